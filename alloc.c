@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "alloc.h"
+
+// objects made by one malloc
+#define SLAB_CHUNK 64
+// a thread keeps this many free objects at most
+#define SLAB_KEEP 1024
+#define ALIGN 16
+
+static size_t align_up(size_t size)
+{
+    return (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+}
+
+struct slab_object
+{
+    struct slab_object* next;
+};
+
+struct slab_cache
+{
+    struct slab_object* head;
+    uint32_t count;
+};
+
+static _Thread_local struct slab_cache caches[MY_SLABS];
+
+/**
+ * The objects given back by the threads.
+ */
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct slab_object* lists[MY_SLABS];
+} depot = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+
+static _Thread_local bool registered = false;
+
+/**
+ * Put all the objects of the cache in the depot.
+ */
+static void give_back(enum my_slab_id id, struct slab_cache* cache)
+{
+    if (cache->head == NULL) return;
+    struct slab_object* tail = cache->head;
+    while (tail->next) tail = tail->next;
+    pthread_mutex_lock(&depot.mutex);
+    tail->next = depot.lists[id];
+    depot.lists[id] = cache->head;
+    pthread_mutex_unlock(&depot.mutex);
+    cache->head = NULL;
+    cache->count = 0;
+}
+
+static void thread_gone(void* p)
+{
+    struct slab_cache* gone = (struct slab_cache*) p;
+    for (uint32_t id = 0; id < MY_SLABS; ++id) give_back(id, &gone[id]);
+}
+
+static void init_key()
+{
+    pthread_key_create(&depot.key, thread_gone);
+}
+
+/**
+ * Fill the empty cache, from the depot if it has
+ * some, or with a new chunk.
+ */
+static void refill(const struct my_slab* slab, struct slab_cache* cache)
+{
+    if (!registered)
+    {
+        // the cache goes to the depot when the thread exits
+        pthread_once(&depot.once, init_key);
+        pthread_setspecific(depot.key, caches);
+        registered = true;
+    }
+    pthread_mutex_lock(&depot.mutex);
+    struct slab_object* o = depot.lists[slab->id];
+    for (uint32_t i = 0; o && i < SLAB_CHUNK; ++i)
+    {
+        depot.lists[slab->id] = o->next;
+        o->next = cache->head;
+        cache->head = o;
+        ++cache->count;
+        o = depot.lists[slab->id];
+    }
+    pthread_mutex_unlock(&depot.mutex);
+    if (cache->head) return;
+
+    size_t size = align_up(slab->size);
+    uint8_t* chunk = (uint8_t*) malloc(size * SLAB_CHUNK);
+    if (chunk == NULL) return;
+    for (uint32_t i = 0; i < SLAB_CHUNK; ++i)
+    {
+        o = (struct slab_object*) (chunk + i * size);
+        o->next = cache->head;
+        cache->head = o;
+    }
+    cache->count = SLAB_CHUNK;
+}
+
+void* my_slab_alloc(const struct my_slab* slab)
+{
+#ifdef MY_FS_NO_SLAB
+    return malloc(slab->size);
+#else
+    struct slab_cache* cache = &caches[slab->id];
+    if (cache->head == NULL) refill(slab, cache);
+    struct slab_object* o = cache->head;
+    if (o == NULL) return NULL;
+    cache->head = o->next;
+    --cache->count;
+    return o;
+#endif
+}
+
+void my_slab_free(const struct my_slab* slab, void* p)
+{
+#ifdef MY_FS_NO_SLAB
+    free(p);
+#else
+    if (p == NULL) return;
+    struct slab_cache* cache = &caches[slab->id];
+    struct slab_object* o = (struct slab_object*) p;
+    o->next = cache->head;
+    cache->head = o;
+    // a thread that frees what others allocate
+    if (++cache->count > SLAB_KEEP) give_back(slab->id, cache);
+#endif
+}
+
+struct my_arena_chunk
+{
+    struct my_arena_chunk* next;
+    size_t size, used;
+    _Alignas(ALIGN) uint8_t data[];
+};
+
+void my_arena_init(struct my_arena* arena, size_t chunk_size)
+{
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+    arena->last = NULL;
+}
+
+void* my_arena_alloc(struct my_arena* arena, size_t size)
+{
+    size = align_up(size ? size : 1);
+    struct my_arena_chunk* chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        size_t bytes = (size > arena->chunk_size) ? size : arena->chunk_size;
+        chunk = (struct my_arena_chunk*) malloc(
+            sizeof(struct my_arena_chunk) + bytes);
+        if (chunk == NULL) return NULL;
+        chunk->size = bytes;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->last = p;
+    return p;
+}
+
+void* my_arena_grow(struct my_arena* arena, void* p, size_t old_size, size_t size)
+{
+    struct my_arena_chunk* chunk = arena->head;
+    if (p && p == arena->last)
+    {
+        size_t at = (uint8_t*) p - chunk->data;
+        if (align_up(size) <= chunk->size - at)
+        {
+            chunk->used = at + align_up(size);
+            return p;
+        }
+    }
+    void* q = my_arena_alloc(arena, size);
+    if (q && p) memcpy(q, p, old_size);
+    return q;
+}
+
+void my_arena_reset(struct my_arena* arena)
+{
+    struct my_arena_chunk* keep = arena->head;
+    if (keep == NULL) return;
+    // the largest is kept, enough for the next time
+    for (struct my_arena_chunk* c = keep->next; c; c = c->next)
+        if (c->size > keep->size) keep = c;
+    for (struct my_arena_chunk* c = arena->head, *next; c; c = next)
+    {
+        next = c->next;
+        if (c != keep) free(c);
+    }
+    keep->next = NULL;
+    keep->used = 0;
+    arena->head = keep;
+    arena->last = NULL;
+}
+
+void my_arena_free(struct my_arena* arena)
+{
+    my_arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
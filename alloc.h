@@ -0,0 +1,78 @@
+#ifndef __H_MY_ALLOC__
+#define __H_MY_ALLOC__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * The objects with a cache of their own.
+ */
+enum my_slab_id
+{
+    MY_SLAB_FILE,
+    MY_SLAB_DIR_LIST,
+    MY_SLAB_CWD_NODE,
+    MY_SLABS
+};
+
+/**
+ * A cache of objects of one size. Every thread keeps
+ * the freed ones for its next allocations, so most
+ * allocations don't reach malloc or a lock. The
+ * objects a thread has too many of, or has when it
+ * exits, are given to the others. The memory isn't
+ * given back to the system, it's the most there ever
+ * was of these objects at once.
+ * Build with `MY_FS_NO_SLAB` for plain malloc and
+ * free, for memory checkers.
+ */
+struct my_slab
+{
+    enum my_slab_id id;
+    size_t size;
+};
+
+#define MY_SLAB(id, type) { (id), sizeof(type) }
+
+void* my_slab_alloc(const struct my_slab* slab);
+void my_slab_free(const struct my_slab* slab, void* p);
+
+struct my_arena_chunk;
+
+/**
+ * Memory for objects that die together, taken in
+ * order from large chunks and released all at once
+ * by `my_arena_reset`. Not for many threads.
+ */
+struct my_arena
+{
+    struct my_arena_chunk* head;
+    // the size of a new chunk at least
+    size_t chunk_size;
+    // the last allocation, it can grow in place
+    void* last;
+};
+
+void my_arena_init(struct my_arena* arena, size_t chunk_size);
+
+/**
+ * Return `size` bytes aligned for any type.
+ */
+void* my_arena_alloc(struct my_arena* arena, size_t size);
+
+/**
+ * Make `p`, of `old_size` bytes, `size` bytes long.
+ * The last allocation grows in place when its chunk
+ * has the room, others are copied.
+ */
+void* my_arena_grow(struct my_arena* arena, void* p, size_t old_size, size_t size);
+
+/**
+ * Release all the allocations, the newest chunk is
+ * kept for the next ones.
+ */
+void my_arena_reset(struct my_arena* arena);
+
+void my_arena_free(struct my_arena* arena);
+
+#endif
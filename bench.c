@@ -0,0 +1,856 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "myfs.h"
+#include "ring.h"
+#include "shared.h"
+#include "extent.h"
+#include "fsck.h"
+#include "scan.h"
+
+#define CHUNK_SIZE 4096
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Many writers patching disjoint parts of the same file.
+ */
+struct contention_args
+{
+    struct my_partition* partition;
+    uint32_t inode;
+    uint32_t start;
+    uint32_t length;
+    uint32_t rounds;
+    // take this lock around every write, NULL for range locks
+    pthread_mutex_t* inode_lock;
+};
+
+static void* contention_writer(void* p)
+{
+    struct contention_args* args = (struct contention_args*) p;
+    struct my_file* file = my_file_open(args->partition, args->inode);
+    uint8_t buffer[CHUNK_SIZE];
+    memset(buffer, 'x', CHUNK_SIZE);
+    for (uint32_t r = 0; r < args->rounds; ++r)
+        for (uint32_t off = 0; off + CHUNK_SIZE <= args->length; off += CHUNK_SIZE)
+        {
+            if (args->inode_lock) pthread_mutex_lock(args->inode_lock);
+            my_file_seek(args->partition, file, args->start + off);
+            my_file_write(args->partition, file, buffer, CHUNK_SIZE);
+            if (args->inode_lock) pthread_mutex_unlock(args->inode_lock);
+        }
+    my_file_close(args->partition, file);
+    return NULL;
+}
+
+static void bench_contention(uint32_t threads)
+{
+    const uint32_t file_size = 64 M, rounds = 8;
+    struct my_partition* partition = my_make_partition(256 M, 0);
+    uint32_t inode = my_touch(partition);
+    my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+
+    // the file exists before the writers start
+    struct my_file* file = my_file_open(partition, inode);
+    uint8_t* buffer = (uint8_t*) calloc(1, CHUNK_SIZE);
+    for (uint32_t i = 0; i < file_size; i += CHUNK_SIZE)
+        my_file_write(partition, file, buffer, CHUNK_SIZE);
+    my_file_close(partition, file);
+    free(buffer);
+
+    pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t* tids = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+    struct contention_args* args = (struct contention_args*) malloc(
+        sizeof(struct contention_args) * threads);
+
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        double begin = now();
+        for (uint32_t i = 0; i < threads; ++i)
+        {
+            args[i] = (struct contention_args) {
+                partition, inode,
+                file_size / threads * i, file_size / threads, rounds,
+                mode ? &inode_lock : NULL };
+            pthread_create(&tids[i], NULL, contention_writer, &args[i]);
+        }
+        for (uint32_t i = 0; i < threads; ++i)
+            pthread_join(tids[i], NULL);
+        double elapsed = now() - begin;
+        uint64_t ops = (uint64_t) file_size / CHUNK_SIZE * rounds;
+        printf("%-12s threads=%u ops/s=%.0f MB/s=%.1f\n",
+            mode ? "inode-lock" : "range-lock", threads,
+            ops / elapsed, (double) file_size * rounds / elapsed / (1 M));
+    }
+
+    free(tids);
+    free(args);
+    my_free_partition(partition);
+}
+
+/**
+ * Small random reads, one call per read against
+ * batches through a ring.
+ */
+static void bench_ring(uint32_t workers)
+{
+    const uint32_t file_size = 16 M, ops = 1 << 20, read_size = 64;
+    const uint32_t depth = 64;
+    struct my_partition* partition = my_make_partition(64 M, 0);
+    uint32_t inode = my_touch(partition);
+    my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+
+    struct my_file* file = my_file_open(partition, inode);
+    uint8_t* buffer = (uint8_t*) calloc(depth, CHUNK_SIZE);
+    for (uint32_t i = 0; i < file_size; i += CHUNK_SIZE)
+        my_file_write(partition, file, buffer, CHUNK_SIZE);
+
+    uint32_t seed = 1;
+    double begin = now();
+    for (uint32_t i = 0; i < ops; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        my_file_seek(partition, file, seed % (file_size - read_size));
+        my_file_read(partition, file, buffer, read_size);
+    }
+    double elapsed = now() - begin;
+    printf("%-12s ops/s=%.0f\n", "sync", ops / elapsed);
+    my_file_close(partition, file);
+
+    struct my_ring* ring = my_ring_create(partition, depth, workers);
+    struct my_cqe cqes[depth];
+    // a slot of the buffer for every read in flight,
+    // given back when it completes
+    uint32_t slots[2 * depth], free_slots = 2 * depth;
+    for (uint32_t i = 0; i < free_slots; ++i) slots[i] = i;
+    uint32_t submitted = 0, completed = 0;
+    begin = now();
+    while (completed < ops)
+    {
+        struct my_sqe* sqe;
+        while (submitted < ops && free_slots && (sqe = my_ring_get_sqe(ring)))
+        {
+            uint32_t slot = slots[--free_slots];
+            seed = seed * 1103515245 + 12345;
+            sqe->opcode = MY_OP_READ;
+            sqe->inode = inode;
+            sqe->offset = seed % (file_size - read_size);
+            sqe->buffer = buffer + slot * read_size;
+            sqe->length = read_size;
+            sqe->user_data = slot;
+            ++submitted;
+        }
+        my_ring_submit(ring);
+        uint32_t n = my_ring_reap(ring, cqes, depth, 1);
+        for (uint32_t i = 0; i < n; ++i) slots[free_slots++] = cqes[i].user_data;
+        completed += n;
+    }
+    elapsed = now() - begin;
+    printf("%-12s workers=%u depth=%u ops/s=%.0f\n",
+        "ring", workers, depth, ops / elapsed);
+    my_ring_destroy(ring);
+
+    free(buffer);
+    my_free_partition(partition);
+}
+
+/**
+ * Random reads from many processes on one shared
+ * partition, the throughput should grow with the
+ * number of processes.
+ */
+static void bench_shared(uint32_t max_procs)
+{
+    const uint32_t file_size = 16 M, ops = 1 << 18, read_size = 4096;
+    char name[64];
+    snprintf(name, sizeof(name), "/myfs-bench-%d", (int) getpid());
+
+    struct my_partition* partition = my_make_shared_partition(name, 64 M, 0);
+    if (partition == NULL)
+    {
+        puts("failed to make shared partition");
+        return;
+    }
+    uint32_t inode = my_touch(partition);
+    my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+    struct my_file* file = my_file_open(partition, inode);
+    uint8_t* buffer = (uint8_t*) calloc(1, CHUNK_SIZE);
+    for (uint32_t i = 0; i < file_size; i += CHUNK_SIZE)
+        my_file_write(partition, file, buffer, CHUNK_SIZE);
+    my_file_close(partition, file);
+
+    for (uint32_t procs = 1; procs <= max_procs; procs *= 2)
+    {
+        double begin = now();
+        for (uint32_t i = 0; i < procs; ++i)
+            if (fork() == 0)
+            {
+                // attach like an unrelated process would
+                struct my_partition* p = my_attach_shared_partition(name);
+                struct my_file* f = my_file_open(p, inode);
+                uint32_t seed = i + 1;
+                for (uint32_t n = 0; n < ops; ++n)
+                {
+                    seed = seed * 1103515245 + 12345;
+                    my_file_seek(p, f, (seed >> 4) % (file_size - read_size));
+                    my_file_read(p, f, buffer, read_size);
+                }
+                my_file_close(p, f);
+                my_detach_shared_partition(p);
+                _exit(0);
+            }
+        while (wait(NULL) > 0);
+        double elapsed = now() - begin;
+        printf("%-12s procs=%u ops/s=%.0f\n", "shared-read", procs,
+            (double) ops * procs / elapsed);
+    }
+
+    free(buffer);
+    my_detach_shared_partition(partition);
+    my_unlink_shared_partition(name);
+}
+
+/**
+ * The same file operations on every block size:
+ * sequential write and read, small random reads,
+ * then erasing the file.
+ */
+static void bench_block_size()
+{
+    const uint32_t file_size = 64 M, io_size = 64 K, read_size = 4096;
+    const uint32_t ops = 1 << 18;
+    const uint32_t block_sizes[] = { 1 K, 4 K, 16 K, 64 K };
+    uint8_t* buffer = (uint8_t*) calloc(1, io_size);
+
+    for (uint32_t b = 0; b < sizeof(block_sizes) / sizeof(uint32_t); ++b)
+    {
+        struct my_partition* partition = my_make_partition(256 M, block_sizes[b]);
+        uint32_t inode = my_touch(partition);
+        my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+        struct my_file* file = my_file_open(partition, inode);
+
+        double begin = now();
+        for (uint32_t i = 0; i < file_size; i += io_size)
+            my_file_write(partition, file, buffer, io_size);
+        double write = now() - begin;
+
+        my_file_seek(partition, file, 0);
+        begin = now();
+        while (my_file_read(partition, file, buffer, io_size));
+        double read = now() - begin;
+
+        uint32_t seed = 1;
+        begin = now();
+        for (uint32_t i = 0; i < ops; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            my_file_seek(partition, file, (seed >> 4) % (file_size - read_size));
+            my_file_read(partition, file, buffer, read_size);
+        }
+        double random = now() - begin;
+        my_file_close(partition, file);
+
+        begin = now();
+        my_erase_file(partition, inode);
+        double erase = now() - begin;
+
+        printf("%-12s block=%-5u write MB/s=%.0f read MB/s=%.0f "
+            "rand-read ops/s=%.0f erase ms=%.2f\n", "block-size",
+            block_sizes[b], file_size / write / (1 M), file_size / read / (1 M),
+            ops / random, erase * 1e3);
+        my_free_partition(partition);
+    }
+    free(buffer);
+}
+
+static void bench_erase()
+{
+    const uint64_t file_sizes[] = { 64 M, 1024 M };
+    const uint32_t io_size = 1 M;
+    uint8_t* buffer = (uint8_t*) calloc(1, io_size);
+
+    for (uint32_t s = 0; s < sizeof(file_sizes) / sizeof(uint64_t); ++s)
+    {
+        struct my_partition* partition = my_make_partition(
+            file_sizes[s] + 64 M, 0);
+        uint32_t inode = my_touch(partition);
+        my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+        struct my_file* file = my_file_open(partition, inode);
+        for (uint64_t i = 0; i < file_sizes[s]; i += io_size)
+            my_file_write(partition, file, buffer, io_size);
+        my_file_close(partition, file);
+        my_block_t used = my_fold_block_used(partition);
+
+        // rm returns, then the space comes back
+        double begin = now();
+        my_dir_unreference_file(partition, partition->root, "f");
+        double rm = now() - begin;
+        my_reap_wait(partition);
+        double reclaim = now() - begin;
+
+        printf("%-12s file MB=%-5llu blocks=%-8llu rm ms=%.2f reclaim ms=%.2f "
+            "freed=%llu\n", "erase", (unsigned long long) (file_sizes[s] / (1 M)),
+            (unsigned long long) used, rm * 1e3, reclaim * 1e3,
+            (unsigned long long) (used - my_fold_block_used(partition)));
+        my_free_partition(partition);
+    }
+    free(buffer);
+}
+
+/**
+ * Files of random sizes written a few at a time and
+ * deleted at random, then see how broken up the
+ * files and the free space are.
+ */
+static void bench_churn(uint32_t rounds)
+{
+    const uint32_t slots = 512, writers = 4, chunk = 16 K;
+    struct my_partition* partition = my_make_partition(512 M, 0);
+    uint32_t inodes[512] = { 0 };
+    uint8_t* buffer = (uint8_t*) calloc(1, chunk);
+    uint32_t seed = 1, live = 0;
+    char name[16];
+
+    double begin = now();
+    for (uint32_t r = 0; r < rounds; ++r)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t s = (seed >> 8) % slots;
+        my_fold_block_used(partition);
+        bool full = partition->block_used > partition->block_count / 10 * 7;
+        if (full || (live && (seed >> 4) % 3 == 0))
+        {
+            // delete the first file from a random slot on
+            for (uint32_t i = 0; i < slots && live; ++i, s = (s + 1) % slots)
+                if (inodes[s])
+                {
+                    snprintf(name, sizeof(name), "c%u", s);
+                    my_dir_unreference_file(partition, partition->root, name);
+                    inodes[s] = 0;
+                    --live;
+                    break;
+                }
+            continue;
+        }
+
+        // a few files written side by side
+        struct my_file* files[4];
+        uint64_t sizes[4];
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < slots && n < writers; ++i, s = (s + 1) % slots)
+            if (inodes[s] == 0)
+            {
+                seed = seed * 1103515245 + 12345;
+                // 4K to 8M, small ones more often
+                sizes[n] = (4 K) << ((seed >> 8) % 12);
+                sizes[n] += (seed >> 4) % sizes[n];
+                inodes[s] = my_touch(partition);
+                snprintf(name, sizeof(name), "c%u", s);
+                my_dir_reference_file(partition, partition->root,
+                    inodes[s], MY_TYPE_FILE, name);
+                files[n++] = my_file_open(partition, inodes[s]);
+                ++live;
+            }
+        for (bool more = true; more; )
+        {
+            more = false;
+            for (uint32_t i = 0; i < n; ++i)
+                if (sizes[i])
+                {
+                    uint32_t len = (sizes[i] < chunk) ? sizes[i] : chunk;
+                    my_file_write(partition, files[i], buffer, len);
+                    sizes[i] -= len;
+                    more = true;
+                }
+        }
+        for (uint32_t i = 0; i < n; ++i) my_file_close(partition, files[i]);
+    }
+    double elapsed = now() - begin;
+
+    uint64_t fragments = 0, runs;
+    my_block_t largest;
+    for (uint32_t s = 0; s < slots; ++s)
+        if (inodes[s]) fragments += my_file_fragments(partition, inodes[s]);
+    my_extent_stats(partition, &runs, &largest);
+    my_fold_block_used(partition);
+    printf("%-12s rounds=%u files=%u fragments/file=%.2f free runs=%llu "
+        "largest free MB=%.1f used=%.0f%% s=%.2f\n", "churn", rounds, live,
+        live ? (double) fragments / live : 0, (unsigned long long) runs,
+        (double) largest * partition->block_size / (1 M),
+        100.0 * partition->block_used / partition->block_count, elapsed);
+
+    // then put the pieces together
+    uint32_t cursor = 0;
+    begin = now();
+    uint32_t moved = my_defrag(partition, &cursor, 0, NULL, NULL);
+    elapsed = now() - begin;
+    fragments = 0;
+    for (uint32_t s = 0; s < slots; ++s)
+        if (inodes[s]) fragments += my_file_fragments(partition, inodes[s]);
+    printf("%-12s moved=%u fragments/file=%.2f s=%.2f\n", "defrag", moved,
+        live ? (double) fragments / live : 0, elapsed);
+    free(buffer);
+    my_free_partition(partition);
+}
+
+/**
+ * Files made in many directories side by side, then
+ * read a directory at a time. `my_touch` takes the
+ * lowest free inode, `my_touch_in` places them.
+ */
+static void bench_locality()
+{
+    const uint32_t dirs = 16, files = 64, rounds = 20;
+    uint32_t d[16], f[16][64];
+    uint8_t* buffer = (uint8_t*) calloc(1, 32 K);
+    char name[16];
+
+    for (uint32_t placed = 0; placed < 2; ++placed)
+    {
+        struct my_partition* partition = my_make_partition(256 M, 0);
+        uint32_t seed = 1;
+        for (uint32_t i = 0; i < dirs; ++i)
+        {
+            d[i] = placed ? my_touch_in(partition, partition->root, MY_TYPE_DIR) :
+                my_touch(partition);
+            snprintf(name, sizeof(name), "d%u", i);
+            my_dir_reference_file(partition, partition->root, d[i], MY_TYPE_DIR, name);
+        }
+        for (uint32_t j = 0; j < files; ++j)
+            for (uint32_t i = 0; i < dirs; ++i)
+            {
+                f[i][j] = placed ? my_touch_in(partition, d[i], MY_TYPE_FILE) :
+                    my_touch(partition);
+                snprintf(name, sizeof(name), "f%u", j);
+                my_dir_reference_file(partition, d[i], f[i][j], MY_TYPE_FILE, name);
+                seed = seed * 1103515245 + 12345;
+                struct my_file* file = my_file_open(partition, f[i][j]);
+                my_file_write(partition, file, buffer, 4 K + (seed >> 8) % (28 K));
+                my_file_close(partition, file);
+            }
+
+        // how far apart the inodes and the data of a
+        // directory are
+        double inode_span = 0, data_span = 0;
+        for (uint32_t i = 0; i < dirs; ++i)
+        {
+            uint32_t lo = f[i][0], hi = f[i][0];
+            my_block_t first = -1, last = 0;
+            for (uint32_t j = 0; j < files; ++j)
+            {
+                my_block_t b = my_get_inode_pointer(partition, f[i][j])->direct_block[0];
+                if (f[i][j] < lo) lo = f[i][j];
+                if (f[i][j] > hi) hi = f[i][j];
+                if (b < first) first = b;
+                if (b > last) last = b;
+            }
+            inode_span += (double) (hi - lo) * partition->inode_size / dirs;
+            data_span += (double) (last - first) * partition->block_size / dirs;
+        }
+
+        uint64_t bytes = 0;
+        double begin = now();
+        for (uint32_t r = 0; r < rounds; ++r)
+            for (uint32_t i = 0; i < dirs; ++i)
+            {
+                struct my_dir_list* list = my_ls_dir(partition, d[i]);
+                for (struct my_dir_list* e = list; e; e = e->next)
+                {
+                    struct my_file* file = my_file_open(partition, e->inode);
+                    uint32_t len;
+                    while ((len = my_file_read(partition, file, buffer, 32 K)))
+                        bytes += len;
+                    my_file_close(partition, file);
+                }
+                my_free_dir_list(partition, list);
+            }
+        double elapsed = now() - begin;
+        printf("%-12s %-6s inode span KB/dir=%.1f data span MB/dir=%.2f "
+            "walk MB/s=%.0f\n", "locality", placed ? "placed" : "lowest",
+            inode_span / (1 K), data_span / (1 M), bytes / elapsed / (1 M));
+        my_free_partition(partition);
+    }
+    free(buffer);
+}
+
+/**
+ * A 2G partition full of files checked with 1 up to
+ * `max_threads` threads.
+ */
+static void bench_fsck(uint32_t max_threads)
+{
+    const uint32_t dirs = 64, files = 256;
+    struct my_partition* partition = my_make_partition(2ull G, 0);
+    uint32_t seed = 1;
+    char name[16];
+    for (uint32_t i = 0; i < dirs; ++i)
+    {
+        uint32_t d = my_touch_in(partition, partition->root, MY_TYPE_DIR);
+        snprintf(name, sizeof(name), "d%u", i);
+        my_dir_reference_file(partition, partition->root, d, MY_TYPE_DIR, name);
+        for (uint32_t j = 0; j < files; ++j)
+        {
+            uint32_t f = my_touch_in(partition, d, MY_TYPE_FILE);
+            snprintf(name, sizeof(name), "f%u", j);
+            my_dir_reference_file(partition, d, f, MY_TYPE_FILE, name);
+            seed = seed * 1103515245 + 12345;
+            my_file_reserve(partition, f, (seed >> 8) % (192 K));
+        }
+    }
+
+    struct my_fsck_report report;
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        bool clean = my_fsck(partition, threads, false, &report);
+        printf("%-12s threads=%-3u inodes=%u blocks=%llu GB/s=%.2f ms=%.1f%s\n",
+            "fsck", threads, report.inodes_reachable,
+            (unsigned long long) report.blocks_owned,
+            (double) report.blocks_owned * partition->block_size /
+                report.seconds / (1 G), report.seconds * 1000,
+            clean ? "" : " NOT clean");
+    }
+    my_free_partition(partition);
+}
+
+/**
+ * A directory of 100k entries listed, and a 64M text
+ * file read line by line and scanned for newlines,
+ * with every code the CPU can run.
+ */
+static void bench_scan()
+{
+    const uint32_t entries = 100000, lists = 5;
+    const uint32_t text_size = 64 M, line_size = 512;
+    const char* impls[] = { "avx2", "sse2", "scalar" };
+    struct my_partition* partition = my_make_partition(1ull G, 4 K);
+
+    uint32_t dir = my_touch_in(partition, partition->root, MY_TYPE_DIR);
+    my_dir_reference_file(partition, partition->root, dir, MY_TYPE_DIR, "d");
+    struct my_dir_entry* list = (struct my_dir_entry*)
+        malloc(entries * sizeof(struct my_dir_entry));
+    char* names = (char*) malloc(entries * 32);
+    for (uint32_t i = 0; i < entries; ++i)
+    {
+        snprintf(names + i * 32, 32, "some-longer-file-name-%u", i);
+        list[i].inode = my_touch_in(partition, dir, MY_TYPE_FILE);
+        list[i].type = MY_TYPE_FILE;
+        list[i].filename = names + i * 32;
+    }
+    my_dir_reference_files(partition, dir, list, entries);
+
+    // lines of 1 up to 160 bytes
+    uint32_t text = my_touch_in(partition, partition->root, MY_TYPE_FILE);
+    my_dir_reference_file(partition, partition->root, text, MY_TYPE_FILE, "t");
+    uint8_t* buffer = (uint8_t*) malloc(text_size);
+    uint32_t seed = 1, lines = 0;
+    for (uint32_t at = 0; at < text_size; ++lines)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t len = 1 + (seed >> 8) % 160;
+        if (len > text_size - at) len = text_size - at;
+        memset(buffer + at, 'x', len - 1);
+        buffer[at + len - 1] = '\n';
+        at += len;
+    }
+    struct my_file* file = my_file_open(partition, text);
+    my_file_write(partition, file, buffer, text_size);
+    my_file_close(partition, file);
+
+    const char* initial = my_scan_impl();
+    for (uint32_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k)
+    {
+        if (!my_scan_use(impls[k])) continue;
+        double best[3] = { 1e9, 1e9, 1e9 };
+        for (uint32_t r = 0; r < 3; ++r)
+        {
+            double t, begin = now();
+            for (uint32_t i = 0; i < lists; ++i)
+                my_free_dir_list(partition, my_ls_dir(partition, dir));
+            if ((t = now() - begin) < best[0]) best[0] = t;
+
+            uint32_t read = 0;
+            file = my_file_open(partition, text);
+            begin = now();
+            while (my_file_read_line(partition, file, buffer, line_size)) ++read;
+            if ((t = now() - begin) < best[1]) best[1] = t;
+            my_file_close(partition, file);
+            if (read != lines) abort();
+
+            // the same bytes, scanned in memory
+            file = my_file_open(partition, text);
+            my_file_read(partition, file, buffer, text_size);
+            my_file_close(partition, file);
+            read = 0;
+            begin = now();
+            for (const uint8_t* p = buffer, *end = buffer + text_size;
+                (p = my_scan_byte(p, end, '\n')) < end; ++p) ++read;
+            if ((t = now() - begin) < best[2]) best[2] = t;
+            if (read != lines) abort();
+        }
+        printf("%-12s %-6s entries/s=%.0f lines/s=%.0f scan GB/s=%.2f\n",
+            "scan", impls[k], entries * lists / best[0], lines / best[1],
+            text_size / best[2] / (1 G));
+    }
+    my_scan_use(initial);
+    free(buffer);
+    free(names);
+    free(list);
+    my_free_partition(partition);
+}
+
+/**
+ * The microbenchmarks, every one run `repeats` times
+ * and the best kept. They print one JSON document so
+ * runs can be compared with each other.
+ */
+struct micro
+{
+    uint32_t repeats;
+    uint32_t count;
+};
+
+static void micro_result(
+    struct micro* m, const char* name, const char* params,
+    uint64_t ops, uint64_t bytes, double seconds)
+{
+    printf("%s\n    {\"name\": \"%s\", \"params\": \"%s\", \"ops\": %llu, "
+        "\"seconds\": %.6f, \"ns_per_op\": %.1f, \"ops_per_s\": %.0f",
+        m->count++ ? "," : "", name, params, (unsigned long long) ops,
+        seconds, seconds * 1e9 / ops, ops / seconds);
+    if (bytes) printf(", \"mb_per_s\": %.1f", bytes / seconds / (1 M));
+    printf("}");
+}
+
+static void micro_alloc(struct micro* m)
+{
+    const uint32_t ops = 1 << 16;
+    double best = 1e9;
+    for (uint32_t r = 0; r < m->repeats; ++r)
+    {
+        struct my_partition* partition = my_make_partition(256 M, 1 K);
+        double begin = now();
+        for (uint32_t i = 0; i < ops; ++i)
+            my_mark_block_used(partition, my_get_free_block(partition));
+        double elapsed = now() - begin;
+        if (elapsed < best) best = elapsed;
+        my_free_partition(partition);
+    }
+    micro_result(m, "get_free_block", "block=1K", ops, 0, best);
+}
+
+static void micro_io(struct micro* m)
+{
+    const uint32_t file_size = 64 M, ops = 1 << 16;
+    const uint32_t io_sizes[] = { 4 K, 64 K };
+    uint8_t* buffer = (uint8_t*) calloc(1, 64 K);
+    char params[32];
+
+    for (uint32_t s = 0; s < sizeof(io_sizes) / sizeof(uint32_t); ++s)
+    {
+        const uint32_t io = io_sizes[s];
+        double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+        for (uint32_t r = 0; r < m->repeats; ++r)
+        {
+            struct my_partition* partition = my_make_partition(256 M, 4 K);
+            uint32_t inode = my_touch(partition);
+            my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+            struct my_file* file = my_file_open(partition, inode);
+            double t[4], begin = now();
+            for (uint32_t i = 0; i < file_size; i += io)
+                my_file_write(partition, file, buffer, io);
+            my_file_flush(partition, file);
+            t[0] = now() - begin;
+
+            my_file_seek(partition, file, 0);
+            begin = now();
+            while (my_file_read(partition, file, buffer, io));
+            t[1] = now() - begin;
+
+            uint32_t seed = 1;
+            begin = now();
+            for (uint32_t i = 0; i < ops; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                my_file_seek(partition, file, (seed >> 4) % (file_size / io) * io);
+                my_file_write(partition, file, buffer, io);
+            }
+            my_file_flush(partition, file);
+            t[2] = now() - begin;
+
+            seed = 1;
+            begin = now();
+            for (uint32_t i = 0; i < ops; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                my_file_seek(partition, file, (seed >> 4) % (file_size / io) * io);
+                my_file_read(partition, file, buffer, io);
+            }
+            t[3] = now() - begin;
+            for (uint32_t k = 0; k < 4; ++k) if (t[k] < best[k]) best[k] = t[k];
+            my_file_close(partition, file);
+            my_free_partition(partition);
+        }
+        snprintf(params, sizeof(params), "io=%uK", io / (1 K));
+        micro_result(m, "seq_write", params, file_size / io, file_size, best[0]);
+        micro_result(m, "seq_read", params, file_size / io, file_size, best[1]);
+        micro_result(m, "rand_write", params, ops, (uint64_t) ops * io, best[2]);
+        micro_result(m, "rand_read", params, ops, (uint64_t) ops * io, best[3]);
+    }
+    free(buffer);
+}
+
+static void micro_dir(struct micro* m)
+{
+    const uint32_t sizes[] = { 16, 256, 4096 };
+    const uint32_t lookups = 1 << 12;
+    char name[32], params[32];
+
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(uint32_t); ++s)
+    {
+        const uint32_t n = sizes[s];
+        double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+        uint32_t lists = 1 + (1 << 16) / n;
+        for (uint32_t r = 0; r < m->repeats; ++r)
+        {
+            struct my_partition* partition = my_make_partition(256 M, 4 K);
+            uint32_t dir = my_touch_in(partition, partition->root, MY_TYPE_DIR);
+            my_dir_reference_file(partition, partition->root, dir, MY_TYPE_DIR, "d");
+
+            double t[4], begin = now();
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                uint32_t inode = my_touch_in(partition, dir, MY_TYPE_FILE);
+                snprintf(name, sizeof(name), "file-%u", i);
+                my_dir_reference_file(partition, dir, inode, MY_TYPE_FILE, name);
+            }
+            t[0] = now() - begin;
+
+            begin = now();
+            for (uint32_t i = 0; i < lists; ++i)
+                my_free_dir_list(partition, my_ls_dir(partition, dir));
+            t[1] = now() - begin;
+
+            struct my_dir_list* list = my_ls_dir(partition, dir);
+            uint32_t seed = 1;
+            begin = now();
+            for (uint32_t i = 0; i < lookups; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                snprintf(name, sizeof(name), "file-%u", (seed >> 8) % n);
+                if (!my_get_file(partition, list, name)) abort();
+            }
+            t[2] = now() - begin;
+            my_free_dir_list(partition, list);
+
+            begin = now();
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                snprintf(name, sizeof(name), "file-%u", i);
+                my_dir_unreference_file(partition, dir, name);
+            }
+            t[3] = now() - begin;
+            for (uint32_t k = 0; k < 4; ++k) if (t[k] < best[k]) best[k] = t[k];
+            my_free_partition(partition);
+        }
+        snprintf(params, sizeof(params), "entries=%u", n);
+        micro_result(m, "create", params, n, 0, best[0]);
+        micro_result(m, "ls_dir", params, lists, 0, best[1]);
+        micro_result(m, "get_file", params, lookups, 0, best[2]);
+        micro_result(m, "unlink", params, n, 0, best[3]);
+    }
+}
+
+static void micro_dump(struct micro* m)
+{
+    const uint64_t size = 256 M;
+    double best[2] = { 1e9, 1e9 };
+    uint8_t* buffer = (uint8_t*) calloc(1, 1 M);
+    memset(buffer, 0x5a, 1 M);
+    for (uint32_t r = 0; r < m->repeats; ++r)
+    {
+        struct my_partition* partition = my_make_partition(size, 4 K);
+        uint32_t inode = my_touch(partition);
+        my_dir_reference_file(partition, partition->root, inode, MY_TYPE_FILE, "f");
+        struct my_file* file = my_file_open(partition, inode);
+        for (uint32_t i = 0; i < 64; ++i)
+            my_file_write(partition, file, buffer, 1 M);
+        my_file_close(partition, file);
+
+        FILE* tmp = tmpfile();
+        if (!tmp) abort();
+        double begin = now();
+        my_dump_partition_to_file(partition, tmp);
+        fflush(tmp);
+        double dump = now() - begin;
+        my_free_partition(partition);
+
+        rewind(tmp);
+        begin = now();
+        partition = my_load_partition_from_file(tmp);
+        double load = now() - begin;
+        fclose(tmp);
+        if (!partition) abort();
+        my_free_partition(partition);
+        if (dump < best[0]) best[0] = dump;
+        if (load < best[1]) best[1] = load;
+    }
+    micro_result(m, "dump", "size=256M", 1, size, best[0]);
+    micro_result(m, "load", "size=256M", 1, size, best[1]);
+    free(buffer);
+}
+
+static void bench_micro(uint32_t repeats)
+{
+    struct micro m = { repeats ? repeats : 1, 0 };
+    printf("{\"bench\": \"micro\", \"repeats\": %u, \"results\": [", m.repeats);
+    micro_alloc(&m);
+    micro_io(&m);
+    micro_dir(&m);
+    micro_dump(&m);
+    printf("\n]}\n");
+}
+
+int main(int argc, char const *argv[])
+{
+    const char* name = (argc > 1) ? argv[1] : "all";
+    uint32_t threads = (argc > 2) ? atoi(argv[2]) : 4;
+    if (threads == 0) threads = 1;
+
+    if (!strcmp(name, "all") || !strcmp(name, "contention"))
+        bench_contention(threads);
+    if (!strcmp(name, "all") || !strcmp(name, "ring"))
+        bench_ring(threads);
+    if (!strcmp(name, "all") || !strcmp(name, "shared"))
+        bench_shared(threads);
+    if (!strcmp(name, "all") || !strcmp(name, "block-size"))
+        bench_block_size();
+    if (!strcmp(name, "all") || !strcmp(name, "erase"))
+        bench_erase();
+    if (!strcmp(name, "all") || !strcmp(name, "locality"))
+        bench_locality();
+    if (!strcmp(name, "all") || !strcmp(name, "churn"))
+        bench_churn((argc > 2) ? atoi(argv[2]) : 10000);
+    if (!strcmp(name, "all") || !strcmp(name, "fsck"))
+        bench_fsck(threads);
+    if (!strcmp(name, "all") || !strcmp(name, "scan"))
+        bench_scan();
+    // JSON, not part of "all"
+    if (!strcmp(name, "micro"))
+        bench_micro((argc > 2) ? atoi(argv[2]) : 5);
+    return 0;
+}
@@ -3,12 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "utils.h"
 #include "myfs.h"
 #include "cmds.h"
+#include "extent.h"
+#include "fsck.h"
+#include "stats.h"
+#include "trace.h"
+#include "import.h"
+#include "tar.h"
+#include "scan.h"
+#include "lock.h"
 
 #define FILE_BUFFER_SIZE 4096
+// `cat -n` reads this much at a time
+#define CAT_BUFFER_SIZE (64 * 1024)
+// `get` writes this much with a writev
+#define GET_CHUNK_SIZE (64 * 1024 * 1024)
+#define GET_IOVECS 1024
 
 const char* cmds[] = {
     "cd",
@@ -22,6 +37,13 @@ const char* cmds[] = {
     "help",
     "dump",
     "status",
+    "truncate",
+    "defrag",
+    "fsck",
+    "stats",
+    "trace",
+    "tar-in",
+    "tar-out",
 };
 
 const void (*cmd_ptrs[])(struct cwd*, struct cmd_args*) = {
@@ -36,6 +58,13 @@ const void (*cmd_ptrs[])(struct cwd*, struct cmd_args*) = {
     cmd_help,
     cmd_dump,
     cmd_status,
+    cmd_truncate,
+    cmd_defrag,
+    cmd_fsck,
+    cmd_stats,
+    cmd_trace,
+    cmd_tar_in,
+    cmd_tar_out,
 };
 
 static struct cwd_node* get_cwd(struct cwd* cwd)
@@ -45,11 +74,14 @@ static struct cwd_node* get_cwd(struct cwd* cwd)
     return node;
 }
 
+// cd in and out of directories makes and frees them
+static const struct my_slab cwd_slab = MY_SLAB(MY_SLAB_CWD_NODE, struct cwd_node);
+
 void cwd_append(struct cwd* cwd, char* dir_name, uint32_t inode)
 {
-    struct cwd_node* new = (struct cwd_node*) malloc(sizeof(struct cwd_node));
-    new->dir_name = (char*) malloc(sizeof(char) * strlen(dir_name));
-    strcpy(new->dir_name, dir_name);
+    struct cwd_node* new = (struct cwd_node*) my_slab_alloc(&cwd_slab);
+    strncpy(new->dir_name, dir_name, sizeof(new->dir_name) - 1);
+    new->dir_name[sizeof(new->dir_name) - 1] = '\0';
     new->inode = inode;
     new->next = NULL;
     if (cwd->next == NULL) cwd->next = new;
@@ -62,14 +94,31 @@ void cwd_free(struct cwd* cwd)
     while (node)
     {
         next = node->next;
-        free(node->dir_name);
-        free(node);
+        my_slab_free(&cwd_slab, node);
         node = next;
     }
     cwd->next = NULL;
 }
 
-struct cmd_args* get_args_from_stdin()
+/**
+ * `strappend` in the arena, the last string grows in
+ * place.
+ */
+static char* arena_append(
+    struct my_arena* arena, char* str, uint32_t* len, uint32_t* size, char ch)
+{
+    if (*len + 1 >= *size)
+    {
+        uint32_t grown = *size ? *size * 2 : 16;
+        str = (char*) my_arena_grow(arena, str, *size, grown);
+        *size = grown;
+    }
+    str[(*len)++] = ch;
+    str[*len] = '\0';
+    return str;
+}
+
+struct cmd_args* get_args_from_stdin(struct my_arena* arena)
 {
     char ch, quote = '\0';
     struct cmd_args *head = NULL, *node = NULL;
@@ -129,11 +178,11 @@ struct cmd_args* get_args_from_stdin()
             default:
             default_:
                 if (head == NULL)
-                    head = node = (struct cmd_args*) malloc(
-                        sizeof(struct cmd_args));
+                    head = node = (struct cmd_args*) my_arena_alloc(
+                        arena, sizeof(struct cmd_args));
                 else if (!in_arg)
-                    node = node->next = (struct cmd_args*) malloc(
-                        sizeof(struct cmd_args));
+                    node = node->next = (struct cmd_args*) my_arena_alloc(
+                        arena, sizeof(struct cmd_args));
                 if (!in_arg)
                 {
                     len = size = 0;
@@ -141,27 +190,175 @@ struct cmd_args* get_args_from_stdin()
                     node->next = NULL;
                     in_arg = true;
                 }
-                if (ch != '\0') node->arg = strappend(node->arg, &len, &size, ch);
+                if (ch != '\0')
+                    node->arg = arena_append(arena, node->arg, &len, &size, ch);
         }
     }
     if (head == NULL && ch != EOF)
     {
-        head = (struct cmd_args*) malloc(sizeof(struct cmd_args));
+        head = (struct cmd_args*) my_arena_alloc(arena, sizeof(struct cmd_args));
         head->arg = NULL;
         head->next = NULL;
     }
     return head;
 }
 
-void free_args(struct cmd_args* args)
+/**
+ * Scripts are read a chunk at a time, the size of
+ * the first chunk.
+ */
+#define SCRIPT_CHUNK (64 * 1024)
+
+struct cmd_reader
+{
+    FILE* file;
+    char* buffer;
+    // the bytes not read yet are [start, end)
+    uint32_t size, start, end;
+    bool eof;
+    // the args of the last command, reused
+    struct cmd_args* nodes;
+    uint32_t node_count, node_size;
+};
+
+/**
+ * Find the newline ending the command at `start`,
+ * not quoted nor escaped. Return `end` if it's not
+ * in the buffer yet.
+ */
+static uint32_t command_end(struct cmd_reader* reader)
+{
+    char quote = '\0';
+    for (uint32_t i = reader->start; i < reader->end; ++i)
+    {
+        char ch = reader->buffer[i];
+        if (ch == '\\' && quote != '\'')
+        {
+            if (++i == reader->end) break;
+        }
+        else if (quote)
+        {
+            if (ch == quote) quote = '\0';
+        }
+        else if (ch == '\'' || ch == '"') quote = ch;
+        else if (ch == '\n' || ch == '\r') return i;
+    }
+    return reader->end;
+}
+
+/**
+ * Move the bytes not read yet to the front and read
+ * more after them, the buffer grows if a command
+ * doesn't fit. Return false at the end of the file.
+ */
+static bool refill(struct cmd_reader* reader)
+{
+    if (reader->eof) return false;
+    if (reader->start)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start,
+            reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->size)
+    {
+        // one more byte for the '\0' of the last arg
+        reader->size *= 2;
+        reader->buffer = (char*) realloc(reader->buffer, reader->size + 1);
+    }
+    size_t len = fread(reader->buffer + reader->end, 1,
+        reader->size - reader->end, reader->file);
+    if (len == 0) reader->eof = true;
+    reader->end += len;
+    return len > 0;
+}
+
+static void start_arg(struct cmd_reader* reader, char* arg)
+{
+    if (reader->node_count == reader->node_size)
+    {
+        reader->node_size *= 2;
+        reader->nodes = (struct cmd_args*) realloc(reader->nodes,
+            sizeof(struct cmd_args) * reader->node_size);
+    }
+    reader->nodes[reader->node_count++].arg = arg;
+}
+
+/**
+ * Split the command [start, end) into args in place,
+ * the same way `get_args_from_stdin` does. An arg is
+ * never longer than its text, so it's written over
+ * it. Return NULL for an empty line.
+ */
+static struct cmd_args* tokenize(
+    struct cmd_reader* reader, uint32_t start, uint32_t end)
 {
-    struct cmd_args* next;
-    while (args)
+    char* buffer = reader->buffer;
+    char quote = '\0';
+    bool in_arg = false;
+    uint32_t w = start;
+    reader->node_count = 0;
+    for (uint32_t i = start; i < end; ++i)
     {
-        next = args->next;
-        free(args->arg);
-        free(args);
-        args = next;
+        char ch = buffer[i];
+        if (ch == '\\' && quote != '\'')
+        {
+            if (++i == end) break;
+            ch = buffer[i];
+            // the command goes on on the next line
+            if (ch == '\r' || ch == '\n') continue;
+        }
+        else if (quote && ch == quote)
+        {
+            quote = '\0';
+            continue;
+        }
+        else if (!quote && (ch == '\'' || ch == '"'))
+        {
+            // '' is an empty arg
+            if (!in_arg) start_arg(reader, buffer + w);
+            in_arg = true;
+            quote = ch;
+            continue;
+        }
+        else if (!quote && ch == ' ')
+        {
+            if (in_arg) buffer[w++] = '\0';
+            in_arg = false;
+            continue;
+        }
+        if (!in_arg) start_arg(reader, buffer + w);
+        in_arg = true;
+        buffer[w++] = ch;
+    }
+    if (in_arg) buffer[w] = '\0';
+    if (reader->node_count == 0) return NULL;
+    for (uint32_t i = 0; i < reader->node_count; ++i)
+        reader->nodes[i].next = (i + 1 < reader->node_count) ?
+            &reader->nodes[i + 1] : NULL;
+    return reader->nodes;
+}
+
+/**
+ * The next command of the script, NULL at the end.
+ * The args live in the buffer of the reader until
+ * the next call.
+ */
+static struct cmd_args* read_command(struct cmd_reader* reader)
+{
+    for (;;)
+    {
+        uint32_t end = command_end(reader);
+        if (end == reader->end && !reader->eof)
+        {
+            refill(reader);
+            continue;
+        }
+        if (reader->start == reader->end) return NULL;
+        struct cmd_args* args = tokenize(reader, reader->start, end);
+        reader->start = (end < reader->end) ? end + 1 : end;
+        if (args) return args;
     }
 }
 
@@ -184,9 +381,42 @@ void print_dir(struct cwd* cwd)
     free(buffer);
 }
 
-int my_sh(struct my_partition* partition)
+static void run_command(struct cwd* cwd, struct cmd_args* args)
 {
     const int num_of_cmds = sizeof(cmds) / sizeof(char**);
+    bool found = false;
+    for (int i = 0; i < num_of_cmds; ++i)
+        if (strcmp(args->arg, cmds[i]) == 0)
+        {
+            found = true;
+            cmd_ptrs[i](cwd, args);
+        }
+    if (!found)
+        printf("command '%s' not found\ntry 'help'?\n", args->arg);
+}
+
+int my_sh_batch(struct my_partition* partition, FILE* script)
+{
+    struct cwd cwd = { partition, NULL };
+    struct cmd_reader reader = { script };
+    reader.size = SCRIPT_CHUNK;
+    reader.buffer = (char*) malloc(reader.size + 1);
+    reader.node_size = 16;
+    reader.nodes = (struct cmd_args*) malloc(
+        sizeof(struct cmd_args) * reader.node_size);
+
+    struct cmd_args* args;
+    while ((args = read_command(&reader)))
+        if (strlen(args->arg) > 0) run_command(&cwd, args);
+
+    cwd_free(&cwd);
+    free(reader.nodes);
+    free(reader.buffer);
+    return 0;
+}
+
+int my_sh(struct my_partition* partition)
+{
     bool cont = true;
     struct cmd_args* args;
     struct cwd* cwd = (struct cwd*) malloc(sizeof(struct cwd));
@@ -217,29 +447,22 @@ int my_sh(struct my_partition* partition)
         "  |  |  |  |  |  |  |  |  |  |  |  |  |  |  |");
     cmd_help(NULL, NULL);
 
+    // what a command reads lives until the next one
+    struct my_arena arena;
+    my_arena_init(&arena, 4096);
     while (cont)
     {
         print_dir(cwd);
         printf(" $ ");
-        args = get_args_from_stdin();
+        args = get_args_from_stdin(&arena);
 
         if (args == NULL) break;
 
-        if (strlen(args->arg) > 0)
-        {
-            bool found = false;
-            for (int i = 0; i < num_of_cmds; ++i)
-                if (strcmp(args->arg, cmds[i]) == 0)
-                {
-                    found = true;
-                    cmd_ptrs[i](cwd, args);
-                }
-            if (!found)
-                printf("command '%s' not found\ntry 'help'?\n", args->arg);
-        }
+        if (args->arg && strlen(args->arg) > 0) run_command(cwd, args);
 
-        free_args(args);
+        my_arena_reset(&arena);
     }
+    my_arena_free(&arena);
 
     return 0;
 }
@@ -263,15 +486,14 @@ void cmd_cd(
         if (node == NULL) return;
         else if (node->next == NULL)
         {
-            free(node->dir_name);
-            free(node);
+            my_slab_free(&cwd_slab, node);
             cwd->next = NULL;
         }
         else
         {
-            while (node->next) node = node->next;
-            free(node->next->dir_name);
-            free(node->next);
+            // the one before the last
+            while (node->next->next) node = node->next;
+            my_slab_free(&cwd_slab, node->next);
             node->next = NULL;
         }
     }
@@ -380,8 +602,8 @@ void cmd_rm(
         puts("file not exist");
     else if (tmp->type == MY_TYPE_DIR)
         printf("%s is a directory\n", args->arg);
-    else
-        my_dir_unreference_file(cwd->partition, dir, args->arg);
+    else if (!my_dir_unreference_file(cwd->partition, dir, args->arg))
+        puts("rm: not enough space to rewrite the directory");
     my_free_dir_list(cwd->partition, list);
 }
 
@@ -416,7 +638,12 @@ void cmd_mkdir(
     uint32_t dir;
     if (cwd->next) dir = get_cwd(cwd)->inode;
     else dir = cwd->partition->root;
-    uint32_t inode = my_touch(cwd->partition);
+    uint32_t inode = my_touch_in(cwd->partition, dir, MY_TYPE_DIR);
+    if (inode == -1)
+    {
+        puts("mkdir: no more inodes");
+        return;
+    }
     if (my_dir_reference_file(cwd->partition, dir, inode, MY_TYPE_DIR, args->arg));
     else
     {
@@ -447,10 +674,13 @@ void cmd_rmdir(
         return;
     }
 
-    uint32_t target = tmp->inode;
-    tmp = my_ls_dir(cwd->partition, target);
-    if (tmp != NULL) puts("directory is not empty");
-    else my_dir_unreference_file(cwd->partition, dir, args->arg);
+    // the check and the unreference hold the directories
+    enum my_unlink result = MY_UNLINK_DONE;
+    if (tmp->type != MY_TYPE_DIR) printf("%s is not a directory\n", args->arg);
+    else result = my_dir_unreference_empty(cwd->partition, dir, args->arg);
+    if (result == MY_UNLINK_NOT_EMPTY) puts("directory is not empty");
+    else if (result == MY_UNLINK_NO_SPACE)
+        puts("rmdir: not enough space to rewrite the directory");
 
     my_free_dir_list(cwd->partition, list);
 }
@@ -459,9 +689,11 @@ void cmd_put(
     struct cwd* cwd,
     struct cmd_args* args)
 {
-    if (args->next == NULL)
+    bool recursive = args->next && !strcmp(args->next->arg, "-r");
+    if (recursive) args = args->next;
+    if (args->next == NULL || !strlen(args->next->arg))
     {
-        puts("usage: put <file from real world> [new name in myfs]");
+        puts("usage: put [-r] <file or directory from real world> [new name in myfs]");
         return;
     }
     args = args->next;
@@ -489,26 +721,55 @@ void cmd_put(
         // sometimes
         filename = args->next->arg;
     }
-    else filename = args->arg;
-    FILE* fp = fopen(args->arg, "rb");
-    if (fp == NULL)
+    else
     {
-        printf("failed to open file '%s'\n", args->arg);
-        return;
+        // the name without the path
+        char* end = args->arg + strlen(args->arg);
+        while (end - 1 > args->arg && end[-1] == '/') *--end = '\0';
+        filename = strrchr(args->arg, '/');
+        filename = (filename && filename[1]) ? filename + 1 : args->arg;
     }
-    uint32_t inode = my_touch(cwd->partition);
     uint32_t dir;
     if (cwd->next) dir = get_cwd(cwd)->inode;
     else dir = cwd->partition->root;
+    if (recursive)
+    {
+        struct my_import_report r;
+        if (!my_import_tree(cwd->partition, dir, args->arg, filename, 0, &r))
+        {
+            printf("put: can't import '%s' as '%s'\n", args->arg, filename);
+            return;
+        }
+        printf("put: %llu files, %llu directories, %.1f MB in %.2fs "
+            "(%.0f files/s, %.1f MB/s)\n",
+            (unsigned long long) r.files, (unsigned long long) r.dirs,
+            r.bytes / (1024.0 * 1024), r.seconds, r.files / r.seconds,
+            r.bytes / (1024.0 * 1024) / r.seconds);
+        if (r.failed || r.skipped)
+            printf("put: %llu failed, %llu skipped\n",
+                (unsigned long long) r.failed, (unsigned long long) r.skipped);
+        return;
+    }
+    int fd = open(args->arg, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("failed to open file '%s'\n", args->arg);
+        return;
+    }
+    uint32_t inode = my_touch_in(cwd->partition, dir, MY_TYPE_FILE);
+    if (inode == -1)
+    {
+        puts("put: no more inodes");
+        close(fd);
+        return;
+    }
 
     if (my_dir_reference_file(cwd->partition, dir, inode, MY_TYPE_FILE, filename))
     {
-        struct my_file* mfp = my_file_open(cwd->partition, inode);
-        uint8_t* buffer = (uint8_t*) malloc(FILE_BUFFER_SIZE);
-        size_t len;
-        while ((len = fread((void*) buffer, sizeof(*buffer), FILE_BUFFER_SIZE, fp)))
-            if (my_file_write(cwd->partition, mfp, buffer, len) == 0) break;
-        my_file_close(cwd->partition, mfp);
+        uint64_t bytes;
+        if (!my_import_file(cwd->partition, inode, fd, &bytes))
+            printf("put: not enough space, %llu bytes copied\n",
+                (unsigned long long) bytes);
     }
     else
     {
@@ -516,7 +777,7 @@ void cmd_put(
         puts("put: already exist");
     }
 
-    fclose(fp);
+    close(fd);
 }
 
 void cmd_get(
@@ -551,27 +812,34 @@ void cmd_get(
     uint32_t inode = tmp->inode;
     my_free_dir_list(cwd->partition, list);
 
-    struct my_file* mfp = my_file_open(cwd->partition, inode);
-    if (mfp == NULL)
-    {
-        puts("failed to read");
-        return;
-    }
-
-    FILE* fp = fopen(filename, "wb");
-    if (fp == NULL)
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
         puts("failed to write");
-        my_file_close(cwd->partition, mfp);
         return;
     }
 
-    uint8_t* buffer = (uint8_t*) malloc(FILE_BUFFER_SIZE);
-    uint32_t len;
-    while ((len = my_file_read(cwd->partition, mfp, buffer, FILE_BUFFER_SIZE)))
-        fwrite(buffer, sizeof(*buffer), len, fp);
-    fclose(fp);
-    my_file_close(cwd->partition, mfp);
+    // the blocks go straight from the partition to
+    // the host file, a chunk at a time
+    struct iovec* iov = (struct iovec*) malloc(sizeof(struct iovec) * GET_IOVECS);
+    uint64_t pos = 0, mapped;
+    do
+    {
+        uint32_t lock = my_range_lock(cwd->partition, inode,
+            pos, pos + GET_CHUNK_SIZE, false);
+        uint32_t n = my_file_map_iov(cwd->partition, inode,
+            pos, GET_CHUNK_SIZE, iov, GET_IOVECS, &mapped);
+        bool ok = my_write_iov(fd, iov, n);
+        my_range_unlock(cwd->partition, inode, lock);
+        if (!ok)
+        {
+            puts("failed to write");
+            break;
+        }
+        pos += mapped;
+    } while (mapped);
+    free(iov);
+    close(fd);
 }
 
 void cmd_cat(
@@ -626,16 +894,25 @@ void cmd_cat(
         else if (tmp->type == MY_TYPE_DIR) puts(cat);
         else
         {
+            // large reads, the lines are found in the buffer
             struct my_file* fp = my_file_open(cwd->partition, tmp->inode);
             uint32_t len, line = 0;
-            uint8_t* buffer = (uint8_t*) malloc(FILE_BUFFER_SIZE);
-            while ((len = my_file_read_line(cwd->partition, fp, buffer, FILE_BUFFER_SIZE - 1)))
+            bool line_start = true;
+            uint8_t* buffer = (uint8_t*) malloc(CAT_BUFFER_SIZE);
+            while ((len = my_file_read(cwd->partition, fp, buffer, CAT_BUFFER_SIZE)))
             {
-                // buffer[len] = '\0';
-                if (buffer[len - 1] == '\n') buffer[len - 1] = '\0';
-                else buffer[len] = '\0';
-                printf("%05d %s\n", line++, buffer);
+                const uint8_t *p = buffer, *end = buffer + len;
+                while (p < end)
+                {
+                    if (line_start) printf("%05d ", line++);
+                    const uint8_t* newline = my_scan_byte(p, end, '\n');
+                    line_start = newline < end;
+                    fwrite(p, 1, newline + line_start - p, stdout);
+                    p = newline + line_start;
+                }
             }
+            if (!line_start) putchar('\n');
+            free(buffer);
             my_file_close(cwd->partition, fp);
         }
         my_free_dir_list(cwd->partition, list);
@@ -659,6 +936,7 @@ void cmd_cat(
                 buffer[len] = '\0';
                 printf("%s", buffer);
             }
+            free(buffer);
             my_file_close(cwd->partition, fp);
         }
         my_free_dir_list(cwd->partition, list);
@@ -681,10 +959,17 @@ void cmd_help(
         "'rm' remove""\n"
         "'mkdir' make directory""\n"
         "'rmdir' remove directory""\n"
-        "'put' put file into this space ship""\n"
+        "'put' put file into this space ship, -r for a whole directory""\n"
         "'get' get file from the Apollo 11""\n"
         "'cat' meow?""\n"
         "'status' show status of this awesome aircraft""\n"
+        "'truncate' cut or grow a file""\n"
+        "'defrag' put the pieces of files together""\n"
+        "'fsck' check this thing is still in one piece""\n"
+        "'stats' where did the time go? (stats json, stats reset)""\n"
+        "'trace' record what happens (trace start, trace stop, trace save <file>)""\n"
+        "'tar-in' unpack a tar archive here, '-' for stdin""\n"
+        "'tar-out' pack this directory or a file in it as a tar archive, '-' for stdout""\n"
         "'help' call 911""\n"
     );
 }
@@ -713,15 +998,283 @@ void cmd_status(
     struct cwd* cwd,
     struct cmd_args* args)
 {
-    printf("partition size:\t%u\n", cwd->partition->size);
+    my_fold_block_used(cwd->partition);
+    printf("partition size:\t%llu\n",
+        (unsigned long long) cwd->partition->size);
     printf("total inodes:\t%u\n", cwd->partition->inode_count);
     printf("used inodes:\t%u\n", cwd->partition->inode_used);
-    printf("total blocks:\t%u\n", cwd->partition->block_count);
-    printf("used blocks:\t%u\n", cwd->partition->block_used);
-    printf("files' blocks:\t%u\n", 
-        cwd->partition->block_used - cwd->partition->blocks);
+    printf("total blocks:\t%llu\n",
+        (unsigned long long) cwd->partition->block_count);
+    printf("used blocks:\t%llu\n",
+        (unsigned long long) cwd->partition->block_used);
+    printf("files' blocks:\t%llu\n", (unsigned long long)
+        (cwd->partition->block_used - cwd->partition->blocks));
     printf("block size:\t%u\n", cwd->partition->block_size);
-    printf("free space:\t%u\n",
+    printf("free space:\t%llu\n", (unsigned long long)
         (cwd->partition->block_count - cwd->partition->block_used)
         * cwd->partition->block_size);
+
+    uint64_t runs;
+    my_block_t largest;
+    my_extent_stats(cwd->partition, &runs, &largest);
+    if (runs) printf("free runs:\t%llu (largest %llu blocks)\n",
+        (unsigned long long) runs, (unsigned long long) largest);
+}
+
+void cmd_truncate(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    args = args->next;
+    if (args == NULL || args->next == NULL ||
+        strlen(args->arg) == 0 || strlen(args->next->arg) == 0)
+    {
+        puts("usage: truncate <file> <size>");
+        return;
+    }
+    char* end;
+    uint64_t size = strtoull(args->next->arg, &end, 10);
+    if (*end)
+    {
+        puts("truncate: bad size");
+        return;
+    }
+
+    uint32_t dir;
+    if (cwd->next) dir = get_cwd(cwd)->inode;
+    else dir = cwd->partition->root;
+    struct my_dir_list* list = my_ls_dir(cwd->partition, dir);
+    struct my_dir_list* tmp = my_get_file(cwd->partition, list, args->arg);
+    if (tmp == NULL)
+        puts("file not exist");
+    else if (tmp->type == MY_TYPE_DIR)
+        printf("%s is a directory\n", args->arg);
+    else
+        my_file_truncate(cwd->partition, tmp->inode, size);
+    my_free_dir_list(cwd->partition, list);
+}
+
+static void print_defrag(
+    uint32_t inode, uint64_t before, uint64_t after, void* arg)
+{
+    printf("inode %u: %llu -> %llu fragments\n", inode,
+        (unsigned long long) before, (unsigned long long) after);
+}
+
+void cmd_defrag(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    // with a time limit, the next run goes on from
+    // where this one stopped
+    static uint32_t cursor = 0;
+    double seconds = 0;
+    args = args->next;
+    if (args && strlen(args->arg) && (seconds = atof(args->arg)) <= 0)
+    {
+        puts("usage: defrag [seconds]");
+        return;
+    }
+    uint32_t moved = my_defrag(cwd->partition, &cursor, seconds,
+        print_defrag, NULL);
+    if (cursor) printf("defrag: %u files moved, not done yet\n", moved);
+    else printf("defrag: %u files moved\n", moved);
+}
+
+void cmd_fsck(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    bool repair = false;
+    uint32_t threads = 0;
+    for (args = args->next; args; args = args->next)
+    {
+        if (!strlen(args->arg)) continue;
+        if (!strcmp(args->arg, "-r")) repair = true;
+        else if ((threads = atoi(args->arg)) == 0)
+        {
+            puts("usage: fsck [-r] [threads]");
+            return;
+        }
+    }
+    struct my_fsck_report r;
+    bool clean = my_fsck(cwd->partition, threads, repair, &r);
+    printf("inodes: %u marked, %u reachable, counter %u\n",
+        r.inodes_marked, r.inodes_reachable, r.inode_used);
+    printf("blocks: %llu marked, %llu owned, counter %llu\n",
+        (unsigned long long) r.blocks_marked,
+        (unsigned long long) r.blocks_owned,
+        (unsigned long long) r.block_used);
+    if (!clean)
+    {
+        printf("zombies %u, lost %u, bad counts %u, bad entries %u\n",
+            r.zombies, r.lost, r.bad_counts, r.bad_entries);
+        printf("leaked %llu, unmarked %llu, doubles %llu, bad pointers %llu\n",
+            (unsigned long long) r.leaked, (unsigned long long) r.unmarked,
+            (unsigned long long) r.doubles, (unsigned long long) r.bad_pointers);
+    }
+    printf("fsck: %s%s in %.3fs\n", clean ? "clean" : "NOT clean",
+        (!clean && repair) ? ", repaired" : "", r.seconds);
+}
+
+void cmd_stats(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    args = args->next;
+    const char* arg = (args && strlen(args->arg)) ? args->arg : "";
+    if (!strcmp(arg, "json"))
+    {
+        my_stats_dump_json(stdout);
+        return;
+    }
+    if (!strcmp(arg, "reset"))
+    {
+        my_stats_reset();
+        return;
+    }
+    if (strlen(arg))
+    {
+        puts("usage: stats [json|reset]");
+        return;
+    }
+    printf("%-8s %10s %12s %10s %10s %10s %10s %10s\n", "op", "count",
+        "MB", "avg us", "p50 us", "p90 us", "p99 us", "max us");
+    for (uint32_t op = 0; op < MY_STAT_OPS; ++op)
+    {
+        struct my_stat_summary s;
+        my_stats_get(op, &s);
+        if (s.count == 0) continue;
+        printf("%-8s %10llu %12.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+            my_stat_name(op), (unsigned long long) s.count,
+            s.bytes / (1024.0 * 1024), s.total_ns / 1e3 / s.count,
+            s.p50_ns / 1e3, s.p90_ns / 1e3, s.p99_ns / 1e3, s.max_ns / 1e3);
+    }
+}
+
+void cmd_trace(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    args = args->next;
+    const char* arg = (args && strlen(args->arg)) ? args->arg : "";
+    if (!strcmp(arg, "start"))
+    {
+        my_trace_start();
+        return;
+    }
+    if (!strcmp(arg, "stop"))
+    {
+        my_trace_stop();
+        return;
+    }
+    if (strcmp(arg, "save") || !args->next || !strlen(args->next->arg))
+    {
+        puts("usage: trace start|stop|save <file>");
+        return;
+    }
+    FILE* file = fopen(args->next->arg, "w");
+    if (file == NULL)
+    {
+        printf("trace: can't open %s\n", args->next->arg);
+        return;
+    }
+    uint64_t events = my_trace_save(file);
+    fclose(file);
+    printf("trace: %llu events saved to %s\n",
+        (unsigned long long) events, args->next->arg);
+}
+
+static void print_tar_report(FILE* out, const char* cmd, struct my_tar_report* r)
+{
+    fprintf(out, "%s: %llu files, %llu directories, %.1f MB in %.2fs "
+        "(%.0f files/s, %.1f MB/s)\n",
+        cmd, (unsigned long long) r->files, (unsigned long long) r->dirs,
+        r->bytes / (1024.0 * 1024), r->seconds, r->files / r->seconds,
+        r->bytes / (1024.0 * 1024) / r->seconds);
+    if (r->failed || r->skipped)
+        fprintf(out, "%s: %llu failed, %llu skipped\n", cmd,
+            (unsigned long long) r->failed, (unsigned long long) r->skipped);
+}
+
+void cmd_tar_in(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    args = args->next;
+    if (args == NULL || strlen(args->arg) == 0)
+    {
+        puts("usage: tar-in <archive or '-'>");
+        return;
+    }
+    int fd = strcmp(args->arg, "-") ? open(args->arg, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+    {
+        printf("tar-in: can't open %s\n", args->arg);
+        return;
+    }
+    uint32_t dir;
+    if (cwd->next) dir = get_cwd(cwd)->inode;
+    else dir = cwd->partition->root;
+
+    struct my_tar_report r;
+    if (!my_tar_in(cwd->partition, dir, fd, &r))
+        puts("tar-in: the archive is cut or broken");
+    print_tar_report(stdout, "tar-in", &r);
+    if (fd != STDIN_FILENO) close(fd);
+}
+
+void cmd_tar_out(
+    struct cwd* cwd,
+    struct cmd_args* args)
+{
+    args = args->next;
+    if (args == NULL || strlen(args->arg) == 0)
+    {
+        puts("usage: tar-out <archive or '-'> [file or directory]");
+        return;
+    }
+    const char* archive = args->arg;
+    uint32_t dir;
+    if (cwd->next) dir = get_cwd(cwd)->inode;
+    else dir = cwd->partition->root;
+
+    // the whole directory, or one thing in it
+    uint32_t inode = dir;
+    uint8_t type = MY_TYPE_DIR;
+    const char* name = "";
+    if (args->next && strlen(args->next->arg))
+    {
+        name = args->next->arg;
+        struct my_dir_list* list = my_ls_dir(cwd->partition, dir);
+        struct my_dir_list* tmp = my_get_file(cwd->partition, list, name);
+        if (tmp)
+        {
+            inode = tmp->inode;
+            type = tmp->type;
+        }
+        my_free_dir_list(cwd->partition, list);
+        if (tmp == NULL)
+        {
+            puts("not exist");
+            return;
+        }
+    }
+
+    // the archive goes to stdout, the talk to stderr
+    bool piped = !strcmp(archive, "-");
+    int fd = STDOUT_FILENO;
+    if (piped) fflush(stdout);
+    else fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE* out = piped ? stderr : stdout;
+    if (fd < 0)
+    {
+        printf("tar-out: can't open %s\n", archive);
+        return;
+    }
+    struct my_tar_report r;
+    if (!my_tar_out(cwd->partition, inode, type, name, fd, &r))
+        fprintf(out, "tar-out: failed to write %s\n", archive);
+    print_tar_report(out, "tar-out", &r);
+    if (!piped) close(fd);
 }
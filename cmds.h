@@ -2,6 +2,7 @@
 #define __H_COMMANDS__
 
 #include "myfs.h"
+#include "alloc.h"
 
 struct cmd_args
 {
@@ -17,7 +18,8 @@ struct cwd
 
 struct cwd_node
 {
-    char* dir_name;
+    // as long as a name of `my_dir_list`
+    char dir_name[512];
     uint32_t inode;
     struct cwd_node* next;
 };
@@ -27,12 +29,22 @@ void cwd_append(
     char* dir_name, uint32_t inode);
 void cwd_free(struct cwd* cwd);
 
-struct cmd_args* get_args_from_stdin();
-void free_args(struct cmd_args* args);
+/**
+ * Read a command from stdin, the args and their
+ * strings are allocated in the arena.
+ */
+struct cmd_args* get_args_from_stdin(struct my_arena* arena);
 
 void print_dir(struct cwd* cwd);
 int my_sh(struct my_partition* partition);
 
+/**
+ * Run the commands of `script` without the banner
+ * and the prompt. The script is read in large chunks
+ * and split in place, for scripts of many commands.
+ */
+int my_sh_batch(struct my_partition* partition, FILE* script);
+
 void cmd_cd(
     struct cwd* cwd,
     struct cmd_args* args);
@@ -66,5 +78,26 @@ void cmd_dump(
 void cmd_status(
     struct cwd* cwd,
     struct cmd_args* args);
+void cmd_truncate(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_defrag(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_fsck(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_stats(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_trace(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_tar_in(
+    struct cwd* cwd,
+    struct cmd_args* args);
+void cmd_tar_out(
+    struct cwd* cwd,
+    struct cmd_args* args);
 
 #endif
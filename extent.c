@@ -0,0 +1,460 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "extent.h"
+
+// max number of partitions with an index at the same time
+#define MY_EXTENT_INDEXES 16
+
+enum { BY_START, BY_SIZE };
+
+/**
+ * A free run, it's a node of both trees.
+ */
+struct my_extent
+{
+    my_block_t start;
+    my_block_t count;
+    // children in the tree by start and by size
+    struct my_extent* child[2][2];
+    int32_t height[2];
+};
+
+struct my_extent_index
+{
+    pthread_mutex_t mutex;
+    struct my_extent* root[2];
+    // nodes to reuse, chained by `child[0][0]`
+    struct my_extent* spare;
+    uint64_t count;
+};
+
+static pthread_mutex_t indexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    _Atomic(struct my_partition*) partition;
+    struct my_extent_index* index;
+} indexes[MY_EXTENT_INDEXES];
+
+/**
+ * Order of the trees, by start or by size then start.
+ * Runs never overlap so the keys are unique.
+ */
+static inline int compare(int t, struct my_extent* a, struct my_extent* b)
+{
+    if (t == BY_SIZE && a->count != b->count)
+        return (a->count < b->count) ? -1 : 1;
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+static inline int32_t height(int t, struct my_extent* n)
+{
+    return n ? n->height[t] : 0;
+}
+
+static inline void update(int t, struct my_extent* n)
+{
+    int32_t l = height(t, n->child[t][0]), r = height(t, n->child[t][1]);
+    n->height[t] = 1 + ((l > r) ? l : r);
+}
+
+/**
+ * Move `n` down to the side `d`, its other child
+ * comes up. Return the new root of the subtree.
+ */
+static struct my_extent* rotate(int t, struct my_extent* n, int d)
+{
+    struct my_extent* c = n->child[t][!d];
+    n->child[t][!d] = c->child[t][d];
+    c->child[t][d] = n;
+    update(t, n);
+    update(t, c);
+    return c;
+}
+
+static struct my_extent* balance(int t, struct my_extent* n)
+{
+    update(t, n);
+    int32_t b = height(t, n->child[t][0]) - height(t, n->child[t][1]);
+    if (b > 1 || b < -1)
+    {
+        int d = (b < 0); // the heavy side
+        struct my_extent* c = n->child[t][d];
+        if (height(t, c->child[t][!d]) > height(t, c->child[t][d]))
+            n->child[t][d] = rotate(t, c, d);
+        n = rotate(t, n, !d);
+    }
+    return n;
+}
+
+static struct my_extent* insert(int t, struct my_extent* root, struct my_extent* n)
+{
+    if (root == NULL)
+    {
+        n->child[t][0] = n->child[t][1] = NULL;
+        n->height[t] = 1;
+        return n;
+    }
+    int d = compare(t, n, root) > 0;
+    root->child[t][d] = insert(t, root->child[t][d], n);
+    return balance(t, root);
+}
+
+static struct my_extent* remove_min(
+    int t, struct my_extent* root, struct my_extent** min)
+{
+    if (root->child[t][0] == NULL)
+    {
+        *min = root;
+        return root->child[t][1];
+    }
+    root->child[t][0] = remove_min(t, root->child[t][0], min);
+    return balance(t, root);
+}
+
+/**
+ * Remove `n`, which is in the tree.
+ */
+static struct my_extent* erase(int t, struct my_extent* root, struct my_extent* n)
+{
+    int c = compare(t, n, root);
+    if (c)
+    {
+        root->child[t][c > 0] = erase(t, root->child[t][c > 0], n);
+        return balance(t, root);
+    }
+    if (root->child[t][1] == NULL) return root->child[t][0];
+    struct my_extent* min;
+    struct my_extent* right = remove_min(t, root->child[t][1], &min);
+    min->child[t][0] = root->child[t][0];
+    min->child[t][1] = right;
+    return balance(t, min);
+}
+
+/**
+ * The last run starting at or before `block`.
+ */
+static struct my_extent* floor_of(struct my_extent_index* index, my_block_t block)
+{
+    struct my_extent *n = index->root[BY_START], *found = NULL;
+    while (n)
+        if (n->start <= block)
+        {
+            found = n;
+            n = n->child[BY_START][1];
+        }
+        else n = n->child[BY_START][0];
+    return found;
+}
+
+/**
+ * The first run starting after `block`.
+ */
+static struct my_extent* ceil_of(struct my_extent_index* index, my_block_t block)
+{
+    struct my_extent *n = index->root[BY_START], *found = NULL;
+    while (n)
+        if (n->start > block)
+        {
+            found = n;
+            n = n->child[BY_START][0];
+        }
+        else n = n->child[BY_START][1];
+    return found;
+}
+
+/**
+ * The smallest run of at least `want` blocks, or the
+ * largest run.
+ */
+static struct my_extent* best_of(struct my_extent_index* index, my_block_t want)
+{
+    struct my_extent *n = index->root[BY_SIZE], *found = NULL;
+    while (n)
+        if (n->count >= want)
+        {
+            found = n;
+            n = n->child[BY_SIZE][0];
+        }
+        else n = n->child[BY_SIZE][1];
+    if (found) return found;
+    for (n = index->root[BY_SIZE]; n && n->child[BY_SIZE][1]; )
+        n = n->child[BY_SIZE][1];
+    return n;
+}
+
+static struct my_extent* nearest(struct my_extent_index* index, my_block_t goal)
+{
+    struct my_extent* before = floor_of(index, goal);
+    if (before && goal - before->start < before->count) return before;
+    struct my_extent* after = ceil_of(index, goal);
+    if (before == NULL || after == NULL) return before ? before : after;
+    return (goal - (before->start + before->count - 1) <= after->start - goal) ?
+        before : after;
+}
+
+static void link_run(
+    struct my_extent_index* index, my_block_t start, my_block_t count)
+{
+    struct my_extent* n = index->spare;
+    if (n) index->spare = n->child[0][0];
+    else if ((n = (struct my_extent*) malloc(sizeof(struct my_extent))) == NULL)
+        return; // the blocks are still free in the bitmap
+    n->start = start;
+    n->count = count;
+    index->root[BY_START] = insert(BY_START, index->root[BY_START], n);
+    index->root[BY_SIZE] = insert(BY_SIZE, index->root[BY_SIZE], n);
+    ++index->count;
+}
+
+static void unlink_run(struct my_extent_index* index, struct my_extent* n)
+{
+    index->root[BY_START] = erase(BY_START, index->root[BY_START], n);
+    index->root[BY_SIZE] = erase(BY_SIZE, index->root[BY_SIZE], n);
+    --index->count;
+    n->child[0][0] = index->spare;
+    index->spare = n;
+}
+
+static void add_run(
+    struct my_extent_index* index, my_block_t start, my_block_t count)
+{
+    my_block_t end = start + count;
+    struct my_extent* n;
+    // swallow the runs touching it
+    while ((n = floor_of(index, end)) && n->start + n->count >= start)
+    {
+        if (n->start < start) start = n->start;
+        if (n->start + n->count > end) end = n->start + n->count;
+        unlink_run(index, n);
+    }
+    link_run(index, start, end - start);
+}
+
+static void take_run(
+    struct my_extent_index* index, my_block_t start, my_block_t count)
+{
+    my_block_t end = start + count;
+    struct my_extent* n;
+    // cut the overlapping runs, keep the parts outside
+    while ((n = floor_of(index, end - 1)) && n->start + n->count > start)
+    {
+        my_block_t from = n->start, to = n->start + n->count;
+        unlink_run(index, n);
+        if (from < start) link_run(index, from, start - from);
+        if (to > end) link_run(index, end, to - end);
+    }
+}
+
+/**
+ * Fill the index with the free runs of the bitmap.
+ */
+static void build(struct my_extent_index* index, struct my_partition* partition)
+{
+    const uint8_t* bitmap = my_get_block_pointer(partition, partition->block_bitmap);
+    const my_block_t count = partition->block_count;
+    my_block_t b = 0, start = 0;
+    bool in_run = false;
+    while (b < count)
+    {
+        if ((b & 63) == 0 && count - b >= 64)
+        {
+            // a whole word of the same bit
+            uint64_t word;
+            memcpy(&word, bitmap + b / 8, sizeof(word));
+            if (word == 0 || word == ~0ull)
+            {
+                if (in_run != (word == 0))
+                {
+                    if (in_run) link_run(index, start, b - start);
+                    else start = b;
+                    in_run = !in_run;
+                }
+                b += 64;
+                continue;
+            }
+        }
+        bool used = bitmap[b / 8] & (0x80 >> (b & 7));
+        if (in_run == used)
+        {
+            if (in_run) link_run(index, start, b - start);
+            else start = b;
+            in_run = !in_run;
+        }
+        ++b;
+    }
+    if (in_run) link_run(index, start, count - start);
+}
+
+/**
+ * Find the index of the partition, build one if
+ * `make` and it doesn't have one yet.
+ */
+static struct my_extent_index* index_of(
+    struct my_partition* partition, bool make)
+{
+    // other processes don't tell us what they free
+    if (partition->flags & MY_PARTITION_SHARED) return NULL;
+
+    // fast path, no lock
+    for (uint32_t i = 0; i < MY_EXTENT_INDEXES; ++i)
+        if (atomic_load_explicit(&indexes[i].partition,
+                memory_order_acquire) == partition)
+            return indexes[i].index;
+    if (!make) return NULL;
+
+    struct my_extent_index* index = NULL;
+    pthread_mutex_lock(&indexes_mutex);
+    for (uint32_t i = 0; i < MY_EXTENT_INDEXES && index == NULL; ++i)
+        if (atomic_load(&indexes[i].partition) == partition)
+            index = indexes[i].index;
+    for (uint32_t i = 0; i < MY_EXTENT_INDEXES && index == NULL; ++i)
+        if (atomic_load(&indexes[i].partition) == NULL &&
+            (index = (struct my_extent_index*) calloc(1,
+                sizeof(struct my_extent_index))))
+        {
+            pthread_mutex_init(&index->mutex, NULL);
+            // published before it's built, so the blocks
+            // changing meanwhile wait for it
+            pthread_mutex_lock(&index->mutex);
+            indexes[i].index = index;
+            atomic_store_explicit(&indexes[i].partition, partition,
+                memory_order_release);
+            pthread_mutex_unlock(&indexes_mutex);
+            build(index, partition);
+            pthread_mutex_unlock(&index->mutex);
+            return index;
+        }
+    pthread_mutex_unlock(&indexes_mutex);
+    return index; // NULL if too many partitions, go without
+}
+
+static inline void fill_run(struct my_extent* n, struct my_free_run* run)
+{
+    run->start = n->start;
+    run->count = n->count;
+}
+
+bool my_extent_best_fit(
+    struct my_partition* partition, my_block_t want, struct my_free_run* run)
+{
+    struct my_extent_index* index = index_of(partition, true);
+    if (index == NULL) return false;
+    pthread_mutex_lock(&index->mutex);
+    struct my_extent* n = best_of(index, want);
+    if (n) fill_run(n, run);
+    pthread_mutex_unlock(&index->mutex);
+    return n != NULL;
+}
+
+bool my_extent_near(
+    struct my_partition* partition, my_block_t goal, struct my_free_run* run)
+{
+    struct my_extent_index* index = index_of(partition, true);
+    if (index == NULL) return false;
+    pthread_mutex_lock(&index->mutex);
+    struct my_extent* n = nearest(index, goal);
+    if (n) fill_run(n, run);
+    pthread_mutex_unlock(&index->mutex);
+    return n != NULL;
+}
+
+my_block_t my_extent_alloc(
+    struct my_partition* partition, my_block_t goal,
+    my_block_t want, my_block_t* got)
+{
+    struct my_extent_index* index = index_of(partition, true);
+    *got = 0;
+    if (index == NULL) return 0;
+
+    pthread_mutex_lock(&index->mutex);
+    struct my_extent* n = goal ? nearest(index, goal) : NULL;
+    my_block_t from = 0;
+    if (n && goal >= n->start && goal - n->start < n->count)
+        from = goal; // right after the file
+    else if (n && n->count >= want)
+        from = n->start; // close to the file
+    else if ((n = best_of(index, want)))
+        from = n->start;
+    if (n)
+    {
+        // a run doesn't cross a group
+        uint64_t limit = ((uint64_t) from / partition->blocks_per_group + 1) *
+            partition->blocks_per_group;
+        uint64_t count = n->start + n->count - from;
+        if (count > limit - from) count = limit - from;
+        if (count > want) count = want;
+        take_run(index, from, count);
+        *got = count;
+    }
+    pthread_mutex_unlock(&index->mutex);
+    return from;
+}
+
+void my_extent_add(
+    struct my_partition* partition, my_block_t start, my_block_t count)
+{
+    struct my_extent_index* index = index_of(partition, false);
+    if (index == NULL || count == 0) return;
+    pthread_mutex_lock(&index->mutex);
+    add_run(index, start, count);
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void my_extent_take(
+    struct my_partition* partition, my_block_t start, my_block_t count)
+{
+    struct my_extent_index* index = index_of(partition, false);
+    if (index == NULL || count == 0) return;
+    pthread_mutex_lock(&index->mutex);
+    take_run(index, start, count);
+    pthread_mutex_unlock(&index->mutex);
+}
+
+void my_extent_stats(
+    struct my_partition* partition, uint64_t* runs, my_block_t* largest)
+{
+    struct my_extent_index* index = index_of(partition, true);
+    *runs = 0;
+    *largest = 0;
+    if (index == NULL) return;
+    pthread_mutex_lock(&index->mutex);
+    struct my_extent* n = best_of(index, (my_block_t) -1);
+    *runs = index->count;
+    if (n) *largest = n->count;
+    pthread_mutex_unlock(&index->mutex);
+}
+
+static void free_tree(struct my_extent* n)
+{
+    if (n == NULL) return;
+    free_tree(n->child[BY_START][0]);
+    free_tree(n->child[BY_START][1]);
+    free(n);
+}
+
+void my_extent_release(struct my_partition* partition)
+{
+    pthread_mutex_lock(&indexes_mutex);
+    for (uint32_t i = 0; i < MY_EXTENT_INDEXES; ++i)
+        if (atomic_load(&indexes[i].partition) == partition)
+        {
+            struct my_extent_index* index = indexes[i].index;
+            atomic_store(&indexes[i].partition, NULL);
+            free_tree(index->root[BY_START]);
+            while (index->spare)
+            {
+                struct my_extent* n = index->spare;
+                index->spare = n->child[0][0];
+                free(n);
+            }
+            pthread_mutex_destroy(&index->mutex);
+            free(index);
+            indexes[i].index = NULL;
+        }
+    pthread_mutex_unlock(&indexes_mutex);
+}
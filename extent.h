@@ -0,0 +1,82 @@
+#ifndef __H_MY_EXTENT__
+#define __H_MY_EXTENT__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "myfs.h"
+
+/**
+ * A run of free blocks [start, start + count).
+ */
+struct my_free_run
+{
+    my_block_t start;
+    my_block_t count;
+};
+
+/**
+ * Find the smallest free run of at least `want`
+ * blocks, or the largest one if none is that long.
+ * Return false if the index knows no free run.
+ *
+ * The index of a partition is built from the block
+ * bitmap on first use and kept in memory, a tree by
+ * start and a tree by size. The bitmap is still the
+ * truth, a run found here may be taken already by
+ * the time it's claimed. Shared partitions have no
+ * index.
+ */
+bool my_extent_best_fit(
+    struct my_partition* partition, my_block_t want, struct my_free_run* run);
+
+/**
+ * Find the free run containing the block `goal`, or
+ * the closest one to it. Return false if the index
+ * knows no free run.
+ */
+bool my_extent_near(
+    struct my_partition* partition, my_block_t goal, struct my_free_run* run);
+
+/**
+ * Take up to `want` blocks out of the index: from
+ * `goal` if it's free, else from the closest run if
+ * it's long enough, else from the best fit. The run
+ * doesn't cross a block group. Return the first block
+ * and put the number of blocks in `got`, `got` is 0
+ * when nothing was taken.
+ *
+ * The caller claims the blocks in the bitmap.
+ */
+my_block_t my_extent_alloc(
+    struct my_partition* partition, my_block_t goal,
+    my_block_t want, my_block_t* got);
+
+/**
+ * Tell the index the blocks [start, start + count)
+ * became free. They're merged with the runs around.
+ */
+void my_extent_add(
+    struct my_partition* partition, my_block_t start, my_block_t count);
+
+/**
+ * Tell the index the blocks [start, start + count)
+ * are used now.
+ */
+void my_extent_take(
+    struct my_partition* partition, my_block_t start, my_block_t count);
+
+/**
+ * Number of free runs and the length of the largest
+ * one, 0 for both if the partition has no index.
+ */
+void my_extent_stats(
+    struct my_partition* partition, uint64_t* runs, my_block_t* largest);
+
+/**
+ * Drop the index of the partition. It's called by
+ * `my_free_partition` and when formatting.
+ */
+void my_extent_release(struct my_partition* partition);
+
+#endif
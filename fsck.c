@@ -0,0 +1,410 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fsck.h"
+#include "extent.h"
+
+// inodes a thread takes at a time
+#define FSCK_SLICE 1024
+
+/**
+ * A block pointer found pointing to a block that's
+ * used already, the subtree gets copied.
+ */
+struct fsck_fix
+{
+    my_block_t* slot;
+    uint32_t level;
+};
+
+struct fsck
+{
+    struct my_partition* partition;
+    bool repair;
+    uint32_t threads;
+
+    // references seen of every inode
+    _Atomic uint32_t* refs;
+    // directories put in the queue already
+    _Atomic uint8_t* queued;
+    // the block bitmap rebuilt, same layout
+    _Atomic uint8_t* owned;
+    uint64_t bitmap_size;
+
+    // directories to list
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t* queue;
+    uint32_t head, tail, busy;
+
+    // next inode to walk, next word to compare
+    _Atomic uint32_t next_inode;
+    _Atomic uint64_t next_word;
+
+    struct fsck_fix* fixes;
+    uint32_t fix_count, fix_size;
+
+    // the counts of the report, updated by all threads
+    _Atomic uint32_t inodes_marked, inodes_reachable, zombies, lost,
+        bad_counts, bad_entries;
+    _Atomic uint64_t blocks_marked, blocks_owned, leaked, unmarked,
+        doubles, bad_pointers;
+};
+
+static inline bool inode_marked(struct my_partition* partition, uint32_t inode)
+{
+    const uint8_t* bitmap = my_get_block_pointer(partition, partition->inode_bitmap);
+    return bitmap[inode / 8] & (0x80 >> (inode & 7));
+}
+
+static void push_dir(struct fsck* ctx, uint32_t dir)
+{
+    // every directory once, even if it's in a loop
+    if (atomic_exchange(&ctx->queued[dir], 1)) return;
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->queue[ctx->tail++] = dir;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * List directories from the queue until it's empty
+ * and nobody can add more.
+ */
+static void walk_dirs(struct fsck* ctx)
+{
+    struct my_partition* partition = ctx->partition;
+    pthread_mutex_lock(&ctx->mutex);
+    for (;;)
+    {
+        while (ctx->head == ctx->tail && ctx->busy)
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        if (ctx->head == ctx->tail) break;
+        uint32_t dir = ctx->queue[ctx->head++];
+        ++ctx->busy;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        struct my_dir_list* list = my_ls_dir(partition, dir);
+        for (struct my_dir_list* e = list; e; e = e->next)
+        {
+            if (e->inode >= partition->inode_count)
+            {
+                atomic_fetch_add(&ctx->bad_entries, 1);
+                continue;
+            }
+            atomic_fetch_add(&ctx->refs[e->inode], 1);
+            if (e->type == MY_TYPE_DIR) push_dir(ctx, e->inode);
+        }
+        my_free_dir_list(partition, list);
+
+        pthread_mutex_lock(&ctx->mutex);
+        if (--ctx->busy == 0 && ctx->head == ctx->tail)
+            pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void add_fix(struct fsck* ctx, my_block_t* slot, uint32_t level)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    if (ctx->fix_count == ctx->fix_size)
+    {
+        ctx->fix_size = ctx->fix_size ? ctx->fix_size * 2 : 64;
+        ctx->fixes = (struct fsck_fix*) realloc(ctx->fixes,
+            sizeof(struct fsck_fix) * ctx->fix_size);
+    }
+    ctx->fixes[ctx->fix_count++] = (struct fsck_fix) { slot, level };
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * Mark the block under `slot` and the blocks it
+ * points to in the rebuilt bitmap.
+ */
+static void walk_blocks(struct fsck* ctx, my_block_t* slot, uint32_t level)
+{
+    struct my_partition* partition = ctx->partition;
+    my_block_t block = *slot;
+    if (block == 0) return;
+    if (block < partition->blocks || block >= partition->block_count)
+    {
+        atomic_fetch_add(&ctx->bad_pointers, 1);
+        if (ctx->repair) *slot = 0;
+        return;
+    }
+    uint8_t bit = 0x80 >> (block & 7);
+    if (atomic_fetch_or(&ctx->owned[block / 8], bit) & bit)
+    {
+        // the first one to get here keeps it, what's
+        // under it is counted already
+        atomic_fetch_add(&ctx->doubles, 1);
+        if (ctx->repair) add_fix(ctx, slot, level);
+        return;
+    }
+    if (level == 0) return;
+    const uint32_t ind = partition->block_size / sizeof(my_block_t);
+    my_block_t* p = (my_block_t*) my_get_block_pointer(partition, block);
+    for (uint32_t i = 0; i < ind; ++i)
+        if (p[i]) walk_blocks(ctx, &p[i], level - 1);
+}
+
+/**
+ * Check the inodes a slice at a time.
+ */
+static void walk_inodes(struct fsck* ctx)
+{
+    struct my_partition* partition = ctx->partition;
+    uint32_t first;
+    while ((first = atomic_fetch_add(&ctx->next_inode, FSCK_SLICE)) <
+        partition->inode_count)
+    {
+        uint32_t last = first + FSCK_SLICE;
+        if (last > partition->inode_count) last = partition->inode_count;
+        uint32_t marked = 0, reachable = 0;
+        for (uint32_t i = first; i < last; ++i)
+        {
+            struct my_inode* inode = my_get_inode_pointer(partition, i);
+            uint32_t refs = atomic_load(&ctx->refs[i]);
+            bool used = inode_marked(partition, i);
+            marked += used;
+            reachable += refs > 0;
+            if (refs == 0)
+            {
+                if (!used) continue;
+                // its blocks are leaked as well
+                atomic_fetch_add(&ctx->zombies, 1);
+                if (ctx->repair) memset(inode, 0, partition->inode_size);
+                continue;
+            }
+            if (!used) atomic_fetch_add(&ctx->lost, 1);
+            if (inode->reference_count != refs)
+            {
+                atomic_fetch_add(&ctx->bad_counts, 1);
+                if (ctx->repair) inode->reference_count = refs;
+            }
+            for (uint32_t b = 0; b < NUM_OF_DIRECT_BLOCKS; ++b)
+                walk_blocks(ctx, &inode->direct_block[b], 0);
+            walk_blocks(ctx, &inode->indirect_block, 1);
+            walk_blocks(ctx, &inode->double_indirect_block, 2);
+            walk_blocks(ctx, &inode->trible_indirect_block, 3);
+        }
+        atomic_fetch_add(&ctx->inodes_marked, marked);
+        atomic_fetch_add(&ctx->inodes_reachable, reachable);
+    }
+}
+
+/**
+ * Compare the block bitmap with the rebuilt one, a
+ * slice of words at a time.
+ */
+static void compare_bitmaps(struct fsck* ctx)
+{
+    struct my_partition* partition = ctx->partition;
+    const uint8_t* bitmap = my_get_block_pointer(partition, partition->block_bitmap);
+    const uint64_t words = ctx->bitmap_size / 8, slice = 4096;
+    uint64_t first;
+    while ((first = atomic_fetch_add(&ctx->next_word, slice)) < words)
+    {
+        uint64_t last = (first + slice < words) ? first + slice : words;
+        uint64_t marked = 0, owned = 0, leaked = 0, unmarked = 0;
+        for (uint64_t w = first; w < last; ++w)
+        {
+            uint64_t old, now;
+            memcpy(&old, bitmap + w * 8, 8);
+            memcpy(&now, (uint8_t*) ctx->owned + w * 8, 8);
+            marked += __builtin_popcountll(old);
+            owned += __builtin_popcountll(now);
+            leaked += __builtin_popcountll(old & ~now);
+            unmarked += __builtin_popcountll(now & ~old);
+        }
+        atomic_fetch_add(&ctx->blocks_marked, marked);
+        atomic_fetch_add(&ctx->blocks_owned, owned);
+        atomic_fetch_add(&ctx->leaked, leaked);
+        atomic_fetch_add(&ctx->unmarked, unmarked);
+    }
+}
+
+static void* run_thread(void* p)
+{
+    struct fsck* ctx = (struct fsck*) p;
+    walk_dirs(ctx);
+    return NULL;
+}
+
+static void* run_inodes(void* p)
+{
+    walk_inodes((struct fsck*) p);
+    return NULL;
+}
+
+static void* run_compare(void* p)
+{
+    compare_bitmaps((struct fsck*) p);
+    return NULL;
+}
+
+/**
+ * Run a phase on all the threads, this one included.
+ */
+static void run_phase(struct fsck* ctx, void* (*phase)(void*))
+{
+    pthread_t* tids = (pthread_t*) malloc(sizeof(pthread_t) * ctx->threads);
+    uint32_t started = 0;
+    for (uint32_t i = 1; i < ctx->threads; ++i)
+        if (pthread_create(&tids[started], NULL, phase, ctx) == 0) ++started;
+    phase(ctx);
+    for (uint32_t i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+/**
+ * Give the block under `slot` and its subtree new
+ * blocks, copies of the shared ones.
+ */
+static void copy_tree(struct my_partition* partition, my_block_t* slot, uint32_t level)
+{
+    my_block_t block = my_alloc_block(partition);
+    if (block == 0)
+    {
+        *slot = 0; // no space, cut it off
+        return;
+    }
+    memcpy(my_get_block_pointer(partition, block),
+        my_get_block_pointer(partition, *slot), partition->block_size);
+    *slot = block;
+    if (level == 0) return;
+    const uint32_t ind = partition->block_size / sizeof(my_block_t);
+    my_block_t* p = (my_block_t*) my_get_block_pointer(partition, block);
+    for (uint32_t i = 0; i < ind; ++i)
+        if (p[i]) copy_tree(partition, &p[i], level - 1);
+}
+
+/**
+ * Write the rebuilt bitmaps and counters over the
+ * ones of the partition, then fix the blocks used
+ * twice.
+ */
+static void repair(struct fsck* ctx)
+{
+    struct my_partition* partition = ctx->partition;
+    const uint32_t bits = partition->blocks_per_group;
+
+    memcpy(my_get_block_pointer(partition, partition->block_bitmap),
+        (uint8_t*) ctx->owned, ctx->bitmap_size);
+    for (uint32_t g = 0; g < partition->group_count; ++g)
+    {
+        const uint8_t* p = (uint8_t*) ctx->owned + (uint64_t) g * bits / 8;
+        uint32_t used = 0;
+        for (uint32_t w = 0; w < bits / 64; ++w)
+        {
+            uint64_t word;
+            memcpy(&word, p + w * 8, 8);
+            used += __builtin_popcountll(word);
+        }
+        struct my_group* group = my_get_group_pointer(partition, g);
+        group->free_blocks = bits - used; // the bits after the last block are set
+        group->hint = 0;
+    }
+    memset(partition->block_used_slots, 0, sizeof(partition->block_used_slots));
+    partition->block_used = atomic_load(&ctx->blocks_owned) -
+        ((uint64_t) partition->group_count * bits - partition->block_count);
+
+    // an inode is used if a directory refers to it
+    uint8_t* inodes = my_get_block_pointer(partition, partition->inode_bitmap);
+    for (uint32_t i = 0; i < partition->inode_count; ++i)
+        if (atomic_load(&ctx->refs[i])) inodes[i / 8] |= 0x80 >> (i & 7);
+        else inodes[i / 8] &= ~(0x80 >> (i & 7));
+    partition->inode_used = atomic_load(&ctx->inodes_reachable);
+
+    // the free runs changed under the index
+    my_extent_release(partition);
+    for (uint32_t i = 0; i < ctx->fix_count; ++i)
+        copy_tree(partition, ctx->fixes[i].slot, ctx->fixes[i].level);
+    my_fold_block_used(partition);
+}
+
+bool my_fsck(
+    struct my_partition* partition, uint32_t threads, bool repair_it,
+    struct my_fsck_report* report)
+{
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    // the files being erased would look leaked
+    my_reap_wait(partition);
+
+    struct fsck* ctx = (struct fsck*) calloc(1, sizeof(struct fsck));
+    if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx->partition = partition;
+    ctx->repair = repair_it;
+    ctx->threads = threads ? threads : 1;
+    ctx->refs = (_Atomic uint32_t*) calloc(
+        partition->inode_count, sizeof(uint32_t));
+    ctx->queued = (_Atomic uint8_t*) calloc(partition->inode_count, 1);
+    ctx->queue = (uint32_t*) malloc(sizeof(uint32_t) * partition->inode_count);
+    ctx->bitmap_size = (uint64_t) partition->group_count *
+        partition->blocks_per_group / 8;
+    ctx->owned = (_Atomic uint8_t*) calloc(ctx->bitmap_size, 1);
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    // the metadata blocks and the bits after the last
+    // block are always used
+    uint8_t* owned = (uint8_t*) ctx->owned;
+    for (my_block_t b = 0; b < partition->blocks; ++b)
+        owned[b / 8] |= 0x80 >> (b & 7);
+    for (uint64_t b = partition->block_count; b < ctx->bitmap_size * 8; ++b)
+        owned[b / 8] |= 0x80 >> (b & 7);
+
+    // the root refers to itself
+    atomic_store(&ctx->refs[partition->root], 1);
+    push_dir(ctx, partition->root);
+    run_phase(ctx, run_thread);
+    run_phase(ctx, run_inodes);
+    run_phase(ctx, run_compare);
+
+    // the bits after the last block aren't blocks
+    uint64_t extra = ctx->bitmap_size * 8 - partition->block_count;
+    memset(report, 0, sizeof(struct my_fsck_report));
+    report->inodes_marked = ctx->inodes_marked;
+    report->inodes_reachable = ctx->inodes_reachable;
+    report->zombies = ctx->zombies;
+    report->lost = ctx->lost;
+    report->bad_counts = ctx->bad_counts;
+    report->bad_entries = ctx->bad_entries;
+    report->blocks_marked = ctx->blocks_marked - extra;
+    report->blocks_owned = ctx->blocks_owned - extra;
+    report->leaked = ctx->leaked;
+    report->unmarked = ctx->unmarked;
+    report->doubles = ctx->doubles;
+    report->bad_pointers = ctx->bad_pointers;
+    report->inode_used = partition->inode_used;
+    report->block_used = my_fold_block_used(partition);
+    bool clean = !report->zombies && !report->lost && !report->bad_counts &&
+        !report->bad_entries && !report->leaked && !report->unmarked &&
+        !report->doubles && !report->bad_pointers &&
+        report->inode_used == report->inodes_marked &&
+        report->block_used == report->blocks_marked;
+
+    if (repair_it && !clean) repair(ctx);
+
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx->fixes);
+    free((void*) ctx->owned);
+    free(ctx->queue);
+    free((void*) ctx->queued);
+    free((void*) ctx->refs);
+    free(ctx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->seconds = (end.tv_sec - begin.tv_sec) +
+        (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return clean;
+}
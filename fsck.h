@@ -0,0 +1,70 @@
+#ifndef __H_MY_FSCK__
+#define __H_MY_FSCK__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "myfs.h"
+
+/**
+ * What `my_fsck` found. The counts are before any
+ * repair.
+ */
+struct my_fsck_report
+{
+    // inodes marked used in the bitmap
+    uint32_t inodes_marked;
+    // inodes some directory refers to, and the root
+    uint32_t inodes_reachable;
+    // marked used but in no directory, left by `my_touch`
+    uint32_t zombies;
+    // in a directory but marked free
+    uint32_t lost;
+    // reference count not matching the directories
+    uint32_t bad_counts;
+    // directory entries pointing out of the inode table
+    uint32_t bad_entries;
+
+    // blocks marked used in the bitmap
+    my_block_t blocks_marked;
+    // blocks the metadata and the files really use
+    my_block_t blocks_owned;
+    // marked used, nobody uses them
+    my_block_t leaked;
+    // used, but marked free
+    my_block_t unmarked;
+    // used by 2 files, or twice by one
+    my_block_t doubles;
+    // block pointers out of the data blocks
+    my_block_t bad_pointers;
+
+    // the counters of the partition
+    uint32_t inode_used;
+    my_block_t block_used;
+
+    // seconds it took
+    double seconds;
+};
+
+/**
+ * Check the partition with `threads` threads, 0 for
+ * one per CPU. The directories are walked from the
+ * root to count the references of every inode, then
+ * the block trees of the inodes are walked in slices
+ * to rebuild the block bitmap, and the bitmaps and
+ * the counters are compared with the rebuilt ones.
+ *
+ * With `repair`, zombie inodes are cleared, wrong
+ * reference counts are set, bad block pointers are
+ * cut, a block used twice is copied for the second
+ * user, and both bitmaps and the counters are
+ * written again. Nobody else may use the partition
+ * while it repairs.
+ *
+ * Return true if the partition was clean.
+ */
+bool my_fsck(
+    struct my_partition* partition, uint32_t threads, bool repair,
+    struct my_fsck_report* report);
+
+#endif
@@ -0,0 +1,341 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "import.h"
+
+// files waiting for a reader at most
+#define IMPORT_QUEUE 1024
+// read from the host this much at a time
+#define IMPORT_BUFFER (1024 * 1024)
+// write from a mapping this much at a time
+#define IMPORT_CHUNK (64 * 1024 * 1024)
+
+struct import_job
+{
+    char* path;
+    uint32_t inode;
+};
+
+/**
+ * The files found by the walker, read by the pool.
+ */
+struct import
+{
+    struct my_partition* partition;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+    struct import_job jobs[IMPORT_QUEUE];
+    uint32_t head, count;
+    // the walker is done, no more jobs
+    bool done;
+    // threads reading, 0 if none could be started
+    uint32_t readers;
+
+    _Atomic uint64_t files, bytes, failed;
+};
+
+/**
+ * A directory to walk.
+ */
+struct import_dir
+{
+    char* path;
+    uint32_t inode;
+    struct import_dir* next;
+};
+
+static void import_file(struct import* im, struct import_job* job);
+
+static void push_job(struct import* im, char* path, uint32_t inode)
+{
+    if (im->readers == 0)
+    {
+        // nobody to give it to, read it now
+        struct import_job job = { path, inode };
+        import_file(im, &job);
+        free(path);
+        return;
+    }
+    pthread_mutex_lock(&im->mutex);
+    while (im->count == IMPORT_QUEUE)
+        pthread_cond_wait(&im->not_full, &im->mutex);
+    im->jobs[(im->head + im->count++) % IMPORT_QUEUE] =
+        (struct import_job) { path, inode };
+    pthread_cond_signal(&im->not_empty);
+    pthread_mutex_unlock(&im->mutex);
+}
+
+/**
+ * Copy what's left of `fd` through a buffer, for
+ * pipes and whatever can't be mapped.
+ */
+static bool copy_read(
+    struct my_partition* partition, struct my_file* file, int fd,
+    uint64_t* bytes)
+{
+    uint8_t* buffer = (uint8_t*) malloc(IMPORT_BUFFER);
+    ssize_t len = 0;
+    bool ok = true;
+    while (ok && (len = read(fd, buffer, IMPORT_BUFFER)) > 0)
+    {
+        uint32_t written = my_file_write(partition, file, buffer, len);
+        if (written != len) ok = false;
+        *bytes += written;
+    }
+    free(buffer);
+    return ok && len == 0;
+}
+
+bool my_import_file(
+    struct my_partition* partition, uint32_t inode, int fd, uint64_t* bytes)
+{
+    *bytes = 0;
+    struct stat st;
+    if (fstat(fd, &st)) return false;
+    uint8_t* map = MAP_FAILED;
+    bool ok = true;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        // the size is known, map all the blocks at once,
+        // what fits is copied if not all of it does
+        ok = my_file_reserve(partition, inode, st.st_size);
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    struct my_file* file = my_file_open(partition, inode);
+    if (map != MAP_FAILED)
+    {
+        // large writes skip the write-back buffer, the
+        // data goes from the page cache to the blocks
+        for (uint64_t pos = 0; pos < st.st_size; )
+        {
+            uint32_t len = (st.st_size - pos < IMPORT_CHUNK) ?
+                st.st_size - pos : IMPORT_CHUNK;
+            uint32_t written = my_file_write(partition, file, map + pos, len);
+            *bytes = (pos += written);
+            if (written != len)
+            {
+                ok = false;
+                break;
+            }
+        }
+        munmap(map, st.st_size);
+    }
+    else if (!copy_read(partition, file, fd, bytes)) ok = false;
+    if (!my_file_flush(partition, file)) ok = false;
+    my_file_close(partition, file);
+    return ok;
+}
+
+/**
+ * Copy a host file into the inode.
+ */
+static void import_file(struct import* im, struct import_job* job)
+{
+    int fd = open(job->path, O_RDONLY);
+    uint64_t bytes = 0;
+    bool ok = fd >= 0 && my_import_file(im->partition, job->inode, fd, &bytes);
+    if (fd >= 0) close(fd);
+    atomic_fetch_add(&im->bytes, bytes);
+    atomic_fetch_add(ok ? &im->files : &im->failed, 1);
+}
+
+static void* reader(void* arg)
+{
+    struct import* im = (struct import*) arg;
+    pthread_mutex_lock(&im->mutex);
+    for (;;)
+    {
+        while (im->count == 0 && !im->done)
+            pthread_cond_wait(&im->not_empty, &im->mutex);
+        if (im->count == 0) break;
+        struct import_job job = im->jobs[im->head];
+        im->head = (im->head + 1) % IMPORT_QUEUE;
+        --im->count;
+        pthread_cond_signal(&im->not_full);
+        pthread_mutex_unlock(&im->mutex);
+
+        import_file(im, &job);
+        free(job.path);
+
+        pthread_mutex_lock(&im->mutex);
+    }
+    pthread_mutex_unlock(&im->mutex);
+    return NULL;
+}
+
+static char* join_path(const char* dir, const char* name)
+{
+    size_t a = strlen(dir), b = strlen(name);
+    char* path = (char*) malloc(a + b + 2);
+    memcpy(path, dir, a);
+    path[a] = '/';
+    memcpy(path + a + 1, name, b + 1);
+    return path;
+}
+
+/**
+ * Make the entries of the host directory in the myfs
+ * directory, give the files to the readers and put
+ * the directories on the stack.
+ */
+static void import_dir(
+    struct import* im, struct import_dir* dir,
+    struct import_dir** stack, struct my_import_report* report)
+{
+    struct my_partition* partition = im->partition;
+    DIR* host = opendir(dir->path);
+    if (host == NULL)
+    {
+        ++report->failed;
+        return;
+    }
+    uint32_t count = 0, size = 64;
+    struct my_dir_entry* entries = (struct my_dir_entry*) malloc(
+        sizeof(struct my_dir_entry) * size);
+    char** paths = (char**) malloc(sizeof(char*) * size);
+    struct dirent* d;
+    while ((d = readdir(host)))
+    {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+        // the directory can't hold these names
+        if (strchr(d->d_name, '\n') || strchr(d->d_name, '\\'))
+        {
+            ++report->skipped;
+            continue;
+        }
+        char* path = join_path(dir->path, d->d_name);
+        uint8_t type = 0;
+        if (d->d_type == DT_DIR) type = MY_TYPE_DIR;
+        else if (d->d_type == DT_REG) type = MY_TYPE_FILE;
+        else if (d->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat(path, &st) == 0)
+                type = S_ISDIR(st.st_mode) ? MY_TYPE_DIR :
+                    S_ISREG(st.st_mode) ? MY_TYPE_FILE : 0;
+        }
+        uint32_t inode = type ? my_touch_in(partition, dir->inode, type) : -1;
+        if (inode == -1)
+        {
+            // links and devices aren't followed
+            if (type) ++report->failed;
+            else ++report->skipped;
+            free(path);
+            continue;
+        }
+        if (count == size)
+        {
+            size *= 2;
+            entries = (struct my_dir_entry*) realloc(entries,
+                sizeof(struct my_dir_entry) * size);
+            paths = (char**) realloc(paths, sizeof(char*) * size);
+        }
+        // the name lives in the path
+        entries[count] = (struct my_dir_entry) {
+            inode, type, path + strlen(dir->path) + 1, false };
+        paths[count++] = path;
+    }
+    closedir(host);
+
+    my_dir_reference_files(partition, dir->inode, entries, count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!entries[i].referenced)
+        {
+            my_delete_file(partition, entries[i].inode);
+            ++report->failed;
+            free(paths[i]);
+        }
+        else if (entries[i].type == MY_TYPE_FILE)
+            push_job(im, paths[i], entries[i].inode);
+        else
+        {
+            struct import_dir* sub = (struct import_dir*) malloc(
+                sizeof(struct import_dir));
+            *sub = (struct import_dir) { paths[i], entries[i].inode, *stack };
+            *stack = sub;
+            ++report->dirs;
+        }
+    }
+    free(entries);
+    free(paths);
+}
+
+bool my_import_tree(
+    struct my_partition* partition, uint32_t dir,
+    const char* path, const char* name, uint32_t threads,
+    struct my_import_report* report)
+{
+    struct timespec begin, end;
+    timespec_get(&begin, TIME_UTC);
+    memset(report, 0, sizeof(struct my_import_report));
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode)) return false;
+    uint32_t top = my_touch_in(partition, dir, MY_TYPE_DIR);
+    if (top == -1) return false;
+    if (!my_dir_reference_file(partition, dir, top, MY_TYPE_DIR, name))
+    {
+        my_delete_file(partition, top);
+        return false;
+    }
+    report->dirs = 1;
+
+    struct import* im = (struct import*) calloc(1, sizeof(struct import));
+    im->partition = partition;
+    pthread_mutex_init(&im->mutex, NULL);
+    pthread_cond_init(&im->not_empty, NULL);
+    pthread_cond_init(&im->not_full, NULL);
+    if (threads == 0) threads = 4;
+    pthread_t* pool = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < threads; ++i)
+        if (pthread_create(&pool[started], NULL, reader, im) == 0) ++started;
+    im->readers = started;
+
+    // depth first, so the readers work close to the walker
+    struct import_dir* stack = (struct import_dir*) malloc(sizeof(struct import_dir));
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') --len;
+    *stack = (struct import_dir) { strndup(path, len), top, NULL };
+    while (stack)
+    {
+        struct import_dir* d = stack;
+        stack = d->next;
+        import_dir(im, d, &stack, report);
+        free(d->path);
+        free(d);
+    }
+
+    pthread_mutex_lock(&im->mutex);
+    im->done = true;
+    pthread_cond_broadcast(&im->not_empty);
+    pthread_mutex_unlock(&im->mutex);
+    for (uint32_t i = 0; i < started; ++i) pthread_join(pool[i], NULL);
+
+    report->files = im->files;
+    report->bytes = im->bytes;
+    report->failed += im->failed;
+    pthread_mutex_destroy(&im->mutex);
+    pthread_cond_destroy(&im->not_empty);
+    pthread_cond_destroy(&im->not_full);
+    free(pool);
+    free(im);
+    timespec_get(&end, TIME_UTC);
+    report->seconds = (end.tv_sec - begin.tv_sec) +
+        (end.tv_nsec - begin.tv_nsec) / 1e9;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef __H_MY_IMPORT__
+#define __H_MY_IMPORT__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "myfs.h"
+
+/**
+ * What `my_import_tree` did.
+ */
+struct my_import_report
+{
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+    // files that couldn't be read or didn't fit
+    uint64_t failed;
+    // symbolic links, devices and names myfs can't have
+    uint64_t skipped;
+    double seconds;
+};
+
+/**
+ * Copy the open host file `fd` into the file
+ * `inode`, from its start. A regular file is mapped
+ * and written to the blocks straight from the
+ * mapping, after reserving all of them, others are
+ * read through a buffer. Put the bytes copied in
+ * `bytes`. Return false if it can't be read or
+ * doesn't fit.
+ */
+bool my_import_file(
+    struct my_partition* partition, uint32_t inode, int fd, uint64_t* bytes);
+
+/**
+ * Copy the host directory `path` and everything under
+ * it into the directory `dir`, named `name`. This
+ * thread walks the host tree, makes the directories
+ * and the inodes and references the entries of a
+ * directory with one update of it, `threads` threads
+ * (4 if 0) read the files meanwhile.
+ * Return false if `path` isn't a directory or `name`
+ * can't be made.
+ */
+bool my_import_tree(
+    struct my_partition* partition, uint32_t dir,
+    const char* path, const char* name, uint32_t threads,
+    struct my_import_report* report);
+
+#endif
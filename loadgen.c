@@ -0,0 +1,244 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include "proto.h"
+
+#define FILE_SIZE (64 * 1024)
+#define IO_SIZE 4096
+
+struct client
+{
+    const char* path;
+    uint32_t id;
+    double seconds;
+    uint64_t* latencies; // ns
+    uint64_t count;
+    uint64_t size;
+    bool failed;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool read_all(int fd, void* buffer, size_t len)
+{
+    uint8_t* p = (uint8_t*) buffer;
+    while (len)
+    {
+        ssize_t r = read(fd, p, len);
+        if (r <= 0) return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+/**
+ * Send one request and wait for the reply, the reply
+ * payload goes to `out` (at most `out_size` bytes).
+ */
+static bool call(
+    int fd, struct my_request* req, const void* payload,
+    struct my_reply* reply, void* out, uint32_t out_size)
+{
+    struct iovec iov[2] = {
+        { req, sizeof(struct my_request) },
+        { (void*) payload, req->length } };
+    if (writev(fd, iov, req->length ? 2 : 1) !=
+        (ssize_t) (sizeof(struct my_request) + req->length))
+        return false;
+    if (!read_all(fd, reply, sizeof(struct my_reply))) return false;
+
+    uint8_t discard[4096];
+    uint32_t left = reply->length;
+    if (out && left)
+    {
+        uint32_t n = (left < out_size) ? left : out_size;
+        if (!read_all(fd, out, n)) return false;
+        left -= n;
+    }
+    while (left)
+    {
+        uint32_t n = (left < sizeof(discard)) ? left : sizeof(discard);
+        if (!read_all(fd, discard, n)) return false;
+        left -= n;
+    }
+    return true;
+}
+
+static void record(struct client* c, uint64_t ns)
+{
+    if (c->count == c->size)
+    {
+        c->size = c->size ? c->size * 2 : 4096;
+        c->latencies = (uint64_t*) realloc(c->latencies,
+            sizeof(uint64_t) * c->size);
+    }
+    c->latencies[c->count++] = ns;
+}
+
+static void* run_client(void* p)
+{
+    struct client* c = (struct client*) p;
+    struct sockaddr_un addr;
+    struct my_request req;
+    struct my_reply reply;
+    uint8_t buffer[IO_SIZE];
+    char name[32];
+    uint32_t inode, seed = c->id + 1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        c->failed = true;
+        return NULL;
+    }
+
+    // every client works on its own file in root
+    snprintf(name, sizeof(name), "load-%u", c->id);
+    memset(&req, 0, sizeof(req));
+    req.op = MY_PROTO_CREATE;
+    req.length = strlen(name);
+    if (!call(fd, &req, name, &reply, NULL, 0)) goto fail;
+    if (reply.status == MY_PROTO_EEXIST)
+    {
+        req.op = MY_PROTO_LOOKUP;
+        if (!call(fd, &req, name, &reply, NULL, 0)) goto fail;
+    }
+    if (reply.status != MY_PROTO_OK) goto fail;
+    inode = reply.value;
+
+    memset(buffer, 'a' + c->id % 26, sizeof(buffer));
+    for (uint32_t off = 0; off < FILE_SIZE; off += IO_SIZE)
+    {
+        req = (struct my_request) { IO_SIZE, 0, MY_PROTO_WRITE, {0}, inode, off, 0 };
+        if (!call(fd, &req, buffer, &reply, NULL, 0)) goto fail;
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t) (c->seconds * 1e9);
+    uint64_t begin, end = 0;
+    while (end < deadline)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t off = (seed >> 8) % (FILE_SIZE - IO_SIZE);
+        memset(&req, 0, sizeof(req));
+        req.tag = (uint32_t) c->count;
+        begin = now_ns();
+        switch ((seed >> 4) % 4)
+        {
+            case 0:
+                req.op = MY_PROTO_LOOKUP;
+                req.length = strlen(name);
+                if (!call(fd, &req, name, &reply, NULL, 0)) goto fail;
+                break;
+            case 1:
+                req.op = MY_PROTO_READ;
+                req.inode = inode;
+                req.offset = off;
+                req.count = IO_SIZE;
+                if (!call(fd, &req, NULL, &reply, buffer, IO_SIZE)) goto fail;
+                break;
+            case 2:
+                req.op = MY_PROTO_STAT;
+                req.inode = inode;
+                if (!call(fd, &req, NULL, &reply, NULL, 0)) goto fail;
+                break;
+            case 3:
+                req.op = MY_PROTO_WRITE;
+                req.inode = inode;
+                req.offset = off;
+                req.length = IO_SIZE;
+                if (!call(fd, &req, buffer, &reply, NULL, 0)) goto fail;
+                break;
+        }
+        end = now_ns();
+        record(c, end - begin);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.op = MY_PROTO_UNLINK;
+    req.length = strlen(name);
+    call(fd, &req, name, &reply, NULL, 0);
+    close(fd);
+    return NULL;
+
+fail:
+    c->failed = true;
+    close(fd);
+    return NULL;
+}
+
+static int compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <socket> [clients] [seconds]\n", argv[0]);
+        return 1;
+    }
+    uint32_t clients = (argc > 2) ? atoi(argv[2]) : 4;
+    double seconds = (argc > 3) ? atof(argv[3]) : 5;
+    if (clients == 0) clients = 1;
+
+    struct client* c = (struct client*) calloc(clients, sizeof(struct client));
+    pthread_t* tids = (pthread_t*) malloc(sizeof(pthread_t) * clients);
+    for (uint32_t i = 0; i < clients; ++i)
+    {
+        c[i].path = argv[1];
+        c[i].id = i;
+        c[i].seconds = seconds;
+        pthread_create(&tids[i], NULL, run_client, &c[i]);
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < clients; ++i)
+    {
+        pthread_join(tids[i], NULL);
+        if (c[i].failed) printf("client %u failed\n", i);
+        total += c[i].count;
+    }
+
+    uint64_t* all = (uint64_t*) malloc(sizeof(uint64_t) * (total ? total : 1));
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < clients; ++i)
+    {
+        memcpy(all + n, c[i].latencies, sizeof(uint64_t) * c[i].count);
+        n += c[i].count;
+        free(c[i].latencies);
+    }
+    qsort(all, n, sizeof(uint64_t), compare);
+
+    printf("clients=%u ops=%lu ops/s=%.0f", clients,
+        (unsigned long) n, n / seconds);
+    if (n) printf(" p50=%.1fus p99=%.1fus max=%.1fus",
+        all[n / 2] / 1e3, all[n * 99 / 100] / 1e3, all[n - 1] / 1e3);
+    puts("");
+
+    free(all);
+    free(tids);
+    free(c);
+    return 0;
+}
@@ -0,0 +1,296 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lock.h"
+
+// max number of partitions with a lock table at the same time
+#define MY_LOCK_TABLES 16
+
+// how long a shared waiter sleeps before looking for dead owners
+#define MY_LOCK_CHECK_NS 100000000
+
+/**
+ * A locked byte range.
+ */
+struct my_range
+{
+    uint32_t inode;
+    uint64_t start;
+    uint64_t end;
+    // process holding the range, for shared tables
+    int32_t owner;
+    bool used;
+    bool exclusive;
+};
+
+/**
+ * Inodes are hashed into buckets, the ranges of an
+ * inode are all in the same bucket.
+ */
+struct my_lock_bucket
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // lock of block map and size
+    pthread_mutex_t map;
+    struct my_range ranges[MY_LOCK_RANGES];
+};
+
+/**
+ * No pointers inside, so a table works in memory
+ * shared by processes.
+ */
+struct my_lock_table
+{
+    bool shared;
+    struct my_lock_bucket buckets[MY_LOCK_BUCKETS];
+};
+
+static pthread_mutex_t tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    _Atomic(struct my_partition*) partition;
+    struct my_lock_table* table;
+} tables[MY_LOCK_TABLES];
+
+size_t my_lock_table_size()
+{
+    // round up to pages, the partition follows it
+    const size_t page = 4096;
+    return (sizeof(struct my_lock_table) + page - 1) / page * page;
+}
+
+void my_lock_table_init(void* memory, bool shared)
+{
+    struct my_lock_table* table = (struct my_lock_table*) memory;
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_condattr_init(&cattr);
+    if (shared)
+    {
+        // robust: if a process dies holding it, the
+        // next one gets EOWNERDEAD instead of hanging
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    }
+
+    table->shared = shared;
+    for (uint32_t i = 0; i < MY_LOCK_BUCKETS; ++i)
+    {
+        pthread_mutex_init(&table->buckets[i].mutex, &mattr);
+        pthread_cond_init(&table->buckets[i].cond, &cattr);
+        pthread_mutex_init(&table->buckets[i].map, &mattr);
+        for (uint32_t j = 0; j < MY_LOCK_RANGES; ++j)
+            table->buckets[i].ranges[j].used = false;
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+}
+
+static void free_table(struct my_lock_table* table)
+{
+    for (uint32_t i = 0; i < MY_LOCK_BUCKETS; ++i)
+    {
+        pthread_mutex_destroy(&table->buckets[i].mutex);
+        pthread_cond_destroy(&table->buckets[i].cond);
+        pthread_mutex_destroy(&table->buckets[i].map);
+    }
+    free(table);
+}
+
+/**
+ * Find the lock table of the partition, make one
+ * if it doesn't have one yet.
+ */
+static struct my_lock_table* table_of(struct my_partition* partition)
+{
+    // a shared partition carries its table just before it
+    if (partition->flags & MY_PARTITION_SHARED)
+        return (struct my_lock_table*) (
+            (uint8_t*) partition - my_lock_table_size());
+
+    // fast path, no lock
+    for (uint32_t i = 0; i < MY_LOCK_TABLES; ++i)
+        if (atomic_load_explicit(&tables[i].partition,
+                memory_order_acquire) == partition)
+            return tables[i].table;
+
+    struct my_lock_table* table = NULL;
+    pthread_mutex_lock(&tables_mutex);
+    for (uint32_t i = 0; i < MY_LOCK_TABLES && table == NULL; ++i)
+        if (atomic_load(&tables[i].partition) == partition)
+            table = tables[i].table;
+    for (uint32_t i = 0; i < MY_LOCK_TABLES && table == NULL; ++i)
+        if (atomic_load(&tables[i].partition) == NULL)
+        {
+            table = tables[i].table = (struct my_lock_table*) malloc(
+                sizeof(struct my_lock_table));
+            my_lock_table_init(table, false);
+            atomic_store_explicit(&tables[i].partition, partition,
+                memory_order_release);
+        }
+    pthread_mutex_unlock(&tables_mutex);
+    if (table == NULL) abort(); // :O too many partitions
+    return table;
+}
+
+static inline struct my_lock_bucket* bucket_of(
+    struct my_lock_table* table, uint32_t inode)
+{
+    // inode numbers are dense, multiply to spread them
+    return &table->buckets[(inode * 2654435761u >> 16) % MY_LOCK_BUCKETS];
+}
+
+/**
+ * Drop the ranges held by processes that don't exist
+ * anymore. The bucket mutex is held.
+ */
+static bool release_dead(struct my_lock_bucket* bucket)
+{
+    bool released = false;
+    for (uint32_t i = 0; i < MY_LOCK_RANGES; ++i)
+    {
+        struct my_range* r = &bucket->ranges[i];
+        if (r->used && r->owner != getpid() &&
+            kill(r->owner, 0) < 0 && errno == ESRCH)
+        {
+            r->used = false;
+            released = true;
+        }
+    }
+    if (released) pthread_cond_broadcast(&bucket->cond);
+    return released;
+}
+
+/**
+ * Lock a mutex of the bucket. If the last owner died
+ * holding it, clean up after it and take it over.
+ */
+static void lock_mutex(struct my_lock_bucket* bucket, pthread_mutex_t* mutex)
+{
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+    {
+        if (mutex == &bucket->mutex) release_dead(bucket);
+        // for the map lock, a half done allocation only
+        // leaks some blocks
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+static bool conflict(
+    struct my_lock_bucket* bucket, uint32_t inode,
+    uint64_t start, uint64_t end, bool exclusive)
+{
+    for (uint32_t i = 0; i < MY_LOCK_RANGES; ++i)
+    {
+        struct my_range* r = &bucket->ranges[i];
+        if (r->used && r->inode == inode &&
+            r->start < end && start < r->end &&
+            (exclusive || r->exclusive))
+            return true;
+    }
+    return false;
+}
+
+static void wait_bucket(struct my_lock_table* table, struct my_lock_bucket* bucket)
+{
+    int r;
+    if (!table->shared)
+    {
+        pthread_cond_wait(&bucket->cond, &bucket->mutex);
+        return;
+    }
+
+    // the owner of the range may be dead, nobody
+    // will wake us then, so look around once a while
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += MY_LOCK_CHECK_NS;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_nsec -= 1000000000;
+        ++ts.tv_sec;
+    }
+    r = pthread_cond_timedwait(&bucket->cond, &bucket->mutex, &ts);
+    if (r == EOWNERDEAD)
+    {
+        release_dead(bucket);
+        pthread_mutex_consistent(&bucket->mutex);
+    }
+    else if (r == ETIMEDOUT) release_dead(bucket);
+}
+
+uint32_t my_range_lock(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t start, uint64_t end, bool exclusive)
+{
+    struct my_lock_table* table = table_of(partition);
+    struct my_lock_bucket* bucket = bucket_of(table, inode);
+    // empty range still orders writers
+    if (end <= start) end = (start == UINT64_MAX) ? start : start + 1;
+    lock_mutex(bucket, &bucket->mutex);
+    for (;;)
+    {
+        if (!conflict(bucket, inode, start, end, exclusive))
+            for (uint32_t i = 0; i < MY_LOCK_RANGES; ++i)
+                if (!bucket->ranges[i].used)
+                {
+                    bucket->ranges[i] = (struct my_range) {
+                        inode, start, end, getpid(), true, exclusive };
+                    pthread_mutex_unlock(&bucket->mutex);
+                    return i;
+                }
+        // conflict or bucket is full
+        wait_bucket(table, bucket);
+    }
+}
+
+void my_range_unlock(
+    struct my_partition* partition, uint32_t inode, uint32_t lock)
+{
+    struct my_lock_bucket* bucket = bucket_of(table_of(partition), inode);
+    lock_mutex(bucket, &bucket->mutex);
+    bucket->ranges[lock].used = false;
+    pthread_cond_broadcast(&bucket->cond);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+void my_map_lock(
+    struct my_partition* partition, uint32_t inode)
+{
+    struct my_lock_bucket* bucket = bucket_of(table_of(partition), inode);
+    lock_mutex(bucket, &bucket->map);
+}
+
+void my_map_unlock(
+    struct my_partition* partition, uint32_t inode)
+{
+    pthread_mutex_unlock(&bucket_of(table_of(partition), inode)->map);
+}
+
+void my_lock_table_release(
+    struct my_partition* partition)
+{
+    pthread_mutex_lock(&tables_mutex);
+    for (uint32_t i = 0; i < MY_LOCK_TABLES; ++i)
+        if (atomic_load(&tables[i].partition) == partition)
+        {
+            atomic_store(&tables[i].partition, NULL);
+            free_table(tables[i].table);
+            tables[i].table = NULL;
+        }
+    pthread_mutex_unlock(&tables_mutex);
+}
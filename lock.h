@@ -0,0 +1,74 @@
+#ifndef __H_MY_LOCK__
+#define __H_MY_LOCK__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "myfs.h"
+
+// number of buckets in a lock table, inodes are hashed into them
+#define MY_LOCK_BUCKETS 64
+// number of ranges a bucket can hold at the same time
+#define MY_LOCK_RANGES 16
+
+// a range covering the whole file
+#define MY_RANGE_ALL 0, UINT64_MAX
+
+/**
+ * Lock the byte range [start, end) of the given inode.
+ * Exclusive ranges conflict with every overlapping
+ * range of the same inode, shared ranges only with
+ * exclusive ones. Block until there's no conflict.
+ *
+ * Return a handle for `my_range_unlock`.
+ */
+uint32_t my_range_lock(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t start, uint64_t end, bool exclusive);
+
+/**
+ * Release a range returned by `my_range_lock`.
+ */
+void my_range_unlock(
+    struct my_partition* partition, uint32_t inode, uint32_t lock);
+
+/**
+ * Lock the block map and the size of the given inode.
+ * Writers only take it when they need to allocate
+ * blocks or change the size, so writes inside the
+ * file don't serialize on it.
+ *
+ * Note: take the range lock before this one, never
+ * wait for a range while holding it.
+ */
+void my_map_lock(
+    struct my_partition* partition, uint32_t inode);
+
+/**
+ * Release the lock taken by `my_map_lock`.
+ */
+void my_map_unlock(
+    struct my_partition* partition, uint32_t inode);
+
+/**
+ * Size of a lock table, rounded up to pages.
+ */
+size_t my_lock_table_size();
+
+/**
+ * Init a lock table in the given memory. A shared
+ * table uses process-shared robust mutexes, and
+ * ranges held by a process that died are released
+ * by the next process waiting for them.
+ */
+void my_lock_table_init(void* memory, bool shared);
+
+/**
+ * Release the lock table of the partition. It's
+ * called by `my_free_partition`.
+ */
+void my_lock_table_release(
+    struct my_partition* partition);
+
+#endif
@@ -1,24 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "myfs.h"
 #include "cmds.h"
+#include "server.h"
+#include "shared.h"
 
 struct my_partition* get_partition();
+struct my_partition* load_partition(const char* filename);
+uint64_t parse_size(const char* str);
+
+void usage(const char* name)
+{
+    printf("usage: %s [-l <image> | -c <size> [-b <block size>]] [-m <name>] [-s <socket> [-j <workers>] | -f <script>]\n", name);
+    puts("\t-l\tload the partition from the image");
+    puts("\t-c\tcreate a new partition of the size (example '20MB')");
+    puts("\t-b\tblock size of the new partition, 1KB, 4KB, 16KB or 64KB");
+    puts("\t\t(default 1KB)");
+    puts("\t-m\tput the partition in shared memory, with -c it's made,");
+    puts("\t\twithout it an existing one is attached");
+    puts("\t-s\tserve the partition on the Unix domain socket");
+    puts("\t-j\tnumber of worker threads of the server (default 4)");
+    puts("\t-f\trun the commands of the script, '-' for stdin, without");
+    puts("\t\tthe prompt (it's the default when stdin isn't a terminal)");
+    puts("without -l and -c, you'll be asked in the shell");
+}
 
 int main(int argc, char const *argv[])
 {
-    struct my_partition* partition = get_partition();
+    struct my_partition* partition = NULL;
+    const char *image = NULL, *size = NULL, *socket = NULL, *shared = NULL;
+    const char *block_size = NULL, *script = NULL;
+    uint32_t workers = 4;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-l") == 0) image = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-c") == 0) size = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) block_size = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0) socket = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-m") == 0) shared = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-j") == 0) workers = atoi(argv[++i]);
+        else if (i + 1 < argc && strcmp(argv[i], "-f") == 0) script = argv[++i];
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (image) partition = load_partition(image);
+    else if (size)
+    {
+        uint64_t bytes = parse_size(size);
+        uint32_t bs = block_size ? parse_size(block_size) : 0;
+        if (bytes < 5 K) printf("invalid size '%s'\n", size);
+        else if (block_size && bs == 0) printf("invalid block size '%s'\n", block_size);
+        else if (shared)
+        {
+            partition = my_make_shared_partition(shared, bytes, bs);
+            if (partition == NULL) printf("failed to make shared partition %s\n", shared);
+        }
+        else
+        {
+            partition = my_make_partition(bytes, bs);
+            if (partition == NULL) printf("failed to make partition of %s\n", size);
+        }
+    }
+    else if (shared)
+    {
+        partition = my_attach_shared_partition(shared);
+        if (partition == NULL) printf("failed to attach shared partition %s\n", shared);
+    }
+    else partition = get_partition();
 
     if (partition == NULL) return 1;
 
+    if (socket) return my_serve(partition, socket, workers);
+    if (script && strcmp(script, "-"))
+    {
+        FILE* fp = fopen(script, "r");
+        if (fp == NULL)
+        {
+            printf("failed to open %s\n", script);
+            return 1;
+        }
+        int ret = my_sh_batch(partition, fp);
+        fclose(fp);
+        return ret;
+    }
+    // piped commands don't need the cat
+    if (script || !isatty(fileno(stdin))) return my_sh_batch(partition, stdin);
     return my_sh(partition);
 }
 
 #define BUFFER_SIZE 512
 
+struct my_partition* load_partition(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        printf("failed to open %s\n", filename);
+        return NULL;
+    }
+    struct my_partition* partition = my_load_partition_from_file(fp);
+    fclose(fp);
+    if (partition == NULL) printf("%s is not a partition\n", filename);
+    return partition;
+}
+
+/**
+ * Parse size like '8192', '512KB', '20MB'. Return 0
+ * if it's not a size.
+ */
+uint64_t parse_size(const char* str)
+{
+    char* p;
+    long long num = strtoll(str, &p, 0), unit = 1;
+    while (*p == ' ') ++p;
+    if (*p != '\0')
+    {
+        switch (*p)
+        {
+            case 'b':
+            case 'B': unit = 1  ; break;
+            case 'k':
+            case 'K': unit = 1 K; break;
+            case 'm':
+            case 'M': unit = 1 M; break;
+            case 'g':
+            case 'G': unit = 1 G; break;
+            default: return 0;
+        }
+    }
+    if (num <= 0) return 0;
+    return num * unit;
+}
+
 int32_t read_line(char* dest, uint32_t size)
 {
     uint32_t count = 0;
@@ -48,9 +172,8 @@ struct my_partition* get_partition()
 
     while (1)
     {
-        char* p;
-        long num, unit = 1;
-        
+        uint64_t size;
+
         if (first_time) first_time = false;
         else puts("\n\tWTF?\n");
         
@@ -58,6 +181,7 @@ struct my_partition* get_partition()
         {
             printf("Enter the file name: ");
             len = read_line(line, BUFFER_SIZE);
+            if (len == -1) return NULL;
             FILE* fp = fopen(line, "rb");
             if (fp == NULL)
             {
@@ -66,7 +190,12 @@ struct my_partition* get_partition()
             }
             struct my_partition* partition = my_load_partition_from_file(fp);
             fclose(fp);
-            printf("partition size: %d\n", partition->size);
+            if (partition == NULL)
+            {
+                printf("%s is not a partition\n", line);
+                continue;
+            }
+            printf("partition size: %llu\n", (unsigned long long) partition->size);
             free(line);
             return partition;
         }
@@ -79,27 +208,11 @@ struct my_partition* get_partition()
             len = read_line(line, BUFFER_SIZE);
             if (len == -1) return NULL;
             if (len == 0) continue;
-            num = strtol(line, &p, 0);
-            while (*p == ' ' && (p - line) < len) ++p;
-            if (*p != '\0')
-            {
-                switch (*p)
-                {
-                    case 'b':
-                    case 'B': unit = 1  ; break;
-                    case 'k':
-                    case 'K': unit = 1 K; break;
-                    case 'm':
-                    case 'M': unit = 1 M; break;
-                    case 'g':
-                    case 'G': unit = 1 G; break;
-                    default: continue;
-                }
-            }
-            if (num * unit < 5 K) continue;
+            size = parse_size(line);
+            if (size < 5 K) continue;
             free(line);
-            printf("partition size = %ld\n", num * unit);
-            return my_make_partition(num * unit);
+            printf("partition size = %llu\n", (unsigned long long) size);
+            return my_make_partition(size, 0);
         }
     }
     return NULL;
@@ -1,63 +1,181 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "myfs.h"
-
-#define MY_INODE_SIZE 128
+#include "lock.h"
+#include "shared.h"
+#include "extent.h"
+#include "stats.h"
+#include "trace.h"
+#include "alloc.h"
+#include "scan.h"
+
+#ifdef MY_FS_64BIT_BLOCKS
+    #define MY_INODE_SIZE 256
+    #define MY_BLOCK_FLAGS MY_PARTITION_64BIT_BLOCKS
+#else
+    #define MY_INODE_SIZE 128
+    #define MY_BLOCK_FLAGS 0
+#endif
 #define MY_BLOCK_SIZE 1 K
 
 #define BUFFER_SIZE 512
+// size of the write-back buffer of a file pointer
+#define WRITE_BACK_SIZE (64 K)
+// number of blocks gathered before they're cleared
+#define FREE_BATCH_SIZE 1024
+// files this large are erased by the reaper thread
+#define REAP_SIZE (256 * 1024 K)
+
+// log2 of the size of a block number
+#define MY_BLOCK_T_SHIFT (sizeof(my_block_t) == 8 ? 3 : 2)
+
+// a template of the hot paths, `shift` is a constant
+// in every copy
+#define HOT_PATH static inline __attribute__((always_inline))
+
+// every open and every directory entry listed is one
+static const struct my_slab file_slab = MY_SLAB(MY_SLAB_FILE, struct my_file);
+static const struct my_slab dir_list_slab =
+    MY_SLAB(MY_SLAB_DIR_LIST, struct my_dir_list);
+
+// view a field of the partition as atomic
+#define AS_ATOMIC(p) ((_Atomic __typeof__(*(p))*) (p))
+
+// the state of a directory inode
+#define DIR_IDLE 0
+#define DIR_ADDING 1
+#define DIR_REMOVED 2
+
+static void fill_bitmap(uint8_t* bitmap, uint64_t from, uint64_t to);
+
+/**
+ * Return log2 of the block size, 0 if the hot paths
+ * are not specialized for it.
+ */
+static uint32_t block_shift_of(uint32_t block_size)
+{
+    switch (block_size)
+    {
+        case 1 K: return 10;
+        case 4 K: return 12;
+        case 16 K: return 14;
+        case 64 K: return 16;
+        default: return 0;
+    }
+}
 
-struct my_partition* my_make_partition(uint32_t size)
+/**
+ * Check the size and the block size, return the
+ * block size to use or 0 if they don't work.
+ */
+static uint32_t check_size(uint64_t size, uint32_t block_size)
 {
-    if (size < 5 * MY_BLOCK_SIZE) return NULL;
+    if (block_size == 0) block_size = MY_BLOCK_SIZE;
+    if (block_shift_of(block_size) == 0) return 0;
+    if (size < 5 * (uint64_t) block_size) return 0;
+    if (size / block_size > (my_block_t) -1) return 0; // too many blocks
+    return block_size;
+}
 
+struct my_partition* my_make_partition(
+    uint64_t size, uint32_t block_size)
+{
+    if (check_size(size, block_size) == 0) return NULL;
     uint8_t* memory = (uint8_t*) malloc(size);
+    if (memory == NULL) return NULL;
+    return my_format_partition(memory, size, block_size);
+}
+
+struct my_partition* my_format_partition(
+    uint8_t* memory, uint64_t size, uint32_t block_size)
+{
+    block_size = check_size(size, block_size);
+    if (block_size == 0) return NULL;
+
     struct my_partition* partition = (struct my_partition*) memory;
+    // an index of the old contents is no good
+    my_extent_release(partition);
     partition->size = size;
+    partition->flags = MY_BLOCK_FLAGS;
 
-    // uses default block size
     partition->inode_size = MY_INODE_SIZE;
-    partition->block_size = MY_BLOCK_SIZE;
+    partition->block_size = block_size;
+    partition->block_shift = block_shift_of(block_size);
 
-    uint32_t num_of_blocks = partition->size / partition->block_size;
-    uint32_t size_of_bitmap = num_of_blocks / 8;
+    // 64 bits math, a partition can be larger than 4G
+    my_block_t num_of_blocks = partition->size / partition->block_size;
+    uint64_t size_of_bitmap = num_of_blocks / 8;
     if (num_of_blocks % 8) ++size_of_bitmap;
-    uint32_t blocks_of_bitmap = size_of_bitmap / partition->block_size;
+    my_block_t blocks_of_bitmap = size_of_bitmap / partition->block_size;
     if (size_of_bitmap % partition->block_size) ++blocks_of_bitmap;
-    uint32_t tmp;
+    uint64_t tmp;
+
+    // every block of the blocks bitmap is a group
+    partition->blocks_per_group = partition->block_size * 8;
+    partition->group_count = blocks_of_bitmap;
+    tmp = (uint64_t) partition->group_count * sizeof(struct my_group);
+    my_block_t blocks_of_groups = tmp / partition->block_size;
+    if (tmp % partition->block_size) ++blocks_of_groups;
+
+    // group descriptors starting block
+    partition->groups = 1;
 
     // bitmap starting block
-    partition->inode_bitmap = 1;
+    partition->inode_bitmap = partition->groups + blocks_of_groups;
     partition->block_bitmap = partition->inode_bitmap + blocks_of_bitmap;
 
     // inodes starting block
     partition->inodes = partition->block_bitmap + blocks_of_bitmap;
 
-    // number of inodes and blocks
-    partition->inode_count = (num_of_blocks - partition->inodes) *
-        partition->inode_size / (partition->inode_size + partition->block_size);
+    // number of inodes and blocks, as many inodes as
+    // 1K blocks would get for the same space
+    tmp = (uint64_t) (num_of_blocks - partition->inodes) *
+        (partition->block_size / (1 K)) *
+        partition->inode_size / (partition->inode_size + 1 K);
+    // no more than the inode bitmap holds, it's sized
+    // by the number of blocks
+    if (tmp > (uint64_t) partition->blocks_per_group * blocks_of_bitmap)
+        tmp = (uint64_t) partition->blocks_per_group * blocks_of_bitmap;
+    // inode number -1 means no inode
+    partition->inode_count = (tmp < UINT32_MAX) ? tmp : UINT32_MAX - 1;
     partition->block_count = num_of_blocks;
-    tmp = partition->inode_count * partition->inode_size;
+    tmp = (uint64_t) partition->inode_count * partition->inode_size;
     partition->blocks = partition->inodes + tmp / partition->block_size;
     if (tmp % partition->block_size) ++partition->blocks;
 
     // init
     partition->inode_used = 0;
     partition->block_used = 0;
-
-    // init bitmap
-    memset(my_get_block_pointer(partition,
-        partition->inode_bitmap), 0, partition->block_size);
-    memset(my_get_block_pointer(partition,
-        partition->block_bitmap), 0, partition->block_size);
+    memset(partition->block_used_slots, 0, sizeof(partition->block_used_slots));
+
+    // init bitmap, the bits after the last inode and
+    // the last block are marked used so that nobody
+    // can allocate them
+    memset(my_get_block_pointer(partition, partition->groups), 0,
+        (uint64_t) (partition->inodes - partition->groups) * partition->block_size);
+    fill_bitmap(my_get_block_pointer(partition, partition->inode_bitmap),
+        partition->inode_count, (uint64_t) partition->blocks_per_group * blocks_of_bitmap);
+    fill_bitmap(my_get_block_pointer(partition, partition->block_bitmap),
+        partition->block_count, (uint64_t) partition->blocks_per_group * blocks_of_bitmap);
+
+    // init groups
+    for (uint32_t i = 0; i < partition->group_count; ++i)
+    {
+        tmp = partition->block_count - (uint64_t) i * partition->blocks_per_group;
+        my_get_group_pointer(partition, i)->free_blocks =
+            (tmp < partition->blocks_per_group) ? tmp : partition->blocks_per_group;
+    }
 
     // mark description block, bitmap blocks used
-    for (uint32_t i = 0; i < partition->blocks; ++i)
+    for (my_block_t i = 0; i < partition->blocks; ++i)
         my_mark_block_used(partition, i);
+    my_fold_block_used(partition);
 
     // make root directory
     my_mark_inode_used(partition, 0);
@@ -65,14 +183,16 @@ struct my_partition* my_make_partition(uint32_t size)
 
     // init root directory
     struct my_inode* root = my_get_inode_pointer(partition, 0);
+    memset(root, 0, partition->inode_size);
     root->reference_count = 1;
+    root->type = MY_TYPE_DIR;
     root->mtime = time(NULL);
     root->size = 0;
 
     return partition;
 }
 
-struct my_partition* my_load_partition_from_file(FILE* file)
+static struct my_partition* load_partition(FILE* file)
 {
     if (file == NULL) return NULL;
 
@@ -80,51 +200,104 @@ struct my_partition* my_load_partition_from_file(FILE* file)
     uint8_t* buffer = (uint8_t*) malloc(bs);
     uint8_t* partition;
     uint64_t ret, fs, pos = 0;
-    uint32_t ps;
+    uint64_t ps;
 
     // get file size
     fseek(file, 0L, SEEK_END);
     fs = ftell(file);
-    if (fs < 5 K) return NULL;
+    if (fs < 5 K)
+    {
+        free(buffer);
+        return NULL;
+    }
 
     // get partition size
     rewind(file);
     ret = fread(buffer, sizeof(uint8_t), bs, file);
-    ps = *((uint32_t*) buffer); // first 4 bytes should be the partition size
-    if (ps < 5 K) return NULL;
+    ps = *((uint64_t*) buffer); // first 8 bytes should be the partition size
+    struct my_partition* header = (struct my_partition*) buffer;
+    if (ps < 5 K || ret < sizeof(struct my_partition) ||
+        (header->flags & MY_PARTITION_64BIT_BLOCKS)
+            != MY_BLOCK_FLAGS || // made by the other variant
+        header->block_shift != block_shift_of(header->block_size) ||
+        header->block_shift == 0)
+    {
+        free(buffer);
+        return NULL;
+    }
     partition = (uint8_t*) malloc(ps);
+    if (partition == NULL)
+    {
+        free(buffer);
+        return NULL;
+    }
 
     // copy the first part
+    if (ret > ps) ret = ps;
     memcpy(partition, buffer, ret);
     pos += ret;
+    free(buffer);
 
     // load from file
-    while ((ret = fread(buffer, sizeof(uint8_t), 4 K, file)) > 0)
-    {
-        memcpy(partition + pos, buffer, ret);
+    while (pos < ps && (ret = fread(partition + pos, sizeof(uint8_t), ps - pos, file)) > 0)
         pos += ret;
-    }
 
+    // it's in private memory now
+    ((struct my_partition*) partition)->flags &= ~MY_PARTITION_SHARED;
     return (struct my_partition*) partition;
 }
 
+struct my_partition* my_load_partition_from_file(FILE* file)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    struct my_partition* partition = load_partition(file);
+    MY_STAT_END(MY_STAT_LOAD, begin, partition ? partition->size : 0);
+    MY_TRACE_END(MY_TRACE_LOAD, trace, 0, partition ? partition->size : 0);
+    return partition;
+}
+
 void my_dump_partition_to_file(struct my_partition* partition, FILE* file)
 {
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    // the files being erased would leak in the image
+    my_reap_wait(partition);
+    my_fold_block_used(partition);
     // :D simple and easy
     fwrite(partition, sizeof(uint8_t), partition->size, file);
+    MY_STAT_END(MY_STAT_DUMP, begin, partition->size);
+    MY_TRACE_END(MY_TRACE_DUMP, trace, 0, partition->size);
 }
 
 void my_free_partition(struct my_partition* partition)
 {
-    // just a wrapper, actually
+    my_reap_wait(partition);
+    my_extent_release(partition);
+    if (partition->flags & MY_PARTITION_SHARED)
+    {
+        my_detach_shared_partition(partition);
+        return;
+    }
+    my_lock_table_release(partition);
     free(partition);
 }
 
 uint8_t* my_get_block_pointer(
-    struct my_partition* partition, uint32_t block)
+    struct my_partition* partition, my_block_t block)
 {
     // use to save lines of codes
-    return (uint8_t*) partition + block * partition->block_size;
+    return (uint8_t*) partition + ((uint64_t) block << partition->block_shift);
+}
+
+/**
+ * `my_get_block_pointer` for the hot paths, the
+ * shift is a constant there.
+ */
+static inline uint8_t* block_at(
+    struct my_partition* partition, my_block_t block, const uint32_t shift)
+{
+    return (uint8_t*) partition + ((uint64_t) block << shift);
 }
 
 struct my_inode* my_get_inode_pointer(
@@ -133,167 +306,646 @@ struct my_inode* my_get_inode_pointer(
     // use to save lines of codes
     return (struct my_inode*) (
         my_get_block_pointer(partition, partition->inodes) +
-        partition->inode_size * inode);
+        (uint64_t) partition->inode_size * inode);
 }
 
-static int32_t first_zero(uint64_t x)
+struct my_group* my_get_group_pointer(
+    struct my_partition* partition, uint32_t group)
 {
-    int32_t i;
+    // use to save lines of codes
+    return (struct my_group*) my_get_block_pointer(
+        partition, partition->groups) + group;
+}
+
+static _Atomic uint32_t thread_count = 0;
+static _Thread_local uint32_t thread_id = UINT32_MAX;
+
+/**
+ * A small number for the calling thread, used to
+ * pick the preferred group and the counter stripe.
+ */
+static uint32_t my_thread_id()
+{
+    if (thread_id == UINT32_MAX)
+        thread_id = atomic_fetch_add(&thread_count, 1);
+    return thread_id;
+}
+
+/**
+ * Return the mask of the given bit inside its
+ * 64-bit word of bitmap.
+ */
+static inline uint64_t bit_of(uint64_t n)
+{
+    // bitmap is stored byte by byte, the first bit
+    // is the highest bit of the first byte. So it
+    // depends on endianness where the byte is in
+    // the word.
+    #ifndef MY_FS_BIG_ENDIAN
+        return 1ull << ((n & 0x38) | (7 - (n & 7)));
+    #else
+        return 1ull << (63 - (n & 63));
+    #endif
+}
+
+/**
+ * Return index of the first ZERO in the given word
+ * of bitmap, 64 if there's no ZERO.
+ */
+static inline int32_t first_zero(uint64_t x)
+{
+    x = ~x;
+    if (x == 0) return 64;
 
     // since the representation of int is different
-    // in 2 different endianness, we need to use 2
-    // different approach to get the first ZERO.
+    // in 2 different endianness, we need to swap the
+    // bytes in little endian, then the first bit is
+    // always the highest bit.
     #ifndef MY_FS_BIG_ENDIAN
-        uint8_t* p = ((uint8_t*) &x) - 1;
+        x = __builtin_bswap64(x);
     #endif
 
-    for (i = 63; i >= 0; --i)
+    return __builtin_clzll(x);
+}
+
+/**
+ * Set bits [from, to) of the bitmap without touching
+ * any counter, used to close the tail of a bitmap.
+ */
+static void fill_bitmap(uint8_t* bitmap, uint64_t from, uint64_t to)
+{
+    for (; from < to && (from & 7); ++from)
+        bitmap[from / 8] |= 0x80 >> (from & 7);
+    if (from >= to) return;
+    memset(bitmap + from / 8, 0xff, (to - from) / 8);
+    for (from += (to - from) & ~7ull; from < to; ++from)
+        bitmap[from / 8] |= 0x80 >> (from & 7);
+}
+
+/**
+ * Find the first ZERO in the words [0, count) of the
+ * bitmap, starting at the word `start` and wrapping
+ * around. Set it with compare-and-swap if `claim`.
+ * Return the bit index, or -1 if all bits are set.
+ */
+static uint32_t scan_bitmap(
+    _Atomic uint64_t* words, uint32_t count, uint32_t start, bool claim)
+{
+    uint32_t w = start;
+    for (uint32_t i = 0; i < count; ++i, ++w)
     {
-        #ifndef MY_FS_BIG_ENDIAN
-            if ((i & 7) == 7) ++p;
-            if (((*p >> (i & 7)) & 1) == 0) break;
-        #else
-            if ((x >> i & 1) == 0) break;
-        #endif
+        if (w >= count) w = 0;
+        uint64_t old = atomic_load_explicit(words + w, memory_order_relaxed);
+        while (old != 0xffffffffffffffff) // all 1
+        {
+            uint32_t z = first_zero(old);
+            if (!claim) return w * 64 + z;
+            if (atomic_compare_exchange_weak_explicit(words + w, &old,
+                    old | bit_of(z), memory_order_acquire, memory_order_relaxed))
+                return w * 64 + z;
+        }
     }
+    return -1;
+}
 
-    return 63 - i;
+static inline _Atomic uint64_t* bitmap_word(
+    struct my_partition* partition, my_block_t bitmap, uint64_t n)
+{
+    return (_Atomic uint64_t*) my_get_block_pointer(partition, bitmap) + n / 64;
 }
 
 uint32_t my_get_free_inode(struct my_partition* partition)
 {
-    uint32_t loop = partition->inode_count / 64;
-    uint64_t *p = (uint64_t*) my_get_block_pointer(
-        partition, partition->inode_bitmap);
-    for (uint32_t i = 0; i < loop; ++i, ++p) // 64 bits per loop
-        if (*p != 0xffffffffffffffff) // all 1
-            return first_zero(*p) + i * 64;
-    uint32_t base = loop * 64;
-    uint32_t z = first_zero(*p);
-    if (base + z >= partition->inode_count) return -1;
-    return base + z;
+    uint32_t words = (partition->inode_count + 63) / 64;
+    uint32_t inode = scan_bitmap(
+        bitmap_word(partition, partition->inode_bitmap, 0), words, 0, false);
+    if (inode >= partition->inode_count) return -1;
+    return inode;
 }
 
 void my_mark_inode_used(struct my_partition* partition, uint32_t inode)
 {
-    uint8_t* bitmap = my_get_block_pointer(
-        partition, partition->inode_bitmap) + (inode / 8);
-    uint8_t bit = 0x80 >> (inode & 7);
-    if (!(*bitmap & bit))
+    _Atomic uint64_t* word = bitmap_word(
+        partition, partition->inode_bitmap, inode);
+    uint64_t bit = bit_of(inode);
+    if (!(atomic_fetch_or(word, bit) & bit))
     {
         // Only increase the number when it was marked
         // available originally.
-        ++partition->inode_used;
-        *bitmap |= bit;
+        atomic_fetch_add(AS_ATOMIC(&partition->inode_used), 1);
     }
 }
 
+bool my_inode_used(struct my_partition* partition, uint32_t inode)
+{
+    return atomic_load_explicit(bitmap_word(partition,
+        partition->inode_bitmap, inode), memory_order_relaxed) & bit_of(inode);
+}
+
 void my_mark_inode_unused(struct my_partition* partition, uint32_t inode)
 {
-    uint8_t* bitmap = my_get_block_pointer(
-        partition, partition->inode_bitmap) + (inode / 8);
-    uint8_t bit = 0x80 >> (inode & 7);
-    if (*bitmap & bit)
+    _Atomic uint64_t* word = bitmap_word(
+        partition, partition->inode_bitmap, inode);
+    uint64_t bit = bit_of(inode);
+    if (atomic_fetch_and(word, ~bit) & bit)
     {
         // Only decrease the number when it was marked
         // unavailable originally.
-        --partition->inode_used;
-        *bitmap &= ~bit;
+        atomic_fetch_sub(AS_ATOMIC(&partition->inode_used), 1);
+    }
+}
+
+/**
+ * Account `delta` used blocks to the group of the
+ * given block and to the stripe of this thread.
+ */
+static inline void block_used_changed(
+    struct my_partition* partition, my_block_t block, int32_t delta)
+{
+    struct my_group* group = my_get_group_pointer(
+        partition, block / partition->blocks_per_group);
+    atomic_fetch_sub_explicit(AS_ATOMIC(&group->free_blocks),
+        delta, memory_order_relaxed);
+    atomic_fetch_add_explicit(AS_ATOMIC(&partition->block_used_slots[
+        my_thread_id() % MY_COUNTER_SLOTS].value), delta, memory_order_relaxed);
+}
+
+/**
+ * Walk the groups from the preferred group of this
+ * thread, return the first free block.
+ */
+static my_block_t find_free_block(struct my_partition* partition, bool claim)
+{
+    const uint32_t words = partition->blocks_per_group / 64;
+    uint32_t g = my_thread_id() % partition->group_count;
+    for (uint32_t n = 0; n < partition->group_count; ++n, ++g)
+    {
+        if (g >= partition->group_count) g = 0;
+        struct my_group* group = my_get_group_pointer(partition, g);
+        if (atomic_load_explicit(AS_ATOMIC(&group->free_blocks),
+                memory_order_relaxed) == 0) continue; // group is full
+        uint32_t hint = atomic_load_explicit(AS_ATOMIC(&group->hint),
+            memory_order_relaxed);
+        uint32_t bit = scan_bitmap(
+            bitmap_word(partition, partition->block_bitmap + g, 0),
+            words, hint < words ? hint : 0, claim);
+        if (bit == -1) continue;
+        my_block_t block = (my_block_t) g * partition->blocks_per_group + bit;
+        if (claim)
+        {
+            atomic_store_explicit(AS_ATOMIC(&group->hint), bit / 64,
+                memory_order_relaxed);
+            // the index doesn't hear of single blocks, it
+            // finds out when it hands out the run
+            block_used_changed(partition, block, 1);
+        }
+        return block;
+    }
+    return 0;
+}
+
+my_block_t my_get_free_block(struct my_partition* partition)
+{
+    MY_STAT_BEGIN(begin);
+    my_block_t block = find_free_block(partition, false);
+    MY_STAT_END(MY_STAT_ALLOC, begin, 0);
+    return block;
+}
+
+my_block_t my_alloc_block(struct my_partition* partition)
+{
+    MY_STAT_BEGIN(begin);
+    my_block_t block = find_free_block(partition, true);
+    MY_STAT_END(MY_STAT_ALLOC, begin, 0);
+    return block;
+}
+
+/**
+ * Claim the free bits from `bit` on, a word at a time,
+ * until `want` bits, a used bit or the bit `limit`.
+ * Return the number of bits claimed.
+ */
+static uint32_t claim_run(
+    _Atomic uint64_t* words, uint32_t bit, uint32_t want, uint32_t limit)
+{
+    uint32_t n = 0;
+    while (n < want && bit + n < limit)
+    {
+        _Atomic uint64_t* word = words + (bit + n) / 64;
+        uint64_t old = atomic_load_explicit(word, memory_order_relaxed);
+        uint32_t first = (bit + n) & 63, k;
+        uint64_t mask;
+        do
+        {
+            // the free bits of this word in a row
+            mask = 0;
+            for (k = first; k < 64 && n + k - first < want &&
+                    bit + n + k - first < limit && !(old & bit_of(k)); ++k)
+                mask |= bit_of(k);
+            if (mask == 0) return n;
+        } while (!atomic_compare_exchange_weak_explicit(word, &old,
+            old | mask, memory_order_acquire, memory_order_relaxed));
+        n += k - first;
+        if (k < 64) break; // the run ends inside this word
+    }
+    return n;
+}
+
+/**
+ * Give the free bits among [bit, bit + count) of the
+ * group at `base` back to the index of free runs. It
+ * is the part of a run from the index that wasn't
+ * claimed, the index forgot it already.
+ */
+static void unclaimed_to_index(
+    struct my_partition* partition, my_block_t base,
+    _Atomic uint64_t* words, uint32_t bit, uint32_t count)
+{
+    uint32_t run = 0;
+    for (uint32_t i = bit; i < bit + count; ++i)
+    {
+        if (!(atomic_load_explicit(words + i / 64, memory_order_relaxed) &
+                bit_of(i & 63)))
+        {
+            ++run;
+            continue;
+        }
+        if (run) my_extent_add(partition, base + i - run, run);
+        run = 0;
     }
+    if (run) my_extent_add(partition, base + bit + count - run, run);
 }
 
-uint32_t my_get_free_block(struct my_partition* partition)
+static my_block_t alloc_blocks(
+    struct my_partition* partition, my_block_t goal,
+    my_block_t count, my_block_t* got)
 {
-    uint32_t loop = partition->block_count / 64;
-    uint64_t *p = (uint64_t*) my_get_block_pointer(
-        partition, partition->block_bitmap);
-    for (uint32_t i = 0; i < loop; ++i, ++p) // 64 bits per loop
-        if (*p != 0xffffffffffffffff) // all 1
-            return first_zero(*p) + i * 64;
-    uint32_t base = loop * 64;
-    uint32_t z = first_zero(*p);
-    if (base + z >= partition->block_count) return 0;
-    return base + z;
+    const uint32_t bits = partition->blocks_per_group;
+    const uint32_t words = bits / 64;
+    const uint32_t want = (count < bits) ? count : bits;
+
+    // near fit or best fit from the index of free runs
+    my_block_t n, start = my_extent_alloc(partition, goal, want, &n);
+    if (n)
+    {
+        _Atomic uint64_t* bitmap = bitmap_word(partition,
+            partition->block_bitmap + start / bits, 0);
+        uint32_t claimed = claim_run(bitmap, start % bits, n, bits);
+        // the run is stale if someone was faster, what's
+        // still free of it goes back to the index
+        if (claimed < n)
+            unclaimed_to_index(partition, start - start % bits, bitmap,
+                start % bits + claimed, n - claimed);
+        if (claimed)
+        {
+            block_used_changed(partition, start, claimed);
+            *got = claimed;
+            return start;
+        }
+    }
+
+    // from the group of the goal, else spread threads
+    uint32_t g = (goal && goal < partition->block_count) ? goal / bits :
+        my_thread_id() % partition->group_count;
+    for (uint32_t n = 0; n < partition->group_count; ++n, ++g)
+    {
+        if (g >= partition->group_count) g = 0;
+        struct my_group* group = my_get_group_pointer(partition, g);
+        if (atomic_load_explicit(AS_ATOMIC(&group->free_blocks),
+                memory_order_relaxed) == 0) continue; // group is full
+        _Atomic uint64_t* bitmap = bitmap_word(
+            partition, partition->block_bitmap + g, 0);
+        uint32_t hint = atomic_load_explicit(AS_ATOMIC(&group->hint),
+            memory_order_relaxed);
+        if (hint >= words) hint = 0;
+        uint32_t bit = 0, claimed = 0;
+
+        // a long run had better start in an empty word
+        // than in the holes left by others
+        for (uint32_t i = 0, w = hint; want >= 64 && i < words && !claimed; ++i, ++w)
+        {
+            if (w >= words) w = 0;
+            if (atomic_load_explicit(bitmap + w, memory_order_relaxed) == 0)
+                claimed = claim_run(bitmap, bit = w * 64, want, bits);
+        }
+        if (claimed == 0)
+        {
+            bit = scan_bitmap(bitmap, words, hint, true);
+            if (bit == -1) continue;
+            claimed = 1 + claim_run(bitmap, bit + 1, want - 1, bits);
+        }
+
+        my_block_t block = (my_block_t) g * bits + bit;
+        atomic_store_explicit(AS_ATOMIC(&group->hint),
+            (bit + claimed - 1) / 64, memory_order_relaxed);
+        block_used_changed(partition, block, claimed);
+        my_extent_take(partition, block, claimed);
+        *got = claimed;
+        return block;
+    }
+    *got = 0;
+    return 0;
+}
+
+my_block_t my_alloc_blocks(
+    struct my_partition* partition, my_block_t goal,
+    my_block_t count, my_block_t* got)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    my_block_t block = alloc_blocks(partition, goal, count, got);
+    MY_STAT_END(MY_STAT_ALLOC, begin, 0);
+    MY_TRACE_END(MY_TRACE_ALLOC, trace, 0,
+        (uint64_t) *got << partition->block_shift);
+    return block;
+}
+
+my_block_t my_fold_block_used(struct my_partition* partition)
+{
+    for (uint32_t i = 0; i < MY_COUNTER_SLOTS; ++i)
+    {
+        int64_t delta = atomic_exchange(
+            AS_ATOMIC(&partition->block_used_slots[i].value), 0);
+        if (delta) atomic_fetch_add(AS_ATOMIC(&partition->block_used),
+            (my_block_t) delta);
+    }
+    return atomic_load(AS_ATOMIC(&partition->block_used));
 }
 
-void my_mark_block_used(struct my_partition* partition, uint32_t block)
+void my_mark_block_used(struct my_partition* partition, my_block_t block)
 {
-    uint8_t* bitmap = my_get_block_pointer(
-        partition, partition->block_bitmap) + (block / 8);
-    uint8_t bit = 0x80 >> (block & 7);
-    if (!(*bitmap & bit))
+    _Atomic uint64_t* word = bitmap_word(
+        partition, partition->block_bitmap, block);
+    uint64_t bit = bit_of(block);
+    if (!(atomic_fetch_or(word, bit) & bit))
     {
         // Only increase the number when it was marked
         // available originally.
-        ++partition->block_used;
-        *bitmap |= bit;
+        block_used_changed(partition, block, 1);
     }
 }
 
-void my_mark_block_unused(struct my_partition* partition, uint32_t block)
+void my_mark_block_unused(struct my_partition* partition, my_block_t block)
 {
-    uint8_t* bitmap = my_get_block_pointer(
-        partition, partition->block_bitmap) + (block / 8);
-    uint8_t bit = 0x80 >> (block & 7);
-    if (*bitmap & bit)
+    _Atomic uint64_t* word = bitmap_word(
+        partition, partition->block_bitmap, block);
+    uint64_t bit = bit_of(block);
+    if (atomic_fetch_and(word, ~bit) & bit)
     {
         // Only decrease the number when it was marked
         // unavailable originally.
-        --partition->block_used;
-        *bitmap &= ~bit;
+        block_used_changed(partition, block, -1);
     }
 }
 
-struct my_dir_list* my_ls_dir(
-    struct my_partition* partition, uint32_t dir)
+void my_mark_blocks_unused(
+    struct my_partition* partition, my_block_t block, my_block_t count)
+{
+    const uint32_t bits = partition->blocks_per_group;
+    my_block_t start = block, end = block + count;
+    int32_t cleared = 0;
+    while (block < end)
+    {
+        // the bits of this word in the run
+        uint32_t first = block & 63;
+        uint32_t last = (end - block < 64 - first) ? first + (end - block) : 64;
+        uint64_t mask = 0;
+        if (last - first == 64) mask = ~0ull;
+        else for (uint32_t k = first; k < last; ++k) mask |= bit_of(k);
+        uint64_t old = atomic_fetch_and(
+            bitmap_word(partition, partition->block_bitmap, block), ~mask);
+        cleared += __builtin_popcountll(old & mask);
+        block += last - first;
+        // account it per group, words never cross them
+        if (cleared && (block >= end || block % bits == 0))
+        {
+            block_used_changed(partition, block - 1, -cleared);
+            cleared = 0;
+        }
+    }
+    my_extent_add(partition, start, count);
+}
+
+/**
+ * Blocks being released. They're gathered, sorted
+ * and cleared from the bitmap a run at a time.
+ */
+struct free_batch
+{
+    uint32_t count;
+    my_block_t blocks[FREE_BATCH_SIZE];
+};
+
+static int compare_block(const void* a, const void* b)
+{
+    my_block_t x = *(const my_block_t*) a, y = *(const my_block_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void flush_batch(struct my_partition* partition, struct free_batch* batch)
+{
+    my_block_t* blocks = batch->blocks;
+    // usually in order already, files get runs
+    for (uint32_t i = 1; i < batch->count; ++i)
+        if (blocks[i] < blocks[i - 1])
+        {
+            qsort(blocks, batch->count, sizeof(my_block_t), compare_block);
+            break;
+        }
+    for (uint32_t i = 0, j; i < batch->count; i = j)
+    {
+        for (j = i + 1; j < batch->count && blocks[j] == blocks[j - 1] + 1; ++j);
+        my_mark_blocks_unused(partition, blocks[i], j - i);
+    }
+    batch->count = 0;
+}
+
+static inline void batch_free(
+    struct my_partition* partition, struct free_batch* batch, my_block_t block)
+{
+    if (batch->count == FREE_BATCH_SIZE) flush_batch(partition, batch);
+    batch->blocks[batch->count++] = block;
+}
+
+/**
+ * Hot paths of the file layer, a copy for each block
+ * size so divisions and mods are shifts and masks.
+ * A partition picks its table by `block_shift`.
+ */
+struct block_ops
+{
+    my_block_t (*file_block)(
+        struct my_partition* partition, struct my_inode* inode,
+        uint64_t index, bool alloc);
+    void (*free_blocks)(
+        struct my_partition* partition, my_block_t block, uint32_t level,
+        struct free_batch* batch);
+    uint32_t (*file_read)(
+        struct my_partition* partition, struct my_file* file,
+        uint8_t* buffer, uint32_t buffer_size, bool line);
+    uint32_t (*file_write)(
+        struct my_partition* partition, struct my_file* file,
+        uint8_t* buffer, uint32_t buffer_size);
+    bool (*reserve)(
+        struct my_partition* partition, struct my_inode* inode, uint64_t end);
+    bool (*relocate)(
+        struct my_partition* partition, struct my_inode* inode);
+};
+
+/**
+ * Blocks claimed ahead by `my_alloc_blocks`, handed
+ * out in order so a file gets consecutive blocks.
+ */
+struct block_run
+{
+    my_block_t next;
+    my_block_t count;
+    // about how many blocks are still needed
+    my_block_t want;
+    // zero the blocks before they're linked
+    bool zero;
+};
+
+static inline const struct block_ops* ops_of(struct my_partition* partition);
+static bool pend(struct my_file* file, uint8_t* buffer, uint32_t size);
+static bool flush_pending(
+    struct my_partition* partition, struct my_file* file, bool held);
+static void clear_range(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t from, uint64_t to);
+static void erase_file(
+    struct my_partition* partition, struct my_inode* inode);
+static void punch_file(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t first, uint64_t last);
+
+/**
+ * Read the hex number at `p`, up to `end`. Return
+ * false if there are no digits.
+ */
+static bool parse_hex(const uint8_t* p, const uint8_t* end, uint32_t* value)
+{
+    uint32_t v = 0;
+    const uint8_t* q;
+    for (q = p; q < end; ++q)
+    {
+        uint8_t digit;
+        if (*q >= '0' && *q <= '9') digit = *q - '0';
+        else if ((*q | 0x20) >= 'a' && (*q | 0x20) <= 'f') digit = (*q | 0x20) - 'a' + 10;
+        else break;
+        v = (v << 4) | digit;
+    }
+    *value = v;
+    return q != p;
+}
+
+/**
+ * Put the entry of the line "inode|type|filename" of
+ * [p, end), without the '\n', in front of the list.
+ * Broken lines are skipped.
+ */
+static void parse_entry(
+    const uint8_t* p, const uint8_t* end, struct my_dir_list** head)
 {
-    struct my_file* directory = my_file_open(partition, dir);
-    struct my_dir_list *head = NULL, *node;
-    uint32_t len = 1;
     uint32_t inode, type;
-    int r;
-    char* buffer = (char*) malloc(BUFFER_SIZE);
-    char *p, *q;
-    while (len != 0)
-    {
-        len = my_file_read_line(partition, directory, (uint8_t*) buffer, BUFFER_SIZE);
-        if (len == 0 || len < 6) continue;
-        q = p = buffer;
-
-        // inode
-        while (*p != '|' && *p != '\n' && (buffer + len - p) > 0) ++p;
-        if (p == q) continue;
-        *p = '\0';
-        r = sscanf(q, "%x", &inode);
-        if (r < 1) continue;
-
-        // type
-        q = ++p;
-        while (*p != '|' && *p != '\n' && (buffer + len - p) > 0) ++p;
-        if (p == q) continue;
-        *p = '\0';
-        r = sscanf(q, "%x", &type);
-        if (r < 1) continue;
-
-        // filename
-        q = ++p;
-        while (*p != '\n' && (buffer + len - p) > 0) ++p;
-        if (p == q) continue;
-        *p = '\0';
-
-        // linked list
-        node = (struct my_dir_list*) malloc(sizeof(struct my_dir_list));
-        node->inode = inode;
-        node->type = type;
-        strcpy(node->filename, q);
-        node->next = head;
-        head = node;
+    const uint8_t* bar = my_scan_byte(p, end, '|');
+    if (bar == end || !parse_hex(p, bar, &inode)) return;
+    p = bar + 1;
+    bar = my_scan_byte(p, end, '|');
+    if (bar == end || !parse_hex(p, bar, &type)) return;
+    p = bar + 1;
+    if (p == end || end - p >= sizeof(((struct my_dir_list*) 0)->filename))
+        return;
+
+    // linked list
+    struct my_dir_list* node = (struct my_dir_list*) my_slab_alloc(&dir_list_slab);
+    node->inode = inode;
+    node->type = type;
+    memcpy(node->filename, p, end - p);
+    node->filename[end - p] = '\0';
+    node->next = *head;
+    *head = node;
+}
+
+/**
+ * `my_ls_dir` without locking the directory. The
+ * lines are parsed right in the blocks, only the
+ * ones cut by the end of a block are copied.
+ */
+static struct my_dir_list* ls_dir(
+    struct my_partition* partition, uint32_t dir)
+{
+    struct my_inode* inode = my_get_inode_pointer(partition, dir);
+    const uint64_t size = atomic_load(AS_ATOMIC(&inode->size));
+    const uint32_t bs = partition->block_size;
+    struct my_dir_list* head = NULL;
+    // the start of a line from the block before
+    uint8_t carry[BUFFER_SIZE];
+    uint32_t carried = 0;
+    // it's too long for an entry, drop it
+    bool too_long = false;
+
+    for (uint64_t pos = 0; pos < size; pos += bs)
+    {
+        uint32_t len = (size - pos < bs) ? size - pos : bs;
+        my_block_t block = ops_of(partition)->file_block(
+            partition, inode, pos >> partition->block_shift, false);
+        if (block == 0)
+        {
+            // a hole has no lines
+            carried = 0;
+            too_long = false;
+            continue;
+        }
+        const uint8_t* p = my_get_block_pointer(partition, block);
+        const uint8_t* end = p + len;
+        if (carried || too_long)
+        {
+            const uint8_t* newline = my_scan_byte(p, end, '\n');
+            if (carried + (newline - p) > sizeof(carry)) too_long = true;
+            if (!too_long)
+            {
+                memcpy(carry + carried, p, newline - p);
+                carried += newline - p;
+            }
+            if (newline == end) continue;
+            if (!too_long) parse_entry(carry, carry + carried, &head);
+            carried = 0;
+            too_long = false;
+            p = newline + 1;
+        }
+        while (p < end)
+        {
+            const uint8_t* newline = my_scan_byte(p, end, '\n');
+            if (newline == end)
+            {
+                // it goes on in the next block
+                carried = end - p;
+                if (carried > sizeof(carry)) too_long = true;
+                else memcpy(carry, p, carried);
+                if (too_long) carried = 0;
+                break;
+            }
+            parse_entry(p, newline, &head);
+            p = newline + 1;
+        }
     }
-    my_file_close(partition, directory);
-    free(buffer);
+    // the last line may have no '\n'
+    if (carried && !too_long) parse_entry(carry, carry + carried, &head);
     return head;
 }
 
+struct my_dir_list* my_ls_dir(
+    struct my_partition* partition, uint32_t dir)
+{
+    MY_STAT_BEGIN(begin);
+    uint32_t lock = my_range_lock(partition, dir, MY_RANGE_ALL, false);
+    struct my_dir_list* list = ls_dir(partition, dir);
+    my_range_unlock(partition, dir, lock);
+    MY_STAT_END(MY_STAT_LS_DIR, begin, 0);
+    return list;
+}
+
 void my_free_dir_list(
     struct my_partition* partition, struct my_dir_list* list)
 {
@@ -302,16 +954,117 @@ void my_free_dir_list(
     while (list)
     {
         next = list->next;
-        free(list);
+        my_slab_free(&dir_list_slab, list);
         list = next;
     }
 }
 
+/**
+ * Inodes are split into a range for each block
+ * group, whole words of the bitmap. The files of
+ * range g keep their data in group g.
+ */
+static inline uint32_t inodes_per_group(struct my_partition* partition)
+{
+    uint32_t n = (partition->inode_count + partition->group_count - 1) /
+        partition->group_count;
+    return (n + 63) / 64 * 64;
+}
+
+static inline uint32_t inode_group_count(struct my_partition* partition)
+{
+    uint32_t per = inodes_per_group(partition);
+    return (partition->inode_count + per - 1) / per;
+}
+
+/**
+ * Block the data of the inode had better be close to,
+ * the start of the group of its range.
+ */
+static my_block_t home_of(struct my_partition* partition, struct my_inode* inode)
+{
+    uint64_t n = ((uint8_t*) inode -
+        my_get_block_pointer(partition, partition->inodes)) / partition->inode_size;
+    return (my_block_t) (n / inodes_per_group(partition)) *
+        partition->blocks_per_group;
+}
+
+static uint32_t free_inodes_of(struct my_partition* partition, uint32_t group)
+{
+    const uint32_t per = inodes_per_group(partition);
+    _Atomic uint64_t* words = bitmap_word(
+        partition, partition->inode_bitmap, (uint64_t) group * per);
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < per / 64; ++i)
+        used += __builtin_popcountll(
+            atomic_load_explicit(words + i, memory_order_relaxed));
+    return per - used; // the bits after the last inode are set
+}
+
+/**
+ * Spread the directories: from a different group
+ * every time, take the first one with at least the
+ * average of free inodes and free blocks.
+ */
+static uint32_t dir_group(struct my_partition* partition)
+{
+    static _Atomic uint32_t next = 0;
+    const uint32_t groups = inode_group_count(partition);
+    uint64_t blocks = 0;
+    for (uint32_t g = 0; g < groups; ++g)
+        blocks += atomic_load_explicit(AS_ATOMIC(
+            &my_get_group_pointer(partition, g)->free_blocks), memory_order_relaxed);
+    uint64_t inodes = partition->inode_count -
+        atomic_load(AS_ATOMIC(&partition->inode_used));
+    uint32_t start = atomic_fetch_add(&next, 1) % groups;
+    for (uint32_t n = 0, g = start; n < groups; ++n, g = (g + 1) % groups)
+        if ((uint64_t) free_inodes_of(partition, g) * groups >= inodes &&
+            (uint64_t) my_get_group_pointer(partition, g)->free_blocks *
+                groups >= blocks)
+            return g;
+    return start;
+}
+
+/**
+ * Claim a free inode, walking the ranges from the
+ * given group.
+ */
+static uint32_t claim_inode(struct my_partition* partition, uint32_t group)
+{
+    const uint32_t per = inodes_per_group(partition);
+    const uint32_t groups = inode_group_count(partition);
+    for (uint32_t n = 0, g = group % groups; n < groups; ++n, g = (g + 1) % groups)
+    {
+        uint32_t bit = scan_bitmap(bitmap_word(partition,
+            partition->inode_bitmap, (uint64_t) g * per), per / 64, 0, true);
+        if (bit == -1) continue;
+        uint32_t inode = g * per + bit;
+        if (inode < partition->inode_count) return inode;
+    }
+    return -1;
+}
+
 uint32_t my_touch(struct my_partition* partition)
 {
-    uint32_t inode = my_get_free_inode(partition);
+    return my_touch_in(partition, partition->root, MY_TYPE_FILE);
+}
+
+uint32_t my_touch_in(struct my_partition* partition, uint32_t dir, uint8_t type)
+{
+    MY_STAT_BEGIN(begin);
+    // a file next to its directory, a directory away
+    // from the others
+    uint32_t inode = claim_inode(partition, (type == MY_TYPE_DIR) ?
+        dir_group(partition) : dir / inodes_per_group(partition));
     if (inode == -1) return -1;
-    my_mark_inode_used(partition, inode);
+    atomic_fetch_add(AS_ATOMIC(&partition->inode_used), 1);
+
+    // a block number 0 means the block is not allocated
+    struct my_inode* s_inode = my_get_inode_pointer(partition, inode);
+    memset(s_inode, 0, partition->inode_size);
+    s_inode->type = type;
+    s_inode->mtime = time(NULL);
+    MY_STAT_END(MY_STAT_CREATE, begin, 0);
     return inode;
 }
 
@@ -320,21 +1073,51 @@ struct my_dir_list* my_get_file(
     struct my_dir_list* file_list, const char* filename)
 {
     if (filename == NULL) return NULL;
+    MY_STAT_BEGIN(begin);
     while (file_list)
         if (strcmp(file_list->filename, filename) == 0) break;
         else file_list = file_list->next;
+    MY_STAT_END(MY_STAT_LOOKUP, begin, 0);
     return file_list;
 }
 
+/**
+ * Mark the directory as being added to, the caller
+ * holds its whole range. Return false if an rmdir
+ * claimed it.
+ */
+static bool begin_adding(struct my_partition* partition, uint32_t dir)
+{
+    uint8_t* state = &my_get_inode_pointer(partition, dir)->state;
+    // only the holder adds, so ADDING here is stale
+    uint8_t seen = atomic_load(AS_ATOMIC(state));
+    do if (seen == DIR_REMOVED) return false;
+    while (!atomic_compare_exchange_weak(AS_ATOMIC(state), &seen, DIR_ADDING));
+    return true;
+}
+
+static void end_adding(struct my_partition* partition, uint32_t dir)
+{
+    atomic_store(AS_ATOMIC(&my_get_inode_pointer(partition, dir)->state), DIR_IDLE);
+}
+
 bool my_dir_reference_file(
     struct my_partition* partition,
     uint32_t dir, uint32_t file, uint8_t type, const char* filename)
 {
-    struct my_dir_list* list = my_ls_dir(partition, dir);
-    if (strlen(filename) == 0 || my_get_file(partition, list, filename) != NULL)
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    // hold the whole directory, so nobody can add the
+    // same filename between checking and appending
+    uint32_t lock = my_range_lock(partition, dir, MY_RANGE_ALL, true);
+    struct my_dir_list* list = ls_dir(partition, dir);
+    if (strlen(filename) == 0 || my_get_file(partition, list, filename) != NULL ||
+        !my_inode_used(partition, dir) || !begin_adding(partition, dir))
     {
-        // if filename already exist or filename with length of 0
+        // if filename already exist or filename with length of 0,
+        // or the directory was removed meanwhile
         my_free_dir_list(partition, list);
+        my_range_unlock(partition, dir, lock);
         return false;
     }
     my_free_dir_list(partition, list);
@@ -344,55 +1127,264 @@ bool my_dir_reference_file(
     // append "aaa|1|filename\n"
     uint32_t line_len = snprintf(buffer, BUFFER_SIZE, "%x|%x|%s\n", file, type, filename);
     if (line_len == 511) buffer[line_len++] = '\n'; // if filename was too large
-    struct my_file* directory = my_file_open_end(partition, dir); // append mode
-    my_file_write(partition, directory, (uint8_t*) buffer, line_len);
-    my_file_close(partition, directory);
-    ++my_get_inode_pointer(partition, file)->reference_count; // increase reference count
+    struct my_file* directory = my_file_open(partition, dir);
+    struct my_inode* inode = directory->inode;
+    uint64_t end = directory->position = inode->size;
+    bool ok = ops_of(partition)->file_write(
+        partition, directory, (uint8_t*) buffer, line_len) == line_len;
+    ok = my_file_close(partition, directory) && ok;
+    if (!ok)
+    {
+        // out of space, the part of the line written and
+        // the blocks taken for it go
+        my_map_lock(partition, dir);
+        punch_file(partition, inode,
+            (end + partition->block_size - 1) >> partition->block_shift,
+            UINT64_MAX);
+        atomic_store(AS_ATOMIC(&inode->size), end);
+        my_map_unlock(partition, dir);
+    }
+    end_adding(partition, dir);
+
+    // increase reference count, before an unlink can
+    // see the entry
+    if (ok)
+        atomic_fetch_add(AS_ATOMIC(
+            &my_get_inode_pointer(partition, file)->reference_count), 1);
+    my_range_unlock(partition, dir, lock);
 
     free(buffer);
+    MY_STAT_END(MY_STAT_LINK, begin, 0);
+    MY_TRACE_END(MY_TRACE_LINK, trace, file, 0);
 
-    return true;
+    return ok;
 }
 
-void my_dir_unreference_file(
-    struct my_partition* partition,
-    uint32_t dir, const char* filename)
+/**
+ * Put `name` in the open addressing table of names,
+ * `slots` is a power of 2. Return false if it's there
+ * already.
+ */
+static bool name_insert(const char** table, uint32_t slots, const char* name)
 {
-    struct my_dir_list* list = my_ls_dir(partition, dir);
-    struct my_dir_list* file = my_get_file(partition, list, filename);
-    if (file == NULL)
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char* p = name; *p; ++p)
+        hash = (hash ^ (uint8_t) *p) * 16777619u;
+    for (uint32_t i = hash & (slots - 1); ; i = (i + 1) & (slots - 1))
     {
-        my_free_dir_list(partition, list);
-        return;
+        if (table[i] == NULL)
+        {
+            table[i] = name;
+            return true;
+        }
+        if (strcmp(table[i], name) == 0) return false;
     }
+}
 
-    // erase the directory then rewrite the contents
-    // except the unreferenced file
-    struct my_dir_list* iter = list;
-    my_erase_file(partition, dir);
-    struct my_file* fp = my_file_open(partition, dir);
-    uint8_t* buffer = (uint8_t*) malloc(BUFFER_SIZE);
-    while (iter)
+/**
+ * Flush the lines of the entries [first, last) of
+ * `my_dir_reference_files` gathered in the write-back
+ * buffer of the directory, and count them. If the
+ * flush fails, the directory is cut back to where it
+ * was before them and they are not referenced.
+ */
+static bool flush_entries(
+    struct my_partition* partition, struct my_file* directory,
+    struct my_dir_entry* entries, uint32_t first, uint32_t last,
+    uint32_t* referenced)
+{
+    uint64_t end = directory->pending_position;
+    bool ok = flush_pending(partition, directory, true);
+    if (!ok) atomic_store(AS_ATOMIC(&directory->inode->size), end);
+    for (uint32_t i = first; i < last; ++i)
+        if (!entries[i].referenced) continue;
+        else if (ok) ++*referenced;
+        else entries[i].referenced = false;
+    return ok;
+}
+
+uint32_t my_dir_reference_files(
+    struct my_partition* partition, uint32_t dir,
+    struct my_dir_entry* entries, uint32_t count)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    uint32_t lock = my_range_lock(partition, dir, MY_RANGE_ALL, true);
+    struct my_dir_list* list = ls_dir(partition, dir);
+
+    // the names in the directory and the batch so far
+    uint32_t names = count, slots = 16;
+    for (struct my_dir_list* e = list; e; e = e->next) ++names;
+    while (slots < names * 2) slots <<= 1;
+    const char** table = (const char**) calloc(slots, sizeof(char*));
+    for (struct my_dir_list* e = list; e; e = e->next)
+        name_insert(table, slots, e->filename);
+
+    // the entries that go in, and the bytes of their lines
+    char* buffer = (char*) malloc(BUFFER_SIZE);
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        struct my_dir_entry* entry = &entries[i];
+        uint32_t line_len = snprintf(buffer, BUFFER_SIZE, "%x|%x|%s\n",
+            entry->inode, entry->type, entry->filename);
+        entry->referenced = strlen(entry->filename) != 0 &&
+            line_len < BUFFER_SIZE && name_insert(table, slots, entry->filename);
+        if (entry->referenced) bytes += line_len;
+    }
+
+    // all the lines are appended in one go, into blocks
+    // taken before, so a lack of space adds none of them
+    struct my_file* directory = my_file_open(partition, dir);
+    directory->position = directory->inode->size;
+    // a directory removed meanwhile takes nothing
+    bool adding = my_inode_used(partition, dir) && begin_adding(partition, dir);
+    bool ok = adding &&
+        my_file_reserve(partition, dir, directory->position + bytes);
+    uint32_t referenced = 0, first = 0;
+    for (uint32_t i = 0; i < count; ++i)
     {
-        if (iter != file)
+        struct my_dir_entry* entry = &entries[i];
+        if (!entry->referenced) continue;
+        if (ok)
         {
-            uint32_t line_len = snprintf(
-                (char*) buffer, 512, "%x|%x|%s\n",
-                iter->inode,
-                iter->type,
-                iter->filename);
-            if (line_len == 511) buffer[line_len++ - 1] = '\n';
-            my_file_write(partition, fp, buffer, line_len);
+            uint32_t line_len = snprintf(buffer, BUFFER_SIZE, "%x|%x|%s\n",
+                entry->inode, entry->type, entry->filename);
+            if (!pend(directory, (uint8_t*) buffer, line_len))
+            {
+                ok = flush_entries(partition, directory, entries, first, i, &referenced);
+                first = i;
+                if (ok) pend(directory, (uint8_t*) buffer, line_len);
+            }
         }
-        iter = iter->next;
+        if (!ok) entry->referenced = false;
     }
-    my_file_close(partition, fp);
+    if (ok) flush_entries(partition, directory, entries, first, count, &referenced);
+    my_file_close(partition, directory);
+    if (adding) end_adding(partition, dir);
+    for (uint32_t i = 0; i < count; ++i)
+        if (entries[i].referenced)
+            atomic_fetch_add(AS_ATOMIC(&my_get_inode_pointer(
+                partition, entries[i].inode)->reference_count), 1);
+    my_range_unlock(partition, dir, lock);
     free(buffer);
-    struct my_inode* inode = my_get_inode_pointer(partition, file->inode);
-    --inode->reference_count; // decrease reference count
-    if (inode->reference_count == 0) // remove if reference count is ZERO
+    free(table);
+    my_free_dir_list(partition, list);
+    MY_STAT_END(MY_STAT_LINK, begin, 0);
+    MY_TRACE_END(MY_TRACE_LINK, trace, dir, 0);
+    return referenced;
+}
+
+/**
+ * Rewrite the directory with the lines of `list`
+ * except `skip`. The new contents are built first
+ * and their blocks taken before anything is written
+ * over the old ones, which stay if there's not
+ * enough space. The caller holds the whole range of
+ * the directory.
+ */
+static bool rewrite_dir(
+    struct my_partition* partition, uint32_t dir,
+    struct my_dir_list* list, struct my_dir_list* skip)
+{
+    uint64_t size = 0, capacity = 4 * BUFFER_SIZE;
+    uint8_t* data = (uint8_t*) malloc(capacity);
+    for (struct my_dir_list* iter = list; iter; iter = iter->next)
+    {
+        if (iter == skip) continue;
+        if (capacity - size < BUFFER_SIZE)
+            data = (uint8_t*) realloc(data, capacity *= 2);
+        uint32_t line_len = snprintf((char*) data + size, BUFFER_SIZE,
+            "%x|%x|%s\n", iter->inode, iter->type, iter->filename);
+        if (line_len >= BUFFER_SIZE)
+        {
+            // cut like a name too long
+            line_len = BUFFER_SIZE - 1;
+            data[size + line_len - 1] = '\n';
+        }
+        size += line_len;
+    }
+
+    struct my_inode* inode = my_get_inode_pointer(partition, dir);
+    bool ok = my_file_reserve(partition, dir, size);
+    if (ok && size)
+    {
+        // over blocks it has, nothing to allocate
+        struct my_file* fp = my_file_open(partition, dir);
+        ok = ops_of(partition)->file_write(
+            partition, fp, data, size) == size;
+        my_file_close(partition, fp);
+    }
+    if (ok)
+    {
+        // the blocks after the new end go
+        my_map_lock(partition, dir);
+        punch_file(partition, inode,
+            (size + partition->block_size - 1) >> partition->block_shift,
+            UINT64_MAX);
+        atomic_store(AS_ATOMIC(&inode->size), size);
+        my_map_unlock(partition, dir);
+    }
+    free(data);
+    return ok;
+}
+
+/**
+ * Unreference the filename in the directory. With
+ * `empty_only` a directory goes only if it's empty.
+ * It's claimed rather than locked, nothing can be
+ * added to it after, and one being added to counts
+ * as not empty. Only one range is held at a time.
+ */
+static enum my_unlink unreference(
+    struct my_partition* partition,
+    uint32_t dir, const char* filename, bool empty_only)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    uint32_t lock = my_range_lock(partition, dir, MY_RANGE_ALL, true);
+    struct my_dir_list* list = ls_dir(partition, dir);
+    struct my_dir_list* file = my_get_file(partition, list, filename);
+    enum my_unlink result = MY_UNLINK_DONE;
+    struct my_inode* inode = file ? my_get_inode_pointer(partition, file->inode) : NULL;
+    bool claimed = false;
+    if (file == NULL) result = MY_UNLINK_NO_ENTRY;
+    else if (empty_only && file->type == MY_TYPE_DIR)
+    {
+        // a directory in itself isn't empty
+        uint8_t idle = DIR_IDLE;
+        claimed = file->inode != dir && atomic_compare_exchange_strong(
+            AS_ATOMIC(&inode->state), &idle, DIR_REMOVED);
+        if (!claimed || atomic_load(AS_ATOMIC(&inode->size)))
+            result = MY_UNLINK_NOT_EMPTY;
+    }
+    if (result == MY_UNLINK_DONE && !rewrite_dir(partition, dir, list, file))
+        result = MY_UNLINK_NO_SPACE;
+    my_range_unlock(partition, dir, lock);
+    // decrease reference count, remove if reference count is ZERO
+    if (result == MY_UNLINK_DONE &&
+        atomic_fetch_sub(AS_ATOMIC(&inode->reference_count), 1) == 1)
         my_delete_file(partition, file->inode);
+    else if (claimed) atomic_store(AS_ATOMIC(&inode->state), DIR_IDLE);
     my_free_dir_list(partition, list);
+    MY_STAT_END(MY_STAT_UNLINK, begin, 0);
+    MY_TRACE_END(MY_TRACE_UNLINK, trace, dir, 0);
+    return result;
+}
+
+bool my_dir_unreference_file(
+    struct my_partition* partition,
+    uint32_t dir, const char* filename)
+{
+    return unreference(partition, dir, filename, false) == MY_UNLINK_DONE;
+}
+
+enum my_unlink my_dir_unreference_empty(
+    struct my_partition* partition,
+    uint32_t dir, const char* filename)
+{
+    return unreference(partition, dir, filename, true);
 }
 
 void my_delete_file(struct my_partition* partition, uint32_t inode)
@@ -401,521 +1393,1008 @@ void my_delete_file(struct my_partition* partition, uint32_t inode)
     my_mark_inode_unused(partition, inode);
 }
 
-void my_erase_file(struct my_partition* partition, uint32_t inode)
+/**
+ * Next block of the run, claim a new run when it's
+ * used up. Without a run, allocate a single block.
+ * Return 0 if there's no more space.
+ */
+static my_block_t take_block(
+    struct my_partition* partition, struct block_run* run)
 {
-    struct my_inode* s_inode = my_get_inode_pointer(partition, inode);
-    if (s_inode->size == 0) return;
-    const uint32_t ind = partition->block_size / sizeof(uint32_t);
-    const uint32_t d_ind = ind * ind;
-    uint32_t blocks = s_inode->size / partition->block_size, tmp;
-    if (s_inode->size % partition->block_size) ++blocks;
-    s_inode->size = 0;
-
-    // direct block
-    tmp = (blocks > NUM_OF_DIRECT_BLOCKS) ? NUM_OF_DIRECT_BLOCKS : blocks;
-    for (int i = 0; i < tmp; ++i)
-        my_mark_block_unused(partition, s_inode->direct_block[i]);
-    blocks -= tmp;
-
-    // indirect block
-    if (blocks == 0) return;
-    tmp = (blocks < ind) ? blocks : ind;
-    uint32_t in = tmp;
-
-    for (uint32_t i = 0; i < in; ++i)
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                s_inode->indirect_block
-            ))[i]
-        );
-    my_mark_block_unused(partition, s_inode->indirect_block);
-    blocks -= tmp;
-
-    // double indirect block
-    if (blocks == 0) return;
-    tmp = (blocks < d_ind) ? blocks : d_ind;
-    uint32_t d = tmp / ind;
-    in = tmp % ind;
-
-    for (uint32_t i = 0; i < d; ++i)
-    {
-        for (uint32_t j = 0; j < ind; ++j)
-            my_mark_block_unused(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        s_inode->double_indirect_block
-                    ))[i]
-                ))[j]
-            );
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                s_inode->double_indirect_block
-            ))[i]
-        );
-    }
-    for (uint32_t j = 0; j < in; ++j)
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    s_inode->double_indirect_block
-                ))[d]
-            ))[j]
-        );
-    my_mark_block_unused(
-        partition,
-        ((uint32_t*) my_get_block_pointer(
-            partition,
-            s_inode->double_indirect_block
-        ))[d]
-    );
-    my_mark_block_unused(partition, s_inode->double_indirect_block);
-    blocks -= tmp;
-
-    // trible indirect block
-    if (blocks == 0) return;
-    uint32_t t = blocks / d_ind;
-    d = (blocks % d_ind) / ind;
-    in = blocks % ind;
-
-    for (uint32_t i = 0; i < t; ++i)
-    {
-        for (uint32_t j = 0; j < ind; ++j)
+    if (run == NULL) return my_alloc_block(partition);
+    if (run->count == 0)
+    {
+        // go on right after the last run if it can
+        run->next = my_alloc_blocks(partition, run->next,
+            run->want ? run->want : 1, &run->count);
+        if (run->count == 0) return 0;
+    }
+    --run->count;
+    if (run->want) --run->want;
+    if (run->zero) memset(my_get_block_pointer(partition, run->next),
+        0, partition->block_size);
+    return run->next++;
+}
+
+/**
+ * Return the block holding the given block index of
+ * the file. When the block isn't allocated, allocate
+ * it (and the indirect blocks on the way) if `alloc`,
+ * from `run` if it's given, else return 0.
+ * 
+ * Return 0 if there's no more space.
+ */
+HOT_PATH my_block_t file_block(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t index, bool alloc, struct block_run* run, const uint32_t shift)
+{
+    // block numbers in an indirect block
+    const uint32_t fan = shift - MY_BLOCK_T_SHIFT;
+    const uint64_t ind = 1ull << fan;
+    my_block_t* slot;
+    uint32_t level;
+
+    if (index < NUM_OF_DIRECT_BLOCKS) // direct
+    {
+        slot = &inode->direct_block[index];
+        level = 0;
+    }
+    else if ((index -= NUM_OF_DIRECT_BLOCKS) < ind) // indirect
+    {
+        slot = &inode->indirect_block;
+        level = 1;
+    }
+    else if ((index -= ind) < ind * ind) // double indirect
+    {
+        slot = &inode->double_indirect_block;
+        level = 2;
+    }
+    else if ((index -= ind * ind) < ind * ind * ind) // trible indirect
+    {
+        slot = &inode->trible_indirect_block;
+        level = 3;
+    }
+    else return 0; // :O too large
+
+    while (1)
+    {
+        if (*slot == 0)
         {
-            for (uint32_t k = 0; k < ind; ++k)
-                my_mark_block_unused(
-                    partition,
-                    ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            ((uint32_t*) my_get_block_pointer(
-                                partition,
-                                s_inode->trible_indirect_block
-                            ))[i]
-                        ))[j]
-                    ))[k]
-                );
-            my_mark_block_unused(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        s_inode->trible_indirect_block
-                    ))[i]
-                ))[j]
-            );
+            if (!alloc) return 0;
+            my_block_t block = take_block(partition, run);
+            if (block == 0) return 0; // no more blocks
+            // a new indirect block points to nothing
+            if (level) memset(block_at(partition, block, shift), 0, 1u << shift);
+            *slot = block;
         }
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                s_inode->trible_indirect_block
-            ))[i]
-        );
-    }
-    for (uint32_t j = 0; j < d; ++j)
-    {
-        for (uint32_t k = 0; k < ind; ++k)
-            my_mark_block_unused(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            s_inode->trible_indirect_block
-                        ))[t]
-                    ))[j]
-                ))[k]
-            );
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    s_inode->trible_indirect_block
-                ))[t]
-            ))[j]
-        );
-    }
-    for (uint32_t k = 0; k < in; ++k)
-        my_mark_block_unused(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        s_inode->trible_indirect_block
-                    ))[t]
-                ))[d]
-            ))[k]
-        );
-    my_mark_block_unused(
-        partition,
-        ((uint32_t*) my_get_block_pointer(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                s_inode->trible_indirect_block
-            ))[t]
-        ))[d]
-    );
-    my_mark_block_unused(
-        partition,
-        ((uint32_t*) my_get_block_pointer(
-            partition,
-            s_inode->trible_indirect_block
-        ))[t]
-    );
-    my_mark_block_unused(
-        partition,
-        s_inode->trible_indirect_block
-    );
+        if (level-- == 0) return *slot;
+        slot = (my_block_t*) block_at(partition, *slot, shift) +
+            ((index >> (fan * level)) & (ind - 1));
+    }
+}
+
+/**
+ * Put the block and every block it points to into
+ * the batch, `level` is the level of indirection.
+ * `self` is the copy for the same block size.
+ */
+HOT_PATH void free_blocks(
+    struct my_partition* partition, my_block_t block, uint32_t level,
+    struct free_batch* batch, const uint32_t shift,
+    void (*self)(struct my_partition*, my_block_t, uint32_t, struct free_batch*))
+{
+    if (block == 0) return;
+    // an indirect block is claimed before the blocks
+    // it points to, keep the batch in that order
+    batch_free(partition, batch, block);
+    if (level)
+    {
+        const uint32_t ind = 1u << (shift - MY_BLOCK_T_SHIFT);
+        my_block_t* p = (my_block_t*) block_at(partition, block, shift);
+        for (uint32_t i = 0; i < ind; ++i)
+            if (p[i] == 0) continue;
+            else if (level == 1) batch_free(partition, batch, p[i]);
+            else self(partition, p[i], level - 1, batch);
+    }
+}
+
+/**
+ * `my_erase_file` without locking the file.
+ */
+static void erase_file(
+    struct my_partition* partition, struct my_inode* inode)
+{
+    const struct block_ops* ops = ops_of(partition);
+    struct free_batch batch;
+    batch.count = 0;
+    for (int i = 0; i < NUM_OF_DIRECT_BLOCKS; ++i)
+    {
+        ops->free_blocks(partition, inode->direct_block[i], 0, &batch);
+        inode->direct_block[i] = 0;
+    }
+    ops->free_blocks(partition, inode->indirect_block, 1, &batch);
+    ops->free_blocks(partition, inode->double_indirect_block, 2, &batch);
+    ops->free_blocks(partition, inode->trible_indirect_block, 3, &batch);
+    flush_batch(partition, &batch);
+    inode->indirect_block = 0;
+    inode->double_indirect_block = 0;
+    inode->trible_indirect_block = 0;
+    atomic_store(AS_ATOMIC(&inode->size), 0);
+}
+
+/**
+ * A file handed to the reaper, the copy of its inode
+ * holds the blocks.
+ */
+struct reap_job
+{
+    struct my_partition* partition;
+    struct my_inode inode;
+    uint32_t number;
+    struct reap_job* next;
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct reap_job* head;
+    struct reap_job* tail;
+    // partition of the job being erased
+    struct my_partition* busy;
+    bool started;
+} reaper = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void* reap(void* arg)
+{
+    pthread_mutex_lock(&reaper.mutex);
+    for (;;)
+    {
+        while (reaper.head == NULL)
+            pthread_cond_wait(&reaper.cond, &reaper.mutex);
+        struct reap_job* job = reaper.head;
+        if ((reaper.head = job->next) == NULL) reaper.tail = NULL;
+        reaper.busy = job->partition;
+        pthread_mutex_unlock(&reaper.mutex);
+
+        MY_TRACE_BEGIN(trace);
+        erase_file(job->partition, &job->inode);
+        MY_TRACE_END(MY_TRACE_ERASE, trace, job->number, job->inode.size);
+        free(job);
+
+        pthread_mutex_lock(&reaper.mutex);
+        reaper.busy = NULL;
+        pthread_cond_broadcast(&reaper.cond);
+    }
+    return NULL;
+}
+
+/**
+ * The reaper thread doesn't survive a fork, neither
+ * do the jobs, the parent erases them.
+ */
+static void reaper_forked()
+{
+    pthread_mutex_init(&reaper.mutex, NULL);
+    pthread_cond_init(&reaper.cond, NULL);
+    reaper.head = reaper.tail = NULL;
+    reaper.busy = NULL;
+    reaper.started = false;
+}
+
+/**
+ * Move the blocks of the inode to a job of the
+ * reaper, the inode is empty after it. Return false
+ * if there's no reaper to take it.
+ */
+static bool reap_later(
+    struct my_partition* partition, struct my_inode* inode, uint32_t number)
+{
+    struct reap_job* job = (struct reap_job*) malloc(sizeof(struct reap_job));
+    if (job == NULL) return false;
+    job->partition = partition;
+    job->inode = *inode;
+    job->number = number;
+    job->next = NULL;
+
+    pthread_mutex_lock(&reaper.mutex);
+    if (!reaper.started)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reap, NULL))
+        {
+            pthread_mutex_unlock(&reaper.mutex);
+            free(job);
+            return false;
+        }
+        pthread_detach(thread);
+        pthread_atfork(NULL, NULL, reaper_forked);
+        reaper.started = true;
+    }
+    if (reaper.tail) reaper.tail->next = job;
+    else reaper.head = job;
+    reaper.tail = job;
+    pthread_cond_broadcast(&reaper.cond);
+    pthread_mutex_unlock(&reaper.mutex);
+
+    memset(inode->direct_block, 0, sizeof(inode->direct_block));
+    inode->indirect_block = 0;
+    inode->double_indirect_block = 0;
+    inode->trible_indirect_block = 0;
+    atomic_store(AS_ATOMIC(&inode->size), 0);
+    return true;
+}
+
+void my_reap_wait(struct my_partition* partition)
+{
+    pthread_mutex_lock(&reaper.mutex);
+    for (;;)
+    {
+        bool pending = reaper.busy == partition;
+        for (struct reap_job* job = reaper.head; job && !pending; job = job->next)
+            pending = job->partition == partition;
+        if (!pending) break;
+        pthread_cond_wait(&reaper.cond, &reaper.mutex);
+    }
+    pthread_mutex_unlock(&reaper.mutex);
+}
+
+bool my_file_reserve(
+    struct my_partition* partition, uint32_t inode, uint64_t bytes)
+{
+    my_map_lock(partition, inode);
+    bool ok = ops_of(partition)->reserve(
+        partition, my_get_inode_pointer(partition, inode), bytes);
+    my_map_unlock(partition, inode);
+    return ok;
+}
+
+/**
+ * Release the data blocks [first, last] under `slot`,
+ * which maps the blocks from `base` with `level`
+ * levels of indirection. Indirect blocks left
+ * pointing to nothing are released too.
+ */
+static void punch_blocks(
+    struct my_partition* partition, my_block_t* slot, uint32_t level,
+    uint64_t base, uint64_t first, uint64_t last, struct free_batch* batch)
+{
+    if (*slot == 0) return;
+    const uint32_t fan = partition->block_shift - MY_BLOCK_T_SHIFT;
+    const uint64_t ind = 1ull << fan;
+    const uint64_t span = 1ull << (fan * level);
+    if (first <= base && base + span - 1 <= last)
+    {
+        // all of it
+        ops_of(partition)->free_blocks(partition, *slot, level, batch);
+        *slot = 0;
+        return;
+    }
+
+    my_block_t* p = (my_block_t*) my_get_block_pointer(partition, *slot);
+    const uint64_t child = span >> fan;
+    uint64_t from = (first > base) ? (first - base) / child : 0;
+    uint64_t to = (last - base) / child;
+    if (to >= ind) to = ind - 1;
+    for (uint64_t i = from; i <= to; ++i)
+        punch_blocks(partition, &p[i], level - 1, base + i * child,
+            first, last, batch);
+    for (uint64_t i = 0; i < ind; ++i)
+        if (p[i]) return;
+    batch_free(partition, batch, *slot);
+    *slot = 0;
+}
+
+/**
+ * Release the data blocks [first, last] of the file,
+ * they become holes.
+ */
+static void punch_file(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t first, uint64_t last)
+{
+    const uint32_t fan = partition->block_shift - MY_BLOCK_T_SHIFT;
+    my_block_t* slots[] = { &inode->indirect_block,
+        &inode->double_indirect_block, &inode->trible_indirect_block };
+    struct free_batch batch;
+    batch.count = 0;
+    for (uint64_t i = first; i < NUM_OF_DIRECT_BLOCKS && i <= last; ++i)
+        punch_blocks(partition, &inode->direct_block[i], 0, i,
+            first, last, &batch);
+    uint64_t base = NUM_OF_DIRECT_BLOCKS, span = 1ull << fan;
+    for (uint32_t level = 1; level <= 3; ++level, base += span, span <<= fan)
+        if (first < base + span && last >= base)
+            punch_blocks(partition, slots[level - 1], level, base,
+                first, last, &batch);
+    flush_batch(partition, &batch);
+}
+
+/**
+ * Zero the bytes [from, to) inside one block of the
+ * file if it's mapped, a hole is zeros already.
+ */
+static void zero_part(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t from, uint64_t to)
+{
+    my_block_t block = ops_of(partition)->file_block(
+        partition, inode, from >> partition->block_shift, false);
+    if (block) memset(my_get_block_pointer(partition, block) +
+        (from & (partition->block_size - 1)), 0, to - from);
+}
+
+/**
+ * Make the bytes [from, to) of the file read as
+ * zeros: zero the partial blocks at both ends and
+ * release the whole blocks between. The caller holds
+ * the map lock.
+ */
+static void clear_range(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t from, uint64_t to)
+{
+    const uint32_t shift = partition->block_shift;
+    const uint64_t mask = partition->block_size - 1;
+    if (from >= to) return;
+    uint64_t first = from >> shift, last = (to - 1) >> shift;
+    if (first == last)
+    {
+        zero_part(partition, inode, from, to);
+        return;
+    }
+    if (from & mask) zero_part(partition, inode, from, ++first << shift);
+    if (to & mask) zero_part(partition, inode, last-- << shift, to);
+    if (first <= last) punch_file(partition, inode, first, last);
+}
+
+/**
+ * `my_file_fragments` without locking the file.
+ */
+static uint64_t count_fragments(
+    struct my_partition* partition, struct my_inode* inode)
+{
+    const struct block_ops* ops = ops_of(partition);
+    uint64_t fragments = 0;
+    my_block_t last = 0;
+    uint64_t blocks = (inode->size + partition->block_size - 1) >>
+        partition->block_shift;
+    for (uint64_t i = 0; i < blocks; ++i)
+    {
+        my_block_t block = ops->file_block(partition, inode, i, false);
+        if (block == 0) continue; // a hole
+        // the indirect blocks of the file sit between
+        // its data blocks, skipping them isn't a break
+        if (last == 0 || block <= last || block - last > 4) ++fragments;
+        last = block;
+    }
+    return fragments;
+}
+
+uint64_t my_file_fragments(
+    struct my_partition* partition, uint32_t inode)
+{
+    my_map_lock(partition, inode);
+    uint64_t fragments = count_fragments(
+        partition, my_get_inode_pointer(partition, inode));
+    my_map_unlock(partition, inode);
+    return fragments;
+}
+
+// what the holes of a mapped file point to
+static const uint8_t zeros[64 K];
+
+uint32_t my_file_map_iov(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t offset, uint64_t length,
+    struct iovec* iov, uint32_t count, uint64_t* mapped)
+{
+    struct my_inode* node = my_get_inode_pointer(partition, inode);
+    const uint64_t size = atomic_load(AS_ATOMIC(&node->size));
+    const uint32_t mask = partition->block_size - 1;
+    uint64_t end = offset, pos = offset;
+    if (offset < size) end = (size - offset < length) ? size : offset + length;
+    uint32_t n = 0;
+    while (pos < end)
+    {
+        uint32_t len = partition->block_size - (pos & mask);
+        if (len > end - pos) len = end - pos;
+        my_block_t block = ops_of(partition)->file_block(
+            partition, node, pos >> partition->block_shift, false);
+        uint8_t* p = block ?
+            my_get_block_pointer(partition, block) + (pos & mask) : (uint8_t*) zeros;
+        struct iovec* last = n ? &iov[n - 1] : NULL;
+        // the blocks are in one piece of memory, the
+        // consecutive ones are one iovec
+        if (last && block && (uint8_t*) last->iov_base + last->iov_len == p)
+            last->iov_len += len;
+        else if (last && !block && last->iov_base == zeros &&
+            last->iov_len + len <= sizeof(zeros))
+            last->iov_len += len;
+        else if (n < count)
+            iov[n++] = (struct iovec) { p, len };
+        else break;
+        pos += len;
+    }
+    *mapped = pos - offset;
+    return n;
+}
+
+bool my_defrag_file(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t* before, uint64_t* after)
+{
+    struct my_inode* node = my_get_inode_pointer(partition, inode);
+    // nobody reads or writes the file meanwhile, and
+    // they look the blocks up again after it
+    uint32_t lock = my_range_lock(partition, inode, MY_RANGE_ALL, true);
+    my_map_lock(partition, inode);
+    *before = *after = count_fragments(partition, node);
+    bool moved = *before > 1 && ops_of(partition)->relocate(partition, node);
+    if (moved) *after = count_fragments(partition, node);
+    my_map_unlock(partition, inode);
+    my_range_unlock(partition, inode, lock);
+    return moved;
+}
+
+uint32_t my_defrag(
+    struct my_partition* partition, uint32_t* cursor, double seconds,
+    my_defrag_report report, void* arg)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    double deadline = ts.tv_sec + ts.tv_nsec / 1e9 + seconds;
+    uint32_t moved = 0;
+    uint64_t before, after;
+    for (uint32_t i = *cursor; i < partition->inode_count; ++i)
+    {
+        if (seconds > 0)
+        {
+            timespec_get(&ts, TIME_UTC);
+            if (ts.tv_sec + ts.tv_nsec / 1e9 >= deadline)
+            {
+                *cursor = i; // go on from here next time
+                return moved;
+            }
+        }
+        if (!my_inode_used(partition, i) ||
+            my_get_inode_pointer(partition, i)->reference_count == 0)
+            continue;
+        if (my_defrag_file(partition, i, &before, &after))
+        {
+            ++moved;
+            if (report) report(i, before, after, arg);
+        }
+    }
+    *cursor = 0;
+    return moved;
+}
+
+void my_file_truncate(
+    struct my_partition* partition, uint32_t inode, uint64_t length)
+{
+    struct my_inode* node = my_get_inode_pointer(partition, inode);
+    uint32_t lock = my_range_lock(partition, inode, MY_RANGE_ALL, true);
+    my_map_lock(partition, inode);
+    uint64_t size = node->size;
+    if (length < size)
+    {
+        // only the blocks after the new end go
+        uint64_t first = (length >> partition->block_shift) +
+            ((length & (partition->block_size - 1)) != 0);
+        punch_file(partition, node, first, UINT64_MAX);
+    }
+    else clear_range(partition, node, size, length); // a hole
+    atomic_store(AS_ATOMIC(&node->size), length);
+    my_map_unlock(partition, inode);
+    my_range_unlock(partition, inode, lock);
+}
+
+void my_file_punch_hole(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t offset, uint64_t length)
+{
+    uint64_t end = (UINT64_MAX - offset < length) ? UINT64_MAX : offset + length;
+    uint32_t lock = my_range_lock(partition, inode, offset, end, true);
+    my_map_lock(partition, inode);
+    clear_range(partition, my_get_inode_pointer(partition, inode), offset, end);
+    my_map_unlock(partition, inode);
+    my_range_unlock(partition, inode, lock);
+}
+
+void my_erase_file(struct my_partition* partition, uint32_t inode)
+{
+    MY_TRACE_BEGIN(trace);
+    uint32_t lock = my_range_lock(partition, inode, MY_RANGE_ALL, true);
+    struct my_inode* node = my_get_inode_pointer(partition, inode);
+    uint64_t size = node->size;
+    // a huge file is left to the reaper, no need to wait
+    if (node->size < REAP_SIZE || !reap_later(partition, node, inode))
+        erase_file(partition, node);
+    my_range_unlock(partition, inode, lock);
+    MY_TRACE_END(MY_TRACE_ERASE, trace, inode, size);
 }
 
 struct my_file* my_file_open(
     struct my_partition* partition, uint32_t file_inode)
 {
-    struct my_file* file = (struct my_file*) malloc(sizeof(struct my_file));
+    struct my_file* file = (struct my_file*) my_slab_alloc(&file_slab);
     file->inode = my_get_inode_pointer(partition, file_inode);
+    file->inode_number = file_inode;
+    file->append = false;
     file->position = 0;
     file->block_position = partition->block_size;
+    file->pending = NULL;
+    file->pending_length = 0;
     return file;
 }
 
 struct my_file* my_file_open_end(
     struct my_partition* partition, uint32_t file_inode)
 {
-    struct my_file* file = (struct my_file*) malloc(sizeof(struct my_file));
-    file->inode = my_get_inode_pointer(partition, file_inode);
+    struct my_file* file = my_file_open(partition, file_inode);
+    file->append = true;
     my_file_seek_end(partition, file);
     return file;
 }
 
-uint32_t my_file_seek(
+uint64_t my_file_seek(
     struct my_partition* partition,
-    struct my_file* file, uint32_t position)
+    struct my_file* file, uint64_t position)
 {
-    uint32_t tmp;
-    const uint32_t ind = partition->block_size / sizeof(uint32_t);
-    const uint32_t d_ind = ind * ind;
-    
-    if (position >= file->inode->size) file->position = file->inode->size;
-    else file->position = position;
-    file->block_position = file->position % partition->block_size;
-
-    if (file->inode->size == 0)
-        file->block_position = partition->block_size;
-    else if ((tmp = file->position / partition->block_size) <
-            NUM_OF_DIRECT_BLOCKS) // direct
-        file->block = file->inode->direct_block[tmp];
-    else if ((tmp -= NUM_OF_DIRECT_BLOCKS) < ind) // indirect
-        file->block = ((uint32_t*) my_get_block_pointer(partition,
-            file->inode->indirect_block))[tmp];
-    else if ((tmp -= ind) < d_ind) // double indirect
-        file->block = ((uint32_t*) my_get_block_pointer(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                file->inode->double_indirect_block
-            ))[tmp / ind]
-        ))[tmp % ind];
-    else if ((tmp -= d_ind) < d_ind * ind) // trible indirect
-        file->block = ((uint32_t*) my_get_block_pointer(
-            partition,
-            ((uint32_t*) my_get_block_pointer(
-                partition,
-                ((uint32_t*) my_get_block_pointer(
-                    partition,
-                    file->inode->trible_indirect_block
-                ))[tmp / d_ind]
-            ))[(tmp % d_ind) / ind]
-        ))[tmp % ind];
-
+    MY_STAT_BEGIN(begin);
+    flush_pending(partition, file, false);
+    // past the end is fine, a write there leaves a hole
+    file->position = position;
+    // the block will be found when it's used
+    file->block_position = partition->block_size;
+    MY_STAT_END(MY_STAT_SEEK, begin, 0);
     return file->position;
 }
 
-uint32_t my_file_seek_end(
+uint64_t my_file_seek_end(
     struct my_partition* partition,
     struct my_file* file)
 {
+    flush_pending(partition, file, false);
     return my_file_seek(partition, file, file->inode->size);
 }
 
-void my_file_close(struct my_partition* partition, struct my_file* file)
+bool my_file_close(struct my_partition* partition, struct my_file* file)
 {
-    // wrapper
-    free(file);
+    bool ok = flush_pending(partition, file, false);
+    free(file->pending);
+    my_slab_free(&file_slab, file);
+    return ok;
 }
 
-uint32_t my_file_read(
+/**
+ * Copy from the file to the buffer block by block,
+ * stop after `\n` if `line`. The caller holds the
+ * range.
+ */
+HOT_PATH uint32_t file_read(
     struct my_partition* partition, struct my_file* file,
-    uint8_t* buffer, uint32_t buffer_size)
+    uint8_t* buffer, uint32_t buffer_size, bool line, const uint32_t shift)
 {
-    uint8_t* current_block = my_get_block_pointer(partition, file->block);
-    uint32_t buffer_position = 0;
-    if (file->position >= file->inode->size) return 0;
-    
-    while (buffer_position < buffer_size && file->position < file->inode->size)
+    const uint32_t bs = 1u << shift;
+    const uint64_t size = atomic_load(AS_ATOMIC(&file->inode->size));
+    uint32_t buffer_position = 0, len;
+    uint8_t *current, *newline;
+
+    if (line)
+    {
+        if (buffer_size == 0) return 0;
+        --buffer_size; // for '\0'
+    }
+
+    while (buffer_position < buffer_size && file->position < size)
     {
-        if (file->block_position >= partition->block_size) // without / and %
+        if (file->block_position >= bs)
         // if reached block ending then go to next block
         {
-            my_file_seek(partition, file, file->position);
-
-            current_block = my_get_block_pointer(partition, file->block);
+            file->block = file_block(partition, file->inode,
+                file->position >> shift, false, NULL, shift);
+            file->block_position = file->position & (bs - 1);
         }
 
-        buffer[buffer_position++] = current_block[file->block_position++];
-        ++file->position;
+        len = bs - file->block_position;
+        if (len > buffer_size - buffer_position)
+            len = buffer_size - buffer_position;
+        if (len > size - file->position)
+            len = size - file->position;
+
+        if (file->block == 0) // a hole reads as zeros
+        {
+            memset(buffer + buffer_position, 0, len);
+            newline = NULL;
+        }
+        else
+        {
+            current = block_at(partition, file->block, shift) +
+                file->block_position;
+            newline = line ?
+                (uint8_t*) my_scan_byte(current, current + len, '\n') : NULL;
+            if (newline == current + len) newline = NULL;
+            if (newline) len = newline - current + 1;
+            memcpy(buffer + buffer_position, current, len);
+        }
+        buffer_position += len;
+        file->block_position += len;
+        file->position += len;
+        if (newline) break;
     }
+    if (line) buffer[buffer_position] = '\0';
     return buffer_position;
 }
 
+uint32_t my_file_read(
+    struct my_partition* partition, struct my_file* file,
+    uint8_t* buffer, uint32_t buffer_size)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    flush_pending(partition, file, false);
+    uint64_t end = (UINT64_MAX - file->position < buffer_size) ?
+        UINT64_MAX : file->position + buffer_size;
+    uint32_t lock = my_range_lock(partition, file->inode_number,
+        file->position, end, false);
+    file->block_position = partition->block_size;
+    uint32_t len = ops_of(partition)->file_read(
+        partition, file, buffer, buffer_size, false);
+    my_range_unlock(partition, file->inode_number, lock);
+    MY_STAT_END(MY_STAT_READ, begin, len);
+    MY_TRACE_END(MY_TRACE_READ, trace, file->inode_number, len);
+    return len;
+}
+
 uint32_t my_file_read_line(
     struct my_partition* partition, struct my_file* file,
     uint8_t* buffer, uint32_t buffer_size)
 {
-    uint8_t* current_block = my_get_block_pointer(partition, file->block);
-    uint32_t buffer_position = 0;
-    if (file->position >= file->inode->size) return 0;
-    
-    while (buffer_position + 1 < buffer_size &&
-        file->position < file->inode->size)
+    flush_pending(partition, file, false);
+    uint64_t end = (UINT64_MAX - file->position < buffer_size) ?
+        UINT64_MAX : file->position + buffer_size;
+    uint32_t lock = my_range_lock(partition, file->inode_number,
+        file->position, end, false);
+    file->block_position = partition->block_size;
+    uint32_t len = ops_of(partition)->file_read(
+        partition, file, buffer, buffer_size, true);
+    my_range_unlock(partition, file->inode_number, lock);
+    return len;
+}
+
+/**
+ * Map the blocks [first, last] of the file, new
+ * blocks come from runs of consecutive blocks. The
+ * caller holds the map lock. Return the index of the
+ * first block it failed to map, `last + 1` if all of
+ * them are mapped.
+ */
+HOT_PATH uint64_t map_blocks(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t first, uint64_t last, const uint32_t shift)
+{
+    // the data blocks and the indirect blocks over them
+    uint64_t want = last - first + 1;
+    want += want >> (shift - MY_BLOCK_T_SHIFT);
+    struct block_run run = { 0, 0,
+        (want < (my_block_t) -1) ? want : (my_block_t) -1, false };
+    // place the new blocks after the ones before them,
+    // the first ones close to the inode
+    if (first) run.next = file_block(partition, inode, first - 1, false, NULL, shift);
+    if (run.next) ++run.next;
+    else run.next = home_of(partition, inode);
+    uint64_t i;
+    for (i = first; i <= last; ++i)
+        if (file_block(partition, inode, i, true, &run, shift) == 0) break;
+    // give back what's left of the run
+    if (run.count) my_mark_blocks_unused(partition, run.next, run.count);
+    return i;
+}
+
+/**
+ * Map the blocks of the file until `end` without
+ * moving the size. The caller holds the map lock.
+ */
+HOT_PATH bool file_reserve(
+    struct my_partition* partition, struct my_inode* inode,
+    uint64_t end, const uint32_t shift)
+{
+    if (end == 0) return true;
+    uint64_t last = (end - 1) >> shift;
+    return map_blocks(partition, inode, 0, last, shift) > last;
+}
+
+/**
+ * Copy the data of the file to new blocks taken as
+ * long runs, then switch the inode to them and
+ * release the old ones. Holes stay holes. Keep the
+ * old blocks if the copy isn't in fewer pieces.
+ * The caller holds the whole range and the map lock.
+ */
+HOT_PATH bool relocate_file(
+    struct my_partition* partition, struct my_inode* inode, const uint32_t shift)
+{
+    const uint64_t bs = 1ull << shift;
+    const uint64_t blocks = (inode->size + bs - 1) >> shift;
+    uint64_t mapped = 0;
+    for (uint64_t i = 0; i < blocks; ++i)
+        if (file_block(partition, inode, i, false, NULL, shift)) ++mapped;
+
+    // the data blocks and the indirect blocks over them
+    uint64_t want = mapped + (mapped >> (shift - MY_BLOCK_T_SHIFT)) + 3;
+    struct block_run run = { home_of(partition, inode), 0,
+        (want < (my_block_t) -1) ? want : (my_block_t) -1, false };
+    struct my_inode copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.size = inode->size;
+    bool ok = true;
+    for (uint64_t i = 0; i < blocks && ok; ++i)
+    {
+        my_block_t from = file_block(partition, inode, i, false, NULL, shift);
+        if (from == 0) continue;
+        my_block_t to = file_block(partition, &copy, i, true, &run, shift);
+        if (to) memcpy(block_at(partition, to, shift),
+            block_at(partition, from, shift), bs);
+        else ok = false; // out of space
+    }
+    if (run.count) my_mark_blocks_unused(partition, run.next, run.count);
+    if (!ok || count_fragments(partition, &copy) >=
+        count_fragments(partition, inode))
     {
-        if (file->block_position >= partition->block_size) // without / and %
+        erase_file(partition, &copy);
+        return false;
+    }
+
+    // switch, then the old blocks go
+    struct my_inode old = *inode;
+    memcpy(inode->direct_block, copy.direct_block, sizeof(copy.direct_block));
+    inode->indirect_block = copy.indirect_block;
+    inode->double_indirect_block = copy.double_indirect_block;
+    inode->trible_indirect_block = copy.trible_indirect_block;
+    erase_file(partition, &old);
+    return true;
+}
+
+/**
+ * Allocate the blocks of the file until `end`, and
+ * move the size to `end`. Only this part of a write
+ * is serialized by the map lock. Return the end it
+ * really reached.
+ */
+HOT_PATH uint64_t file_extend(
+    struct my_partition* partition, struct my_file* file,
+    uint64_t end, const uint32_t shift)
+{
+    const uint32_t bs = 1u << shift;
+    my_map_lock(partition, file->inode_number);
+    uint64_t size = file->inode->size;
+    if (end > size)
+    {
+        // blocks [first, last] are new, the ones before
+        // the position stay holes
+        uint64_t first = (size >> shift) + ((size & (bs - 1)) != 0);
+        uint64_t last = (end - 1) >> shift;
+        if (first < (file->position >> shift)) first = file->position >> shift;
+        uint64_t i = map_blocks(partition, file->inode, first, last, shift);
+        if (i <= last) end = ((i << shift) > size) ? (i << shift) : size;
+        // what was after the old end must read as zeros
+        if (file->position > size)
+            clear_range(partition, file->inode, size,
+                (file->position < end) ? file->position : end);
+        atomic_store(AS_ATOMIC(&file->inode->size), end);
+    }
+    my_map_unlock(partition, file->inode_number);
+    return end;
+}
+
+/**
+ * Allocate the block under the position, a hole
+ * inside the file. It's zeroed before it's linked,
+ * the rest of it must still read as zeros.
+ */
+HOT_PATH my_block_t fill_hole(
+    struct my_partition* partition, struct my_file* file, const uint32_t shift)
+{
+    struct block_run run = { home_of(partition, file->inode), 0, 1, true };
+    my_map_lock(partition, file->inode_number);
+    // another writer of the same block may be faster
+    my_block_t block = file_block(partition, file->inode,
+        file->position >> shift, true, &run, shift);
+    my_map_unlock(partition, file->inode_number);
+    return block;
+}
+
+/**
+ * Copy from the buffer to the file block by block.
+ * The caller holds the range.
+ */
+HOT_PATH uint32_t file_write(
+    struct my_partition* partition, struct my_file* file,
+    uint8_t* buffer, uint32_t buffer_size, const uint32_t shift)
+{
+    const uint32_t bs = 1u << shift;
+    uint32_t buffer_position = 0, len;
+    uint64_t end = (UINT64_MAX - file->position < buffer_size) ?
+        UINT64_MAX : file->position + buffer_size;
+    if (end > atomic_load(AS_ATOMIC(&file->inode->size)))
+        end = file_extend(partition, file, end, shift);
+
+    while (file->position < end)
+    {
+        if (file->block_position >= bs)
         // if reached block ending then go to next block
         {
-            my_file_seek(partition, file, file->position);
-
-            current_block = my_get_block_pointer(partition, file->block);
+            file->block = file_block(partition, file->inode,
+                file->position >> shift, false, NULL, shift);
+            if (file->block == 0)
+                file->block = fill_hole(partition, file, shift);
+            if (file->block == 0) break; // no more space
+            file->block_position = file->position & (bs - 1);
         }
 
-        buffer[buffer_position] = current_block[file->block_position++];
-        ++file->position;
-        if (buffer[buffer_position++] == '\n') break;
+        len = bs - file->block_position;
+        if (len > end - file->position) len = end - file->position;
+
+        memcpy(block_at(partition, file->block, shift) +
+            file->block_position, buffer + buffer_position, len);
+        buffer_position += len;
+        file->block_position += len;
+        file->position += len;
     }
-    buffer[buffer_position] = '\0';
     return buffer_position;
 }
 
-uint32_t my_file_write(
+// stamp out the hot paths for a block size
+#define SPECIALIZE(shift) \
+    static my_block_t file_block_##shift( \
+        struct my_partition* partition, struct my_inode* inode, \
+        uint64_t index, bool alloc) \
+    { return file_block(partition, inode, index, alloc, NULL, shift); } \
+    static void free_blocks_##shift( \
+        struct my_partition* partition, my_block_t block, uint32_t level, \
+        struct free_batch* batch) \
+    { free_blocks(partition, block, level, batch, shift, free_blocks_##shift); } \
+    static uint32_t file_read_##shift( \
+        struct my_partition* partition, struct my_file* file, \
+        uint8_t* buffer, uint32_t buffer_size, bool line) \
+    { return file_read(partition, file, buffer, buffer_size, line, shift); } \
+    static uint32_t file_write_##shift( \
+        struct my_partition* partition, struct my_file* file, \
+        uint8_t* buffer, uint32_t buffer_size) \
+    { return file_write(partition, file, buffer, buffer_size, shift); } \
+    static bool file_reserve_##shift( \
+        struct my_partition* partition, struct my_inode* inode, uint64_t end) \
+    { return file_reserve(partition, inode, end, shift); } \
+    static bool relocate_file_##shift( \
+        struct my_partition* partition, struct my_inode* inode) \
+    { return relocate_file(partition, inode, shift); }
+
+SPECIALIZE(10) // 1K
+SPECIALIZE(12) // 4K
+SPECIALIZE(14) // 16K
+SPECIALIZE(16) // 64K
+
+#undef SPECIALIZE
+
+// indexed by (block_shift - 10) / 2
+static const struct block_ops block_ops[] =
+{
+    { file_block_10, free_blocks_10, file_read_10, file_write_10,
+        file_reserve_10, relocate_file_10 },
+    { file_block_12, free_blocks_12, file_read_12, file_write_12,
+        file_reserve_12, relocate_file_12 },
+    { file_block_14, free_blocks_14, file_read_14, file_write_14,
+        file_reserve_14, relocate_file_14 },
+    { file_block_16, free_blocks_16, file_read_16, file_write_16,
+        file_reserve_16, relocate_file_16 },
+};
+
+static inline const struct block_ops* ops_of(struct my_partition* partition)
+{
+    return &block_ops[(partition->block_shift - 10) / 2];
+}
+
+/**
+ * Write to the file now, taking the range.
+ */
+static uint32_t write_now(
     struct my_partition* partition, struct my_file* file,
     uint8_t* buffer, uint32_t buffer_size)
 {
-    uint8_t* current_block = my_get_block_pointer(partition, file->block);
-    uint32_t tmp, buffer_position = 0;
-    const uint32_t ind = partition->block_size / sizeof(uint32_t);
-    const uint32_t d_ind = ind * ind;
-
-    while (buffer_position < buffer_size)
+    uint32_t lock;
+    uint64_t end;
+    while (1)
     {
-        if (file->block_position >= partition->block_size) // without / and %
-        // if reached block ending then go to next block
-        {
-            if (file->position >= file->inode->size)
-            {
-                uint32_t free_block = my_get_free_block(partition);
-                if (free_block == 0 ||
-                    free_block >= partition->block_count) break; // no more blocks
-                my_mark_block_used(partition, free_block);
-
-                if ((tmp = file->position / partition->block_size) < NUM_OF_DIRECT_BLOCKS)
-                {
-                    file->block = file->inode->direct_block[tmp] = free_block;
-                }
-                else if ((tmp -= NUM_OF_DIRECT_BLOCKS) < ind) // indirect
-                {
-                    if (tmp == 0)
-                    {
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block); // free pervious
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-                        file->inode->indirect_block = fb_i;
-                    }
-                    file->block = ((uint32_t*) my_get_block_pointer(partition,
-                        file->inode->indirect_block))[tmp] = free_block;
-                }
-                else if ((tmp -= ind) < d_ind) // double indirect
-                {
-                    uint32_t i = tmp % ind;
-                    uint32_t d = tmp / ind;
-                    if (d == 0 && i == 0)
-                    {
-                        uint32_t fb_d = my_get_free_block(partition);
-                        if (fb_d == 0 || fb_d >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_d);
-
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            my_mark_block_unused(partition, fb_d);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            file->inode->double_indirect_block = fb_d
-                        ))[d] = fb_i;
-                    }
-                    else if (i == 0)
-                    {
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-
-                        ((uint32_t*) my_get_block_pointer(partition,
-                            file->inode->double_indirect_block))[d] = fb_i;
-                    }
-
-                    file->block = ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            file->inode->double_indirect_block
-                        ))[d]
-                    ))[i] = free_block;
-                }
-                else if ((tmp -= d_ind) < d_ind * ind) // trible indirect
-                {
-                    uint32_t i = tmp % ind;
-                    uint32_t d = (tmp % d_ind) / ind;
-                    uint32_t t = tmp / d_ind;
-                    if (t == 0 && d == 0 && i == 0)
-                    {
-                        uint32_t fb_t = my_get_free_block(partition);
-                        if (fb_t == 0 || fb_t >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_t);
-
-                        uint32_t fb_d = my_get_free_block(partition);
-                        if (fb_d == 0 || fb_d >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            my_mark_block_unused(partition, fb_t);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_d);
-
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            my_mark_block_unused(partition, fb_t);
-                            my_mark_block_unused(partition, fb_d);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            ((uint32_t*) my_get_block_pointer(
-                                partition,
-                                file->inode->trible_indirect_block = fb_t
-                            ))[t] = fb_d
-                        ))[d] = fb_i;
-                    }
-                    else if (d == 0 && i == 0)
-                    {
-                        uint32_t fb_d = my_get_free_block(partition);
-                        if (fb_d == 0 || fb_d >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_d);
-
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            my_mark_block_unused(partition, fb_d);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            ((uint32_t*) my_get_block_pointer(
-                                partition,
-                                file->inode->trible_indirect_block
-                            ))[t] = fb_d
-                        ))[d] = fb_i;
-                    }
-                    else if (i == 0)
-                    {
-                        uint32_t fb_i = my_get_free_block(partition);
-                        if (fb_i == 0 || fb_i >= partition->block_count)
-                        {
-                            my_mark_block_unused(partition, free_block);
-                            break;
-                        }
-                        my_mark_block_used(partition, fb_i);
-
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            ((uint32_t*) my_get_block_pointer(
-                                partition,
-                                file->inode->trible_indirect_block
-                            ))[t]
-                        ))[d] = fb_i;
-                    }
-
-                    file->block = ((uint32_t*) my_get_block_pointer(
-                        partition,
-                        ((uint32_t*) my_get_block_pointer(
-                            partition,
-                            ((uint32_t*) my_get_block_pointer(
-                                partition,
-                                file->inode->trible_indirect_block
-                            ))[t]
-                        ))[d]
-                    ))[i] = free_block;
-                }
-                else break; // :O too large
-                file->block_position = 0;
-            }
-            else my_file_seek(partition, file, file->position);
+        // append mode writes at the end, take the range
+        // first then check nobody moved the end
+        if (file->append)
+            file->position = atomic_load(AS_ATOMIC(&file->inode->size));
+        end = (UINT64_MAX - file->position < buffer_size) ?
+            UINT64_MAX : file->position + buffer_size;
+        lock = my_range_lock(partition, file->inode_number,
+            file->position, end, true);
+        if (!file->append ||
+            file->position == atomic_load(AS_ATOMIC(&file->inode->size)))
+            break;
+        my_range_unlock(partition, file->inode_number, lock);
+    }
+    file->block_position = partition->block_size;
+    uint32_t len = ops_of(partition)->file_write(
+        partition, file, buffer, buffer_size);
+    my_range_unlock(partition, file->inode_number, lock);
+    return len;
+}
 
-            current_block = my_get_block_pointer(partition, file->block);
-        }
+/**
+ * Gather the data in the write-back buffer. Return
+ * false if it doesn't continue the data there or
+ * doesn't fit, flush and try again then.
+ */
+static bool pend(struct my_file* file, uint8_t* buffer, uint32_t size)
+{
+    if (file->pending_length)
+    {
+        if (size > WRITE_BACK_SIZE - file->pending_length) return false;
+        if (!file->append && file->position !=
+            file->pending_position + file->pending_length) return false;
+    }
+    else
+    {
+        if (size >= WRITE_BACK_SIZE) return false; // large, write it now
+        if (file->pending == NULL)
+            file->pending = (uint8_t*) malloc(WRITE_BACK_SIZE);
+        file->pending_position = file->position;
+    }
+    memcpy(file->pending + file->pending_length, buffer, size);
+    file->pending_length += size;
+    file->position += size;
+    return true;
+}
 
-        current_block[file->block_position++] = buffer[buffer_position++];
-        ++file->position;
-        if (file->position > file->inode->size)
-            file->inode->size = file->position;
+/**
+ * Write the write-back buffer out, the blocks of all
+ * of it are allocated here at once. `held` tells the
+ * caller holds the range of the file already.
+ * Return false if not all of it was written.
+ */
+static bool flush_pending(
+    struct my_partition* partition, struct my_file* file, bool held)
+{
+    if (file->pending_length == 0) return true;
+    uint32_t len;
+    file->position = file->pending_position;
+    if (held)
+    {
+        file->block_position = partition->block_size;
+        len = ops_of(partition)->file_write(
+            partition, file, file->pending, file->pending_length);
     }
-    return buffer_position;
+    else len = write_now(partition, file, file->pending, file->pending_length);
+    bool done = (len == file->pending_length);
+    file->pending_length = 0;
+    return done;
+}
+
+uint32_t my_file_write(
+    struct my_partition* partition, struct my_file* file,
+    uint8_t* buffer, uint32_t buffer_size)
+{
+    MY_STAT_BEGIN(begin);
+    MY_TRACE_BEGIN(trace);
+    uint32_t len;
+    if (pend(file, buffer, buffer_size)) len = buffer_size;
+    // it doesn't fit, write out what's gathered first
+    else if (!flush_pending(partition, file, false)) len = 0;
+    else if (pend(file, buffer, buffer_size)) len = buffer_size;
+    else len = write_now(partition, file, buffer, buffer_size);
+    MY_STAT_END(MY_STAT_WRITE, begin, len);
+    MY_TRACE_END(MY_TRACE_WRITE, trace, file->inode_number, len);
+    return len;
+}
+
+bool my_file_flush(
+    struct my_partition* partition, struct my_file* file)
+{
+    return flush_pending(partition, file, false);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #define K *(1024  )
 #define M *(1024 K)
@@ -15,6 +16,30 @@
 #define MY_TYPE_SYM  2
 #define MY_TYPE_FILE 3
 
+// the partition is in shared memory, see `shared.h`
+#define MY_PARTITION_SHARED 1
+// block numbers are 64 bits, see `my_block_t`
+#define MY_PARTITION_64BIT_BLOCKS 2
+
+/**
+ * Block number. 32 bits are enough for 4 TB with
+ * 1K blocks and keep twice as many pointers in an
+ * indirect block. Build with `MY_FS_64BIT_BLOCKS`
+ * for the 64-bit variant of the format.
+ */
+#ifdef MY_FS_64BIT_BLOCKS
+    typedef uint64_t my_block_t;
+#else
+    typedef uint32_t my_block_t;
+#endif
+
+// supported block sizes, the hot paths are specialized for each
+#define MY_BLOCK_SIZE_MIN (1 K)
+#define MY_BLOCK_SIZE_MAX (64 K)
+
+// number of striped counters of used blocks
+#define MY_COUNTER_SLOTS 8
+
 /**
  * Hum.. it just... inode.
  * Recording information of file.
@@ -27,14 +52,50 @@ struct my_inode
      * reference count is ZERO.
      */
     uint32_t reference_count;
+    /**
+     * `MY_TYPE_*` it was made with, 0 for inodes
+     * of partitions made before it was kept.
+     */
+    uint8_t type;
+    /**
+     * For directories, whether an entry is being
+     * added to it or it was claimed by an rmdir, which
+     * checks it's empty without taking its lock.
+     */
+    uint8_t state;
     uint64_t mtime;
-    uint32_t size;
+    uint64_t size;
 
     // used blocks
-    uint32_t direct_block[NUM_OF_DIRECT_BLOCKS];
-    uint32_t indirect_block;
-    uint32_t double_indirect_block;
-    uint32_t trible_indirect_block;
+    my_block_t direct_block[NUM_OF_DIRECT_BLOCKS];
+    my_block_t indirect_block;
+    my_block_t double_indirect_block;
+    my_block_t trible_indirect_block;
+};
+
+/**
+ * One stripe of a counter. Threads add to their own
+ * stripe, and the stripes are folded into the real
+ * counter only when somebody needs the value. Padded
+ * to a cache line so threads don't fight for it.
+ */
+struct my_counter_slot
+{
+    int64_t value;
+    uint8_t padding[56];
+};
+
+/**
+ * Descriptor of a block group. Every block of the
+ * blocks bitmap is a group (like ext4), so a group
+ * has `8 * block_size` blocks.
+ */
+struct my_group
+{
+    // number of free blocks in this group
+    uint32_t free_blocks;
+    // bitmap word where the last allocation happened
+    uint32_t hint;
 };
 
 /**
@@ -43,7 +104,7 @@ struct my_inode
 struct my_partition
 {
     // partition size
-    uint32_t size;
+    uint64_t size;
     // single inode size
     uint32_t inode_size;
     // single block size
@@ -51,22 +112,36 @@ struct my_partition
     // number of inodes
     uint32_t inode_count;
     // number of blocks
-    uint32_t block_count;
+    my_block_t block_count;
     // number of used inodes
     uint32_t inode_used;
     // number of used blocks
-    uint32_t block_used;
+    my_block_t block_used;
 
     // inode number of the root directory
     uint32_t root;
     // starting block of the inodes bitmap
-    uint32_t inode_bitmap;
+    my_block_t inode_bitmap;
     // starting block of the blocks bitmap
-    uint32_t block_bitmap;
+    my_block_t block_bitmap;
     // starting block of the inodes block
-    uint32_t inodes;
+    my_block_t inodes;
     // starting block of remaining available blocks
-    uint32_t blocks;
+    my_block_t blocks;
+
+    // number of block groups
+    uint32_t group_count;
+    // number of blocks per group
+    uint32_t blocks_per_group;
+    // starting block of the group descriptors
+    my_block_t groups;
+    // MY_PARTITION_*
+    uint32_t flags;
+    // log2 of block size, picks the specialized paths
+    uint32_t block_shift;
+
+    // not folded changes of `block_used`
+    struct my_counter_slot block_used_slots[MY_COUNTER_SLOTS];
 };
 
 /**
@@ -75,9 +150,18 @@ struct my_partition
 struct my_file
 {
     struct my_inode* inode;
-    uint32_t position;
-    uint32_t block;
+    uint32_t inode_number;
+    // always write at the end of the file
+    bool append;
+    uint64_t position;
+    my_block_t block;
     uint32_t block_position;
+
+    // write-back buffer, holds the data of
+    // [pending_position, pending_position + pending_length)
+    uint8_t* pending;
+    uint64_t pending_position;
+    uint32_t pending_length;
 };
 
 /**
@@ -95,17 +179,26 @@ struct my_dir_list
 
 /**
  * Make a partition for a given size.
- * If the given size is less than 5K then
+ * If the given size is less than 5 blocks then
  * it'll return NULL pointer.
  * 
  * The number of inodes is equal to the number
  * of blocks.
  * 
- * In default, the block size is 1K. In this
- * situation, a block of bitmap can record
- * 8*1024 of blocks or inodes.
+ * The block size is 1K, 4K, 16K or 64K, 0 for
+ * the default 1K. In this situation, a block of
+ * bitmap can record 8*1024 of blocks or inodes.
+ * Return NULL for other block sizes.
  */
-struct my_partition* my_make_partition(uint32_t size);
+struct my_partition* my_make_partition(
+    uint64_t size, uint32_t block_size);
+
+/**
+ * Same as `my_make_partition`, but make it in the
+ * given memory instead of allocating.
+ */
+struct my_partition* my_format_partition(
+    uint8_t* memory, uint64_t size, uint32_t block_size);
 
 /**
  * Load partition from given file.
@@ -125,8 +218,8 @@ void my_dump_partition_to_file(
     struct my_partition* partition, FILE* file);
 
 /**
- * Free the partition in memory.
- * Actually, it just exec `free(partition);`
+ * Free the partition in memory. A shared partition
+ * is only detached, see `my_detach_shared_partition`.
  */
 void my_free_partition(
     struct my_partition* partition);
@@ -138,7 +231,7 @@ void my_free_partition(
  * of the pointer.
  */
 uint8_t* my_get_block_pointer(
-    struct my_partition* partition, uint32_t block);
+    struct my_partition* partition, my_block_t block);
 
 /**
  * Return the pointer point to the given inode
@@ -147,11 +240,21 @@ uint8_t* my_get_block_pointer(
 struct my_inode* my_get_inode_pointer(
     struct my_partition* partition, uint32_t inode);
 
+/**
+ * Return the pointer point to the descriptor of
+ * the given block group.
+ */
+struct my_group* my_get_group_pointer(
+    struct my_partition* partition, uint32_t group);
+
 
 /**
  * Get a inode number that is available. If
  * there are no more available inode, `-1` will
  * returned.
+ * 
+ * Note: the inode is NOT reserved, use `my_touch`
+ * when more than one thread is working.
  */
 uint32_t my_get_free_inode(
     struct my_partition* partition);
@@ -165,6 +268,13 @@ uint32_t my_get_free_inode(
 void my_mark_inode_used(
     struct my_partition* partition, uint32_t inode);
 
+/**
+ * Return true if the given inode number is marked
+ * used in bitmap.
+ */
+bool my_inode_used(
+    struct my_partition* partition, uint32_t inode);
+
 /**
  * Mark the given inode number unused(available)
  * in bitmap, and decrease `partition->inode_used`
@@ -179,10 +289,49 @@ void my_mark_inode_unused(
  * Get a block number that is available. If
  * there are no more available block, `0` will
  * returned.
+ * 
+ * Note: the block is NOT reserved, another thread
+ * may take it before you mark it. Use
+ * `my_alloc_block` when allocating.
  */
-uint32_t my_get_free_block(
+my_block_t my_get_free_block(
     struct my_partition*);
 
+/**
+ * Find a free block and mark it used in one
+ * atomic step, so it's safe to call it from many
+ * threads. Every thread prefers its own block
+ * group and only moves to the others when its
+ * group is full. Return `0` if there are no more
+ * available blocks.
+ */
+my_block_t my_alloc_block(
+    struct my_partition* partition);
+
+/**
+ * Like `my_alloc_block`, but take up to `count`
+ * consecutive blocks. Return the first one and put
+ * how many were taken in `got`, which is less than
+ * `count` when the run is cut by a used block or
+ * the end of the group. Return `0` if there are no
+ * more available blocks.
+ *
+ * The blocks start at `goal` if it's free, else
+ * they're the free run closest to it or the best
+ * fit, see `my_extent_alloc`. `0` means no goal.
+ */
+my_block_t my_alloc_blocks(
+    struct my_partition* partition, my_block_t goal,
+    my_block_t count, my_block_t* got);
+
+/**
+ * Fold the striped counters into
+ * `partition->block_used` and return it. Call it
+ * before reading `partition->block_used`.
+ */
+my_block_t my_fold_block_used(
+    struct my_partition* partition);
+
 /**
  * Mark the given block number used(unavailable)
  * in bitmap, and increase `partition->block_used`
@@ -190,7 +339,7 @@ uint32_t my_get_free_block(
  * this function.
  */
 void my_mark_block_used(
-    struct my_partition* partition, uint32_t block);
+    struct my_partition* partition, my_block_t block);
 
 /**
  * Mark the given block number unused(available)
@@ -199,7 +348,15 @@ void my_mark_block_used(
  * this function.
  */
 void my_mark_block_unused(
-    struct my_partition* partition, uint32_t block);
+    struct my_partition* partition, my_block_t block);
+
+/**
+ * Mark the blocks [block, block + count) available,
+ * a word of the bitmap at a time. Blocks already
+ * available are not counted twice.
+ */
+void my_mark_blocks_unused(
+    struct my_partition* partition, my_block_t block, my_block_t count);
 
 /**
  * List the given directory, and return the content
@@ -233,7 +390,9 @@ void my_free_dir_list(
 
 
 /**
- * Register a inode used in the partition.
+ * Register a inode used in the partition. The
+ * inode is claimed atomically, so it's safe to
+ * call from many threads.
  * The returned inode number should be referenced
  * immediately. If the returned inode number
  * was not referenced, it'll resulted in a zombie
@@ -242,26 +401,92 @@ void my_free_dir_list(
 uint32_t my_touch(
     struct my_partition* partition);
 
+/**
+ * Like `my_touch`, for a file of `type` that will be
+ * referenced in `dir`. A file gets an inode close to
+ * its directory, a directory gets one in a group
+ * with more free room than average, away from the
+ * last one. The data of a file starts near its inode.
+ */
+uint32_t my_touch_in(
+    struct my_partition* partition, uint32_t dir, uint8_t type);
+
 /**
  * Reference the given inode to the given directory,
  * and increase reference count of the inode.
  * Return on reference seccussfully(the given
  * filename was not exist in the given directory),
- * else return false.
+ * else return false. Without space for the line the
+ * directory is left as it was and false returned.
  */
 bool my_dir_reference_file(
     struct my_partition* partition, uint32_t dir,
     uint32_t file, uint8_t type, const char* filename);
 
+/**
+ * A file for `my_dir_reference_files`.
+ */
+struct my_dir_entry
+{
+    uint32_t inode;
+    uint8_t type;
+    const char* filename;
+    // set when it's referenced
+    bool referenced;
+};
+
+/**
+ * Reference many files to the given directory with
+ * one update of it, and increase their reference
+ * counts. An entry whose filename exists already, in
+ * the directory or earlier in `entries`, is empty or
+ * too long is skipped and its `referenced` is false.
+ * The blocks for all the lines are taken first, if
+ * there's not enough space none is referenced.
+ * Return the number of files referenced.
+ */
+uint32_t my_dir_reference_files(
+    struct my_partition* partition, uint32_t dir,
+    struct my_dir_entry* entries, uint32_t count);
+
 /**
  * Unreference the given filename in the directory,
  * and decrease the reference count of the file.
  * It will delete the file only if the reference
  * count is ZERO after calling this function.
  * 
+ * The directory is rewritten without the line of
+ * the file. The blocks for it are taken before the
+ * old contents are touched, if there's not enough
+ * space the directory and the file stay as they
+ * were. Return false then, or if there's no such
+ * filename.
+ * 
  * Note: DO NOT UNREFERENCE NON-EMPTY DIRECTORY.
  */
-void my_dir_unreference_file(
+bool my_dir_unreference_file(
+    struct my_partition* partition,
+    uint32_t dir, const char* filename);
+
+/**
+ * What `my_dir_unreference_empty` did.
+ */
+enum my_unlink
+{
+    MY_UNLINK_DONE,
+    MY_UNLINK_NO_ENTRY,
+    MY_UNLINK_NOT_EMPTY,
+    MY_UNLINK_NO_SPACE
+};
+
+/**
+ * Same as `my_dir_unreference_file`, but a directory
+ * is unreferenced only if it's empty. An empty one
+ * is claimed under the lock of the parent, nothing
+ * can be referenced in it after, and one something
+ * is being referenced in is not empty.
+ */
+enum my_unlink my_dir_unreference_empty(
     struct my_partition* partition,
     uint32_t dir, const char* filename);
 
@@ -272,14 +497,110 @@ void my_dir_unreference_file(
 void my_delete_file(
     struct my_partition* partition, uint32_t inode);
 
+/**
+ * Allocate the blocks of the file for the first
+ * `bytes` bytes in one pass, in runs of consecutive
+ * blocks when the space allows. The size doesn't
+ * change, the blocks after the end stay unwritten
+ * until a write moves the end over them.
+ * Return false if there's not enough space, the
+ * blocks reserved so far are kept.
+ */
+bool my_file_reserve(
+    struct my_partition* partition, uint32_t inode, uint64_t bytes);
+
+/**
+ * Point `iov` at the data of the file from `offset`,
+ * up to `length` bytes, right in the memory of the
+ * partition, no copy. Consecutive blocks are one
+ * iovec, holes point to zeros. Return the number of
+ * iovecs used and put the bytes in `mapped`, less
+ * than `length` at the end of the file or when the
+ * `count` iovecs are full.
+ *
+ * Don't write through the iovecs. Hold the range
+ * with `my_range_lock` while using them if the file
+ * may be written or truncated meanwhile.
+ */
+uint32_t my_file_map_iov(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t offset, uint64_t length,
+    struct iovec* iov, uint32_t count, uint64_t* mapped);
+
+/**
+ * Number of pieces the data of the file is in, 1 if
+ * its blocks are consecutive and 0 if it has none.
+ */
+uint64_t my_file_fragments(
+    struct my_partition* partition, uint32_t inode);
+
+/**
+ * Move the data of the file to blocks in as few
+ * runs as the free space allows, the block pointers
+ * are switched at once and the old blocks released.
+ * Readers and writers of the file wait meanwhile.
+ * Put the fragments before and after in `before`
+ * and `after`. Return false if it's left as it is,
+ * when it's in one piece already, there's not
+ * enough space or the copy is no better.
+ */
+bool my_defrag_file(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t* before, uint64_t* after);
+
+/**
+ * Called for every file `my_defrag` moved.
+ */
+typedef void (*my_defrag_report)(
+    uint32_t inode, uint64_t before, uint64_t after, void* arg);
+
+/**
+ * Defragment the files from the inode `*cursor` on,
+ * stop after `seconds` if it's more than 0. Then
+ * `*cursor` is where to go on next time, or 0 when
+ * every inode was walked. Return the number of files
+ * moved.
+ */
+uint32_t my_defrag(
+    struct my_partition* partition, uint32_t* cursor, double seconds,
+    my_defrag_report report, void* arg);
+
+/**
+ * Cut or grow the file to `length` bytes. Cutting
+ * releases only the blocks after the new end,
+ * growing leaves a hole that reads as zeros.
+ */
+void my_file_truncate(
+    struct my_partition* partition, uint32_t inode, uint64_t length);
+
+/**
+ * Release the blocks of [offset, offset + length) of
+ * the file, the range reads as zeros then. Partial
+ * blocks at the ends are zeroed. The size doesn't
+ * change.
+ */
+void my_file_punch_hole(
+    struct my_partition* partition, uint32_t inode,
+    uint64_t offset, uint64_t length);
+
 /**
  * Release all the block that the given inode is
- * using and set size to zero.
+ * using and set size to zero. The blocks of a huge
+ * file are released by a background thread, the
+ * inode is empty when this returns but the space
+ * comes back later, see `my_reap_wait`.
  */
 void my_erase_file(
     struct my_partition* partition,
     uint32_t inode);
 
+/**
+ * Wait until the blocks of the files erased in the
+ * background are released. Dumping and freeing the
+ * partition wait for it.
+ */
+void my_reap_wait(struct my_partition* partition);
+
 
 /**
  * Open the given inode, and point to the begining
@@ -292,32 +613,38 @@ struct my_file* my_file_open(
 /**
  * Same as `my_file_open`, but point the the end
  * of the file. (append mode)
+ * 
+ * In append mode every write goes to the end of the
+ * file, even if another writer moved the end.
  */
 struct my_file* my_file_open_end(
     struct my_partition* partition,
     uint32_t file_inode);
 
 /**
- * Move the pointer to given position. Return
- * the position it really moved to.
+ * Move the pointer to given position, it can be
+ * after the end of the file. A write there makes a
+ * sparse file, the part between reads as zeros
+ * without using blocks. Return the position.
  */
-uint32_t my_file_seek(
+uint64_t my_file_seek(
     struct my_partition* partition,
-    struct my_file* file, uint32_t position);
+    struct my_file* file, uint64_t position);
 
 /**
  * Move the pointer to the end of the file.
  * Return the position it really moved to.
  */
-uint32_t my_file_seek_end(
+uint64_t my_file_seek_end(
     struct my_partition* partition,
     struct my_file* file);
 
 /**
- * Close the file pointer. Actually it execute
- * `free(file)`.
+ * Close the file pointer, the write-back buffer is
+ * flushed first. Return false if not all of it was
+ * written, the pointer is closed anyway.
  */
-void my_file_close(
+bool my_file_close(
     struct my_partition* partition, struct my_file* file);
 
 /**
@@ -340,9 +667,28 @@ uint32_t my_file_read_line(
  * Write buffer to given file, return the length
  * written to the file, return 0 if there's no more
  * space.
+ * 
+ * Small writes that follow each other are gathered
+ * in the write-back buffer of the file pointer, the
+ * blocks are allocated for all of them at once when
+ * it's flushed. Other file pointers see the data
+ * after the flush. Reading, seeking, closing and
+ * `my_file_flush` flush it.
+ * 
+ * Only the written byte range is locked, so writes
+ * to different parts of the same file run in
+ * parallel. Writes that grow the file serialize
+ * only while allocating blocks and moving the size.
  */
 uint32_t my_file_write(
     struct my_partition* partition, struct my_file* file,
     uint8_t* buffer, uint32_t buffer_size);
 
+/**
+ * Write the write-back buffer to the file. Return
+ * false if there was not enough space for all of it.
+ */
+bool my_file_flush(
+    struct my_partition* partition, struct my_file* file);
+
 #endif
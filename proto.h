@@ -0,0 +1,84 @@
+#ifndef __H_MY_PROTO__
+#define __H_MY_PROTO__
+
+#include <stdint.h>
+
+/**
+ * Binary protocol of the server mode, every message
+ * is a header followed by `length` bytes of payload.
+ * Integers are in host byte order, it's a local
+ * socket after all.
+ *
+ * The inode of LOOKUP, READDIR, MKDIR, UNLINK and
+ * CREATE must be a directory (ENOTDIR), the inode of
+ * READ can't be one (EISDIR), nor the inode of WRITE
+ * (EINVAL). Inodes of partitions made before the
+ * inodes kept their type are trusted.
+ */
+
+#define MY_PROTO_LOOKUP  1 // inode: dir, payload: name
+#define MY_PROTO_READ    2 // inode, offset, count
+#define MY_PROTO_WRITE   3 // inode, offset, payload: data
+#define MY_PROTO_READDIR 4 // inode: dir
+#define MY_PROTO_MKDIR   5 // inode: dir, payload: name
+#define MY_PROTO_UNLINK  6 // inode: dir, payload: name
+#define MY_PROTO_STAT    7 // inode
+#define MY_PROTO_CREATE  8 // inode: dir, payload: name
+
+// offset of a write to the end of the file
+#define MY_PROTO_APPEND UINT64_MAX
+
+// max payload of a message
+#define MY_PROTO_MAX_PAYLOAD (1 << 20)
+
+#define MY_PROTO_OK        0
+#define MY_PROTO_ENOENT   -2
+#define MY_PROTO_EEXIST  -17
+#define MY_PROTO_ENOTDIR -20
+#define MY_PROTO_EISDIR  -21
+#define MY_PROTO_EINVAL  -22
+#define MY_PROTO_ENOSPC  -28
+#define MY_PROTO_ENOTEMPTY -39
+
+struct my_request
+{
+    uint32_t length;
+    uint32_t tag; // returned in the reply
+    uint8_t op;
+    uint8_t padding[3];
+    uint32_t inode;
+    uint64_t offset;
+    uint32_t count;
+};
+
+struct my_reply
+{
+    uint32_t length;
+    uint32_t tag;
+    int32_t status;
+    /**
+     * lookup/mkdir/create: the inode
+     * read/write: bytes done
+     * readdir: number of entries
+     * stat: reference count
+     */
+    uint32_t value;
+    // lookup and stat: type, stat: size and mtime
+    uint32_t type;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+/**
+ * Entry of readdir payload, followed by `name_length`
+ * bytes of name (without '\0').
+ */
+struct my_proto_dirent
+{
+    uint32_t inode;
+    uint8_t type;
+    uint8_t padding;
+    uint16_t name_length;
+};
+
+#endif
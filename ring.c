@@ -0,0 +1,221 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+// max entries a worker takes at once
+#define MY_RING_BATCH 16
+
+struct my_ring
+{
+    struct my_partition* partition;
+    uint32_t mask; // entries - 1
+
+    /**
+     * Submission queue. [sq_head, sq_submitted) are
+     * waiting for workers, [sq_submitted, sq_tail) are
+     * got by the client but not submitted yet.
+     */
+    struct my_sqe* sq;
+    _Atomic uint32_t sq_head;
+    uint32_t sq_submitted;
+    uint32_t sq_tail;
+
+    /**
+     * Completion queue, twice the size of submission
+     * queue. [cq_head, cq_tail) are waiting for the
+     * client.
+     */
+    struct my_cqe* cq;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+
+    // got but not reaped, at most size of cq
+    uint32_t in_flight;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t sq_ready; // workers wait for entries
+    pthread_cond_t cq_ready; // client waits for completions
+    bool stop;
+
+    uint32_t worker_count;
+    pthread_t* workers;
+};
+
+static void execute(
+    struct my_partition* partition,
+    struct my_sqe* sqe, struct my_cqe* cqe)
+{
+    struct my_file* file;
+    struct my_dir_list *list, *found;
+
+    cqe->user_data = sqe->user_data;
+    cqe->result = -1;
+    cqe->type = 0;
+    cqe->list = NULL;
+
+    switch (sqe->opcode)
+    {
+        case MY_OP_NOP:
+            cqe->result = 0;
+            break;
+        case MY_OP_READ:
+            file = my_file_open(partition, sqe->inode);
+            my_file_seek(partition, file, sqe->offset);
+            cqe->result = my_file_read(
+                partition, file, sqe->buffer, sqe->length);
+            my_file_close(partition, file);
+            break;
+        case MY_OP_WRITE:
+            if (sqe->offset == MY_RING_APPEND)
+                file = my_file_open_end(partition, sqe->inode);
+            else
+            {
+                file = my_file_open(partition, sqe->inode);
+                my_file_seek(partition, file, sqe->offset);
+            }
+            cqe->result = my_file_write(
+                partition, file, sqe->buffer, sqe->length);
+            if (!my_file_flush(partition, file)) cqe->result = 0;
+            my_file_close(partition, file);
+            break;
+        case MY_OP_LS_DIR:
+            cqe->list = my_ls_dir(partition, sqe->inode);
+            cqe->result = 0;
+            for (list = cqe->list; list; list = list->next) ++cqe->result;
+            break;
+        case MY_OP_LOOKUP:
+            list = my_ls_dir(partition, sqe->inode);
+            found = my_get_file(partition, list, sqe->filename);
+            if (found)
+            {
+                cqe->result = found->inode;
+                cqe->type = found->type;
+            }
+            my_free_dir_list(partition, list);
+            break;
+    }
+}
+
+static void* worker(void* p)
+{
+    struct my_ring* ring = (struct my_ring*) p;
+    struct my_sqe sqes[MY_RING_BATCH];
+    struct my_cqe cqes[MY_RING_BATCH];
+    uint32_t count;
+
+    pthread_mutex_lock(&ring->mutex);
+    while (1)
+    {
+        while (ring->sq_head == ring->sq_submitted && !ring->stop)
+            pthread_cond_wait(&ring->sq_ready, &ring->mutex);
+        if (ring->sq_head == ring->sq_submitted) break; // stop
+
+        // take a batch, one lock for many operations
+        for (count = 0; count < MY_RING_BATCH &&
+                ring->sq_head != ring->sq_submitted; ++count)
+            sqes[count] = ring->sq[ring->sq_head++ & ring->mask];
+        pthread_mutex_unlock(&ring->mutex);
+
+        for (uint32_t i = 0; i < count; ++i)
+            execute(ring->partition, &sqes[i], &cqes[i]);
+
+        // cq can't be full, in flight entries are limited
+        pthread_mutex_lock(&ring->mutex);
+        for (uint32_t i = 0; i < count; ++i)
+            ring->cq[ring->cq_tail++ & (ring->mask * 2 + 1)] = cqes[i];
+        pthread_cond_signal(&ring->cq_ready);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    return NULL;
+}
+
+struct my_ring* my_ring_create(
+    struct my_partition* partition,
+    uint32_t entries, uint32_t workers)
+{
+    uint32_t size = 1;
+    while (size < entries) size <<= 1;
+    if (workers == 0) workers = 1;
+
+    struct my_ring* ring = (struct my_ring*) calloc(1, sizeof(struct my_ring));
+    ring->partition = partition;
+    ring->mask = size - 1;
+    ring->sq = (struct my_sqe*) calloc(size, sizeof(struct my_sqe));
+    ring->cq = (struct my_cqe*) calloc(size * 2, sizeof(struct my_cqe));
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->sq_ready, NULL);
+    pthread_cond_init(&ring->cq_ready, NULL);
+
+    ring->worker_count = workers;
+    ring->workers = (pthread_t*) malloc(sizeof(pthread_t) * workers);
+    for (uint32_t i = 0; i < workers; ++i)
+        pthread_create(&ring->workers[i], NULL, worker, ring);
+    return ring;
+}
+
+void my_ring_destroy(struct my_ring* ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->stop = true;
+    pthread_cond_broadcast(&ring->sq_ready);
+    pthread_mutex_unlock(&ring->mutex);
+    for (uint32_t i = 0; i < ring->worker_count; ++i)
+        pthread_join(ring->workers[i], NULL);
+
+    while (ring->cq_head != ring->cq_tail)
+        my_free_dir_list(ring->partition,
+            ring->cq[ring->cq_head++ & (ring->mask * 2 + 1)].list);
+
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->sq_ready);
+    pthread_cond_destroy(&ring->cq_ready);
+    free(ring->workers);
+    free(ring->sq);
+    free(ring->cq);
+    free(ring);
+}
+
+struct my_sqe* my_ring_get_sqe(struct my_ring* ring)
+{
+    // sq_head only moves forward, an old value is safe
+    uint32_t head = atomic_load_explicit(&ring->sq_head, memory_order_acquire);
+
+    if (ring->sq_tail - head > ring->mask ||
+        ring->in_flight > ring->mask * 2) return NULL; // full
+    ++ring->in_flight;
+    struct my_sqe* sqe = &ring->sq[ring->sq_tail++ & ring->mask];
+    memset(sqe, 0, sizeof(struct my_sqe));
+    return sqe;
+}
+
+uint32_t my_ring_submit(struct my_ring* ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    uint32_t count = ring->sq_tail - ring->sq_submitted;
+    ring->sq_submitted = ring->sq_tail;
+    if (count == 1) pthread_cond_signal(&ring->sq_ready);
+    else if (count) pthread_cond_broadcast(&ring->sq_ready);
+    pthread_mutex_unlock(&ring->mutex);
+    return count;
+}
+
+uint32_t my_ring_reap(
+    struct my_ring* ring, struct my_cqe* cqes,
+    uint32_t count, uint32_t wait)
+{
+    uint32_t n = 0;
+    if (wait > count) wait = count;
+    pthread_mutex_lock(&ring->mutex);
+    while (ring->cq_tail - ring->cq_head < wait)
+        pthread_cond_wait(&ring->cq_ready, &ring->mutex);
+    while (n < count && ring->cq_head != ring->cq_tail)
+        cqes[n++] = ring->cq[ring->cq_head++ & (ring->mask * 2 + 1)];
+    pthread_mutex_unlock(&ring->mutex);
+    ring->in_flight -= n;
+    return n;
+}
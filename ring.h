@@ -0,0 +1,99 @@
+#ifndef __H_MY_RING__
+#define __H_MY_RING__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "myfs.h"
+
+#define MY_OP_NOP    0
+#define MY_OP_READ   1
+#define MY_OP_WRITE  2
+#define MY_OP_LS_DIR 3
+#define MY_OP_LOOKUP 4
+
+// offset of a write to the end of the file
+#define MY_RING_APPEND UINT64_MAX
+
+/**
+ * Submission queue entry, one operation.
+ */
+struct my_sqe
+{
+    uint8_t opcode;
+    // file of read/write, directory of ls/lookup
+    uint32_t inode;
+    uint64_t offset;
+    uint8_t* buffer;
+    uint32_t length;
+    // filename of lookup, must live until completion
+    const char* filename;
+    // returned untouched in the completion
+    uint64_t user_data;
+};
+
+/**
+ * Completion queue entry, result of one operation.
+ */
+struct my_cqe
+{
+    uint64_t user_data;
+    /**
+     * read/write: bytes done
+     * ls: number of entries
+     * lookup: the inode number, -1 if not exist
+     */
+    int64_t result;
+    // type of the file found by lookup
+    uint8_t type;
+    // list of ls, free it by `my_free_dir_list`
+    struct my_dir_list* list;
+};
+
+struct my_ring;
+
+/**
+ * Make a ring of `entries` submission entries (round
+ * up to power of 2) and start `workers` threads to
+ * execute them on the partition.
+ *
+ * A ring has one client thread: the same thread gets
+ * entries, submits and reaps. Make a ring for every
+ * client thread.
+ */
+struct my_ring* my_ring_create(
+    struct my_partition* partition,
+    uint32_t entries, uint32_t workers);
+
+/**
+ * Wait for the submitted operations, stop the
+ * workers and free the ring. Completions not reaped
+ * are dropped (their lists are freed).
+ */
+void my_ring_destroy(struct my_ring* ring);
+
+/**
+ * Return the next free submission entry, NULL if
+ * the ring is full (too many operations in flight,
+ * reap some completions first). The entry is only
+ * seen by the workers after `my_ring_submit`.
+ */
+struct my_sqe* my_ring_get_sqe(struct my_ring* ring);
+
+/**
+ * Hand all the entries got since the last submit
+ * to the workers at once. Return the number of
+ * submitted entries.
+ */
+uint32_t my_ring_submit(struct my_ring* ring);
+
+/**
+ * Copy up to `count` completions to `cqes`, waiting
+ * until at least `wait` of them are there. Return the
+ * number of copied completions.
+ */
+uint32_t my_ring_reap(
+    struct my_ring* ring, struct my_cqe* cqes,
+    uint32_t count, uint32_t wait);
+
+#endif
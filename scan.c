@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define SCAN_X86
+#endif
+
+typedef const uint8_t* (*scan_fn)(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b);
+
+static const uint8_t* scalar_either(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b)
+{
+    for (; p < end; ++p)
+        if (*p == a || *p == b) return p;
+    return end;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const uint8_t* sse2_either(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        uint32_t mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    // the tail, not read past the end
+    return scalar_either(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t* avx2_either(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    // not sse2_either, jumping to SSE code with the upper
+    // halves dirty makes every SSE instruction after slow
+    for (; p < end; ++p)
+        if (*p == a || *p == b) break;
+    return p;
+}
+#endif
+
+static const struct
+{
+    const char* name;
+    scan_fn fn;
+} impls[] = {
+#ifdef SCAN_X86
+    { "avx2", avx2_either },
+    { "sse2", sse2_either },
+#endif
+    { "scalar", scalar_either },
+};
+
+static uint32_t current = sizeof(impls) / sizeof(impls[0]) - 1;
+
+static bool supported(const char* name)
+{
+#ifdef SCAN_X86
+    if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2");
+    if (!strcmp(name, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+    return !strcmp(name, "scalar");
+}
+
+// the first one the CPU can run, before main
+__attribute__((constructor))
+static void pick()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (uint32_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i)
+        if (supported(impls[i].name))
+        {
+            current = i;
+            return;
+        }
+}
+
+const uint8_t* my_scan_either(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b)
+{
+    return impls[current].fn(p, end, a, b);
+}
+
+const char* my_scan_impl()
+{
+    return impls[current].name;
+}
+
+bool my_scan_use(const char* impl)
+{
+    for (uint32_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i)
+        if (!strcmp(impls[i].name, impl) && supported(impl))
+        {
+            current = i;
+            return true;
+        }
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef __H_MY_SCAN__
+#define __H_MY_SCAN__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Find the first `a` or `b` in [p, end), 32 bytes at
+ * a time with AVX2, 16 with SSE2, one by one on
+ * other machines. The best the CPU has is picked
+ * when the program starts. Return `end` if there's
+ * none.
+ */
+const uint8_t* my_scan_either(
+    const uint8_t* p, const uint8_t* end, uint8_t a, uint8_t b);
+
+/**
+ * Find the first `c` in [p, end), `end` if there's
+ * none.
+ */
+static inline const uint8_t* my_scan_byte(
+    const uint8_t* p, const uint8_t* end, uint8_t c)
+{
+    return my_scan_either(p, end, c, c);
+}
+
+/**
+ * The code in use, "avx2", "sse2" or "scalar".
+ */
+const char* my_scan_impl();
+
+/**
+ * Use the code named `impl` from now on, to compare
+ * them. Return false if the CPU can't run it.
+ */
+bool my_scan_use(const char* impl);
+
+#endif
@@ -0,0 +1,525 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#include "server.h"
+#include "proto.h"
+#include "utils.h"
+#include "lock.h"
+
+#define READ_BUFFER_SIZE (64 * 1024)
+// max replies gathered into one writev
+#define REPLY_BATCH 64
+// reads this large are sent from the blocks, no copy
+#define MAPPED_READ_SIZE (64 * 1024)
+// iovecs of a mapped read, a 1MB read of 1KB blocks
+// all apart and the header
+#define MAPPED_IOVECS 1025
+// the least max number of iovecs of a sendmsg
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+/**
+ * A client, owned by one worker at a time thanks
+ * to EPOLLONESHOT.
+ */
+struct connection
+{
+    int fd;
+    uint8_t* buffer;
+    uint32_t len;
+    uint32_t size;
+};
+
+/**
+ * Replies waiting for one writev.
+ */
+struct reply_batch
+{
+    struct my_reply headers[REPLY_BATCH];
+    uint8_t* payloads[REPLY_BATCH];
+    uint32_t count;
+};
+
+struct server
+{
+    struct my_partition* partition;
+    int epoll;
+    int listener;
+    int stop_pipe[2];
+};
+
+static int stop_fd = -1;
+
+static void on_signal(int sig)
+{
+    if (stop_fd >= 0 && write(stop_fd, "x", 1) < 0) {}
+}
+
+static void flush_replies(int fd, struct reply_batch* batch)
+{
+    struct iovec iov[REPLY_BATCH * 2];
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < batch->count; ++i)
+    {
+        iov[n].iov_base = &batch->headers[i];
+        iov[n++].iov_len = sizeof(struct my_reply);
+        if (batch->headers[i].length)
+        {
+            iov[n].iov_base = batch->payloads[i];
+            iov[n++].iov_len = batch->headers[i].length;
+        }
+    }
+
+    // blocking socket, only stops early on error
+    my_write_iov(fd, iov, n);
+
+    for (uint32_t i = 0; i < batch->count; ++i)
+        free(batch->payloads[i]);
+    batch->count = 0;
+}
+
+/**
+ * Copy the name from payload, false if it's not a
+ * valid filename.
+ */
+static bool get_name(
+    const struct my_request* req, const uint8_t* payload, char* name)
+{
+    if (req->length == 0 || req->length >= 512) return false;
+    memcpy(name, payload, req->length);
+    name[req->length] = '\0';
+    return !strchr(name, '\n') && !strchr(name, '/');
+}
+
+/**
+ * Status of the op on an inode of the wrong type,
+ * MY_PROTO_OK if it's the right one or unknown.
+ */
+static int32_t check_type(struct my_partition* partition, const struct my_request* req)
+{
+    uint8_t type = my_get_inode_pointer(partition, req->inode)->type;
+    if (type == 0) return MY_PROTO_OK;
+    switch (req->op)
+    {
+        case MY_PROTO_LOOKUP:
+        case MY_PROTO_READDIR:
+        case MY_PROTO_MKDIR:
+        case MY_PROTO_UNLINK:
+        case MY_PROTO_CREATE:
+            return (type == MY_TYPE_DIR) ? MY_PROTO_OK : MY_PROTO_ENOTDIR;
+        case MY_PROTO_READ:
+            return (type == MY_TYPE_DIR) ? MY_PROTO_EISDIR : MY_PROTO_OK;
+        case MY_PROTO_WRITE:
+            // the lines of a directory are written under its lock
+            return (type == MY_TYPE_DIR) ? MY_PROTO_EINVAL : MY_PROTO_OK;
+        default:
+            return MY_PROTO_OK;
+    }
+}
+
+static void handle(
+    struct my_partition* partition, const struct my_request* req,
+    const uint8_t* payload, struct my_reply* reply, uint8_t** out)
+{
+    char name[512];
+    struct my_file* file;
+    struct my_dir_list *list, *found;
+    struct my_inode* inode;
+    uint32_t n;
+
+    memset(reply, 0, sizeof(struct my_reply));
+    reply->tag = req->tag;
+    *out = NULL;
+
+    if (req->inode >= partition->inode_count ||
+        !my_inode_used(partition, req->inode))
+    {
+        reply->status = MY_PROTO_ENOENT;
+        return;
+    }
+    if ((reply->status = check_type(partition, req)) != MY_PROTO_OK) return;
+
+    switch (req->op)
+    {
+        case MY_PROTO_LOOKUP:
+            if (!get_name(req, payload, name))
+            {
+                reply->status = MY_PROTO_EINVAL;
+                break;
+            }
+            list = my_ls_dir(partition, req->inode);
+            found = my_get_file(partition, list, name);
+            if (found)
+            {
+                reply->value = found->inode;
+                reply->type = found->type;
+            }
+            else reply->status = MY_PROTO_ENOENT;
+            my_free_dir_list(partition, list);
+            break;
+        case MY_PROTO_READ:
+            n = (req->count > MY_PROTO_MAX_PAYLOAD) ?
+                MY_PROTO_MAX_PAYLOAD : req->count;
+            *out = (uint8_t*) malloc(n ? n : 1);
+            file = my_file_open(partition, req->inode);
+            my_file_seek(partition, file, req->offset);
+            reply->value = reply->length = my_file_read(
+                partition, file, *out, n);
+            my_file_close(partition, file);
+            break;
+        case MY_PROTO_WRITE:
+            if (req->offset == MY_PROTO_APPEND)
+                file = my_file_open_end(partition, req->inode);
+            else
+            {
+                file = my_file_open(partition, req->inode);
+                my_file_seek(partition, file, req->offset);
+            }
+            reply->value = my_file_write(
+                partition, file, (uint8_t*) payload, req->length);
+            if (!my_file_flush(partition, file)) reply->value = 0;
+            if (reply->value < req->length) reply->status = MY_PROTO_ENOSPC;
+            my_file_close(partition, file);
+            break;
+        case MY_PROTO_READDIR:
+            list = my_ls_dir(partition, req->inode);
+            n = 0;
+            for (found = list; found; found = found->next)
+                n += sizeof(struct my_proto_dirent) + strlen(found->filename);
+            *out = (uint8_t*) malloc(n ? n : 1);
+            reply->length = n;
+            n = 0;
+            for (found = list; found; found = found->next)
+            {
+                struct my_proto_dirent entry = {
+                    found->inode, found->type, 0, strlen(found->filename) };
+                memcpy(*out + n, &entry, sizeof(entry));
+                n += sizeof(entry);
+                memcpy(*out + n, found->filename, entry.name_length);
+                n += entry.name_length;
+                ++reply->value;
+            }
+            my_free_dir_list(partition, list);
+            break;
+        case MY_PROTO_MKDIR:
+        case MY_PROTO_CREATE:
+            if (!get_name(req, payload, name))
+            {
+                reply->status = MY_PROTO_EINVAL;
+                break;
+            }
+            n = my_touch_in(partition, req->inode,
+                req->op == MY_PROTO_MKDIR ? MY_TYPE_DIR : MY_TYPE_FILE);
+            if (n == -1)
+            {
+                reply->status = MY_PROTO_ENOSPC;
+                break;
+            }
+            if (my_dir_reference_file(partition, req->inode, n,
+                    req->op == MY_PROTO_MKDIR ? MY_TYPE_DIR : MY_TYPE_FILE, name))
+                reply->value = n;
+            else
+            {
+                my_delete_file(partition, n);
+                // or the directory was removed meanwhile
+                reply->status = my_inode_used(partition, req->inode) ?
+                    MY_PROTO_EEXIST : MY_PROTO_ENOENT;
+            }
+            break;
+        case MY_PROTO_UNLINK:
+            if (!get_name(req, payload, name))
+            {
+                reply->status = MY_PROTO_EINVAL;
+                break;
+            }
+            // checked and done holding the directories
+            switch (my_dir_unreference_empty(partition, req->inode, name))
+            {
+                case MY_UNLINK_DONE: break;
+                case MY_UNLINK_NO_ENTRY: reply->status = MY_PROTO_ENOENT; break;
+                case MY_UNLINK_NOT_EMPTY: reply->status = MY_PROTO_ENOTEMPTY; break;
+                case MY_UNLINK_NO_SPACE: reply->status = MY_PROTO_ENOSPC; break;
+            }
+            break;
+        case MY_PROTO_STAT:
+            inode = my_get_inode_pointer(partition, req->inode);
+            reply->value = inode->reference_count;
+            reply->size = inode->size;
+            reply->mtime = inode->mtime;
+            reply->type = inode->type;
+            break;
+        default:
+            reply->status = MY_PROTO_EINVAL;
+    }
+}
+
+/**
+ * Send as much of the `count` iovecs at `*iov` as the
+ * socket takes without blocking, and move `*iov` past
+ * it. Return the number of iovecs left.
+ */
+static uint32_t send_nowait(int fd, struct iovec** iov, uint32_t count)
+{
+    while (count)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = *iov;
+        msg.msg_iovlen = (count < IOV_MAX) ? count : IOV_MAX;
+        ssize_t w = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        while (count && (size_t) w >= (*iov)->iov_len)
+        {
+            w -= (*iov)->iov_len;
+            ++*iov;
+            --count;
+        }
+        if (count)
+        {
+            (*iov)->iov_base = (uint8_t*) (*iov)->iov_base + w;
+            (*iov)->iov_len -= w;
+        }
+    }
+    return count;
+}
+
+/**
+ * Answer a large read with the blocks of the file,
+ * sent holding the range so nobody changes them
+ * meanwhile. The lock is never held waiting for the
+ * client: what the socket doesn't take right away
+ * is copied, and sent after the unlock. Return false
+ * if it's not such a read, `handle` answers it then.
+ */
+static bool send_mapped(
+    struct my_partition* partition, int fd, const struct my_request* req)
+{
+    if (req->op != MY_PROTO_READ || req->count < MAPPED_READ_SIZE ||
+        req->inode >= partition->inode_count ||
+        !my_inode_used(partition, req->inode) ||
+        check_type(partition, req) != MY_PROTO_OK) return false;
+    uint32_t n = (req->count > MY_PROTO_MAX_PAYLOAD) ?
+        MY_PROTO_MAX_PAYLOAD : req->count;
+    uint64_t end = (UINT64_MAX - req->offset < n) ? UINT64_MAX : req->offset + n;
+    struct iovec* iov = (struct iovec*) malloc(sizeof(struct iovec) * MAPPED_IOVECS);
+    struct my_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tag = req->tag;
+
+    uint32_t lock = my_range_lock(partition, req->inode, req->offset, end, false);
+    uint64_t mapped;
+    uint32_t count = my_file_map_iov(partition, req->inode, req->offset, n,
+        iov + 1, MAPPED_IOVECS - 1, &mapped);
+    reply.value = reply.length = mapped;
+    iov[0] = (struct iovec) { &reply, sizeof(reply) };
+    struct iovec* left = iov;
+    count = send_nowait(fd, &left, count + 1);
+    struct iovec rest = { NULL, 0 };
+    for (uint32_t i = 0; i < count; ++i) rest.iov_len += left[i].iov_len;
+    if (count)
+    {
+        rest.iov_base = malloc(rest.iov_len);
+        uint8_t* p = (uint8_t*) rest.iov_base;
+        for (uint32_t i = 0; i < count; p += left[i++].iov_len)
+            memcpy(p, left[i].iov_base, left[i].iov_len);
+    }
+    my_range_unlock(partition, req->inode, lock);
+    if (count) my_write_iov(fd, &rest, 1);
+    free(rest.iov_base);
+    free(iov);
+    return true;
+}
+
+/**
+ * Read what the client sent and answer every
+ * complete request. Return false if the connection
+ * should be closed.
+ */
+static bool serve_connection(
+    struct my_partition* partition, struct connection* conn)
+{
+    ssize_t r = read(conn->fd, conn->buffer + conn->len, conn->size - conn->len);
+    if (r < 0 && errno == EINTR) return true;
+    if (r <= 0) return false;
+    conn->len += r;
+
+    struct reply_batch batch;
+    batch.count = 0;
+    uint32_t pos = 0;
+    while (conn->len - pos >= sizeof(struct my_request))
+    {
+        struct my_request req;
+        memcpy(&req, conn->buffer + pos, sizeof(req));
+        if (req.length > MY_PROTO_MAX_PAYLOAD) return false;
+        uint32_t total = sizeof(req) + req.length;
+        if (conn->len - pos < total)
+        {
+            // grow for a large write
+            if (total > conn->size)
+            {
+                conn->buffer = (uint8_t*) realloc(conn->buffer, total);
+                conn->size = total;
+            }
+            break;
+        }
+
+        if (req.op == MY_PROTO_READ && req.count >= MAPPED_READ_SIZE)
+        {
+            // the replies before it go first
+            if (batch.count) flush_replies(conn->fd, &batch);
+            if (send_mapped(partition, conn->fd, &req))
+            {
+                pos += total;
+                continue;
+            }
+        }
+        handle(partition, &req, conn->buffer + pos + sizeof(req),
+            &batch.headers[batch.count], &batch.payloads[batch.count]);
+        if (++batch.count == REPLY_BATCH) flush_replies(conn->fd, &batch);
+        pos += total;
+    }
+    if (batch.count) flush_replies(conn->fd, &batch);
+
+    memmove(conn->buffer, conn->buffer + pos, conn->len - pos);
+    conn->len -= pos;
+    return true;
+}
+
+static void close_connection(struct server* server, struct connection* conn)
+{
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->buffer);
+    free(conn);
+}
+
+static void accept_clients(struct server* server)
+{
+    int fd;
+    while ((fd = accept(server->listener, NULL, NULL)) >= 0)
+    {
+        struct connection* conn = (struct connection*) malloc(
+            sizeof(struct connection));
+        conn->fd = fd;
+        conn->len = 0;
+        conn->size = READ_BUFFER_SIZE;
+        conn->buffer = (uint8_t*) malloc(conn->size);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void* worker(void* p)
+{
+    struct server* server = (struct server*) p;
+    struct epoll_event ev;
+
+    while (1)
+    {
+        int n = epoll_wait(server->epoll, &ev, 1, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (ev.data.ptr == &server->stop_pipe) break; // stays readable for all
+        if (ev.data.ptr == server)
+        {
+            accept_clients(server);
+            continue;
+        }
+
+        struct connection* conn = (struct connection*) ev.data.ptr;
+        if ((ev.events & (EPOLLHUP | EPOLLERR) && !(ev.events & EPOLLIN)) ||
+            !serve_connection(server->partition, conn))
+        {
+            close_connection(server, conn);
+            continue;
+        }
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        epoll_ctl(server->epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+    return NULL;
+}
+
+int my_serve(
+    struct my_partition* partition,
+    const char* path, uint32_t workers)
+{
+    struct server server;
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("socket path too long: %s\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    server.partition = partition;
+    server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server.listener < 0 ||
+        bind(server.listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(server.listener, 128) < 0)
+    {
+        printf("failed to listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fcntl(server.listener, F_SETFL, O_NONBLOCK);
+
+    server.epoll = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server;
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &ev);
+
+    if (pipe(server.stop_pipe) < 0) return 1;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server.stop_pipe;
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.stop_pipe[0], &ev);
+    stop_fd = server.stop_pipe[1];
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (workers == 0) workers = 1;
+    printf("serving on %s with %u workers\n", path, workers);
+    fflush(stdout);
+
+    pthread_t* tids = (pthread_t*) malloc(sizeof(pthread_t) * workers);
+    for (uint32_t i = 0; i < workers; ++i)
+        pthread_create(&tids[i], NULL, worker, &server);
+    for (uint32_t i = 0; i < workers; ++i)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    // connections still open are dropped with the process
+    stop_fd = -1;
+    close(server.stop_pipe[0]);
+    close(server.stop_pipe[1]);
+    close(server.listener);
+    close(server.epoll);
+    unlink(path);
+    return 0;
+}
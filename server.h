@@ -0,0 +1,22 @@
+#ifndef __H_MY_SERVER__
+#define __H_MY_SERVER__
+
+#include <stdint.h>
+
+#include "myfs.h"
+
+/**
+ * Serve the partition on the given Unix domain
+ * socket with the protocol in `proto.h`, until
+ * SIGINT or SIGTERM. `workers` threads share one
+ * epoll instance, a connection is handled by one
+ * worker at a time.
+ *
+ * Return 0 on normal shutdown, 1 if the socket
+ * couldn't be set up.
+ */
+int my_serve(
+    struct my_partition* partition,
+    const char* path, uint32_t workers);
+
+#endif
@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "lock.h"
+
+// how long attaching waits for the maker to finish formatting
+#define MY_ATTACH_TIMEOUT_MS 5000
+
+struct my_partition* my_make_shared_partition(
+    const char* name, uint64_t size, uint32_t block_size)
+{
+    const size_t header = my_lock_table_size();
+    if (size < 5 K) return NULL;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, header + size) < 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    uint8_t* memory = (uint8_t*) mmap(NULL, header + size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    my_lock_table_init(memory, true);
+    struct my_partition* partition = my_format_partition(
+        memory + header, size, block_size);
+    if (partition == NULL) // unsupported block size
+    {
+        munmap(memory, header + size);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // attaching processes wait for this flag
+    atomic_fetch_or((_Atomic uint32_t*) &partition->flags, MY_PARTITION_SHARED);
+    return partition;
+}
+
+struct my_partition* my_attach_shared_partition(
+    const char* name)
+{
+    const size_t header = my_lock_table_size();
+    struct stat st;
+
+    int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size <= header)
+    {
+        close(fd);
+        return NULL;
+    }
+    uint8_t* memory = (uint8_t*) mmap(NULL, st.st_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return NULL;
+
+    // the maker may still be formatting
+    struct my_partition* partition = (struct my_partition*) (memory + header);
+    struct timespec ts = { 0, 1000000 };
+    for (int i = 0; !(atomic_load((_Atomic uint32_t*) &partition->flags) &
+            MY_PARTITION_SHARED); ++i)
+    {
+        if (i == MY_ATTACH_TIMEOUT_MS)
+        {
+            munmap(memory, st.st_size);
+            return NULL;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return partition;
+}
+
+void my_detach_shared_partition(
+    struct my_partition* partition)
+{
+    const size_t header = my_lock_table_size();
+    munmap((uint8_t*) partition - header, header + partition->size);
+}
+
+int my_unlink_shared_partition(const char* name)
+{
+    return shm_unlink(name);
+}
@@ -0,0 +1,47 @@
+#ifndef __H_MY_SHARED__
+#define __H_MY_SHARED__
+
+#include <stdint.h>
+
+#include "myfs.h"
+
+/**
+ * Shared partitions live in POSIX shared memory, so
+ * many processes can map the same partition and
+ * call the functions in `myfs.h` directly on it.
+ *
+ * The mapping is the lock table (process-shared,
+ * robust) followed by the partition. The allocator
+ * is lock-free, so it needs nothing more.
+ */
+
+/**
+ * Make a partition of the given size and block size
+ * (see `my_make_partition`) in a new shared memory
+ * object. Return NULL if the object already exists
+ * or the sizes don't work.
+ */
+struct my_partition* my_make_shared_partition(
+    const char* name, uint64_t size, uint32_t block_size);
+
+/**
+ * Map the partition in an existing shared memory
+ * object. Return NULL if it doesn't exist.
+ */
+struct my_partition* my_attach_shared_partition(
+    const char* name);
+
+/**
+ * Unmap the partition. The shared memory object
+ * stays, other processes can keep using it.
+ */
+void my_detach_shared_partition(
+    struct my_partition* partition);
+
+/**
+ * Remove the shared memory object, it's freed after
+ * every process detached it.
+ */
+int my_unlink_shared_partition(const char* name);
+
+#endif
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+// number of stripes, threads share them round robin
+#define MY_STAT_STRIPES 16
+
+/**
+ * The counters of some of the threads. Aligned to a
+ * cache line so the stripes don't share one.
+ */
+struct my_stat_stripe
+{
+    _Atomic uint64_t count[MY_STAT_OPS];
+    _Atomic uint64_t bytes[MY_STAT_OPS];
+    _Atomic uint64_t ns[MY_STAT_OPS];
+    _Atomic uint64_t max[MY_STAT_OPS];
+    _Atomic uint64_t hist[MY_STAT_OPS][MY_STAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct my_stat_stripe stripes[MY_STAT_STRIPES];
+static _Atomic uint32_t stripe_count = 0;
+static _Thread_local struct my_stat_stripe* stripe = NULL;
+
+static const char* names[MY_STAT_OPS] = {
+    "read",
+    "write",
+    "seek",
+    "alloc",
+    "ls_dir",
+    "lookup",
+    "create",
+    "link",
+    "unlink",
+    "dump",
+    "load",
+};
+
+/**
+ * Bucket of `ns`: below 4 it's the value, else the
+ * power of 2 and the next 2 bits.
+ */
+static inline uint32_t bucket_of(uint64_t ns)
+{
+    if (ns < 4) return ns;
+    uint32_t e = 63 - __builtin_clzll(ns);
+    uint32_t b = (e - 1) * 4 + ((ns >> (e - 2)) & 3);
+    return (b < MY_STAT_BUCKETS) ? b : MY_STAT_BUCKETS - 1;
+}
+
+/**
+ * The smallest value of the bucket.
+ */
+static inline uint64_t bucket_floor(uint32_t b)
+{
+    if (b < 4) return b;
+    return (uint64_t) (4 + b % 4) << (b / 4 - 1);
+}
+
+uint64_t my_stat_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void my_stat_record(enum my_stat_op op, uint64_t begin, uint64_t bytes)
+{
+    uint64_t ns = my_stat_now() - begin;
+    if (stripe == NULL)
+        stripe = &stripes[atomic_fetch_add(&stripe_count, 1) % MY_STAT_STRIPES];
+    atomic_fetch_add_explicit(&stripe->count[op], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stripe->bytes[op], bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stripe->ns[op], ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stripe->hist[op][bucket_of(ns)], 1,
+        memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&stripe->max[op], memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&stripe->max[op],
+        &max, ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+const char* my_stat_name(enum my_stat_op op)
+{
+    return (op < MY_STAT_OPS) ? names[op] : "?";
+}
+
+/**
+ * Sum the buckets of `op` of all the stripes.
+ */
+static void fold_hist(enum my_stat_op op, uint64_t* hist)
+{
+    memset(hist, 0, sizeof(uint64_t) * MY_STAT_BUCKETS);
+    for (uint32_t s = 0; s < MY_STAT_STRIPES; ++s)
+        for (uint32_t b = 0; b < MY_STAT_BUCKETS; ++b)
+            hist[b] += atomic_load_explicit(&stripes[s].hist[op][b],
+                memory_order_relaxed);
+}
+
+static uint64_t percentile(const uint64_t* hist, uint64_t count, double p)
+{
+    uint64_t rank = count * p, seen = 0;
+    for (uint32_t b = 0; b < MY_STAT_BUCKETS; ++b)
+        if ((seen += hist[b]) > rank) return bucket_floor(b);
+    return 0;
+}
+
+void my_stats_get(enum my_stat_op op, struct my_stat_summary* summary)
+{
+    uint64_t hist[MY_STAT_BUCKETS];
+    memset(summary, 0, sizeof(struct my_stat_summary));
+    for (uint32_t s = 0; s < MY_STAT_STRIPES; ++s)
+    {
+        struct my_stat_stripe* st = &stripes[s];
+        summary->count += atomic_load_explicit(&st->count[op], memory_order_relaxed);
+        summary->bytes += atomic_load_explicit(&st->bytes[op], memory_order_relaxed);
+        summary->total_ns += atomic_load_explicit(&st->ns[op], memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&st->max[op], memory_order_relaxed);
+        if (max > summary->max_ns) summary->max_ns = max;
+    }
+    if (summary->count == 0) return;
+    fold_hist(op, hist);
+    summary->p50_ns = percentile(hist, summary->count, 0.5);
+    summary->p90_ns = percentile(hist, summary->count, 0.9);
+    summary->p99_ns = percentile(hist, summary->count, 0.99);
+}
+
+void my_stats_dump_json(FILE* file)
+{
+    uint64_t hist[MY_STAT_BUCKETS];
+    struct my_stat_summary s;
+    fprintf(file, "{");
+    for (uint32_t op = 0; op < MY_STAT_OPS; ++op)
+    {
+        my_stats_get(op, &s);
+        fprintf(file, "%s\"%s\": {\"count\": %llu, \"bytes\": %llu, "
+            "\"total_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+            "\"p99_ns\": %llu, \"max_ns\": %llu, \"buckets\": {",
+            op ? ", " : "", names[op], (unsigned long long) s.count,
+            (unsigned long long) s.bytes, (unsigned long long) s.total_ns,
+            (unsigned long long) s.p50_ns, (unsigned long long) s.p90_ns,
+            (unsigned long long) s.p99_ns, (unsigned long long) s.max_ns);
+        // only the buckets with something, by lower bound
+        fold_hist(op, hist);
+        bool first = true;
+        for (uint32_t b = 0; b < MY_STAT_BUCKETS; ++b)
+            if (hist[b])
+            {
+                fprintf(file, "%s\"%llu\": %llu", first ? "" : ", ",
+                    (unsigned long long) bucket_floor(b),
+                    (unsigned long long) hist[b]);
+                first = false;
+            }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "}\n");
+}
+
+void my_stats_reset()
+{
+    for (uint32_t s = 0; s < MY_STAT_STRIPES; ++s)
+        for (uint32_t op = 0; op < MY_STAT_OPS; ++op)
+        {
+            struct my_stat_stripe* st = &stripes[s];
+            atomic_store_explicit(&st->count[op], 0, memory_order_relaxed);
+            atomic_store_explicit(&st->bytes[op], 0, memory_order_relaxed);
+            atomic_store_explicit(&st->ns[op], 0, memory_order_relaxed);
+            atomic_store_explicit(&st->max[op], 0, memory_order_relaxed);
+            for (uint32_t b = 0; b < MY_STAT_BUCKETS; ++b)
+                atomic_store_explicit(&st->hist[op][b], 0, memory_order_relaxed);
+        }
+}
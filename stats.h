@@ -0,0 +1,95 @@
+#ifndef __H_MY_STATS__
+#define __H_MY_STATS__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// latency buckets, 4 for every power of 2 of
+// nanoseconds, the last one is 2^40ns and more
+#define MY_STAT_BUCKETS 160
+
+/**
+ * The operations of the public API that are timed.
+ */
+enum my_stat_op
+{
+    MY_STAT_READ,
+    MY_STAT_WRITE,
+    MY_STAT_SEEK,
+    MY_STAT_ALLOC,
+    MY_STAT_LS_DIR,
+    MY_STAT_LOOKUP,
+    MY_STAT_CREATE,
+    MY_STAT_LINK,
+    MY_STAT_UNLINK,
+    MY_STAT_DUMP,
+    MY_STAT_LOAD,
+    MY_STAT_OPS
+};
+
+/**
+ * What `my_stats_get` tells of an operation. The
+ * percentiles are the lower bounds of their buckets,
+ * within 25% of the real value.
+ */
+struct my_stat_summary
+{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+};
+
+/**
+ * Time the code between `MY_STAT_BEGIN(t)` and
+ * `MY_STAT_END(op, t, bytes)`. The counters are for
+ * the whole process, in stripes so the threads don't
+ * fight for them. Build with `MY_FS_NO_STATS` and
+ * both are gone.
+ */
+#ifdef MY_FS_NO_STATS
+    #define MY_STAT_BEGIN(t)
+    #define MY_STAT_END(op, t, bytes) ((void) 0)
+#else
+    #define MY_STAT_BEGIN(t) uint64_t t = my_stat_now()
+    #define MY_STAT_END(op, t, bytes) my_stat_record((op), (t), (bytes))
+#endif
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+uint64_t my_stat_now();
+
+/**
+ * Count one `op` that began at `begin` and moved
+ * `bytes` bytes.
+ */
+void my_stat_record(enum my_stat_op op, uint64_t begin, uint64_t bytes);
+
+/**
+ * Name of the operation, like "read".
+ */
+const char* my_stat_name(enum my_stat_op op);
+
+/**
+ * Fold the stripes of `op` into `summary`.
+ */
+void my_stats_get(enum my_stat_op op, struct my_stat_summary* summary);
+
+/**
+ * Write all the counters and the non-empty buckets
+ * of every operation as one JSON object.
+ */
+void my_stats_dump_json(FILE* file);
+
+/**
+ * Start counting from 0 again. Operations running
+ * at the same time may be counted or not.
+ */
+void my_stats_reset();
+
+#endif
@@ -0,0 +1,823 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "tar.h"
+#include "utils.h"
+#include "lock.h"
+
+#define TAR_BLOCK 512
+// read and write the archive this much at a time
+#define TAR_BUFFER (1024 * 1024)
+// file data this large goes out right from the blocks
+#define TAR_DIRECT (64 * 1024)
+#define TAR_CHUNK (64 * 1024 * 1024)
+#define TAR_IOVECS 1024
+// the largest size the header has room for
+#define TAR_MAX_SIZE 077777777777ull
+
+/**
+ * The header of an entry, one block.
+ */
+struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+_Static_assert(sizeof(struct tar_header) == TAR_BLOCK, "tar header is a block");
+
+static double seconds_since(struct timespec* begin)
+{
+    struct timespec end;
+    timespec_get(&end, TIME_UTC);
+    return (end.tv_sec - begin->tv_sec) + (end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/**
+ * Read a number of the header, octal or the GNU
+ * base-256 of the large ones.
+ */
+static uint64_t parse_number(const char* field, uint32_t size)
+{
+    uint64_t n = 0;
+    if ((uint8_t) field[0] & 0x80)
+    {
+        n = (uint8_t) field[0] & 0x7f;
+        for (uint32_t i = 1; i < size; ++i) n = (n << 8) | (uint8_t) field[i];
+        return n;
+    }
+    uint32_t i = 0;
+    while (i < size && field[i] == ' ') ++i;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i)
+        n = n * 8 + (field[i] - '0');
+    return n;
+}
+
+static uint32_t header_sum(const struct tar_header* header)
+{
+    const uint8_t* p = (const uint8_t*) header;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < TAR_BLOCK; ++i)
+        // the checksum counts as spaces
+        sum += (i >= 148 && i < 156) ? ' ' : p[i];
+    return sum;
+}
+
+static bool all_zeros(const uint8_t* p)
+{
+    for (uint32_t i = 0; i < TAR_BLOCK; ++i)
+        if (p[i]) return false;
+    return true;
+}
+
+/**
+ * The archive coming in, buffered.
+ */
+struct tar_reader
+{
+    int fd;
+    uint8_t* buffer;
+    uint32_t start, end;
+};
+
+/**
+ * Read more after what's buffered. Return false at
+ * the end of the archive.
+ */
+static bool fill(struct tar_reader* r)
+{
+    // what isn't taken yet goes to the front
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+    ssize_t len;
+    do len = read(r->fd, r->buffer + r->end, TAR_BUFFER - r->end);
+    while (len < 0 && errno == EINTR);
+    if (len <= 0) return false;
+    r->end += len;
+    return true;
+}
+
+/**
+ * Take the next `size` bytes, at most a buffer, in
+ * one piece. NULL if the archive ends before.
+ */
+static uint8_t* take(struct tar_reader* r, uint32_t size)
+{
+    while (r->end - r->start < size)
+        if (!fill(r)) return NULL;
+    uint8_t* p = r->buffer + r->start;
+    r->start += size;
+    return p;
+}
+
+/**
+ * Take what's buffered of the next `size` bytes, put
+ * how much in `len`. NULL if the archive ends.
+ */
+static uint8_t* take_some(struct tar_reader* r, uint64_t size, uint32_t* len)
+{
+    if (r->start == r->end && !fill(r)) return NULL;
+    *len = (r->end - r->start < size) ? r->end - r->start : size;
+    uint8_t* p = r->buffer + r->start;
+    r->start += *len;
+    return p;
+}
+
+static bool skip(struct tar_reader* r, uint64_t size)
+{
+    uint32_t len;
+    for (; size; size -= len)
+        if (take_some(r, size, &len) == NULL) return false;
+    return true;
+}
+
+static uint64_t padding_of(uint64_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/**
+ * Read the data of a pax header or a GNU long name
+ * and the padding after it. NULL if it's cut.
+ */
+static char* take_all(struct tar_reader* r, uint64_t size)
+{
+    // nobody has names of megabytes
+    if (size > TAR_BUFFER) return NULL;
+    char* data = (char*) malloc(size + 1);
+    uint32_t len;
+    for (uint64_t got = 0; got < size; got += len)
+    {
+        uint8_t* p = take_some(r, size - got, &len);
+        if (p == NULL)
+        {
+            free(data);
+            return NULL;
+        }
+        memcpy(data + got, p, len);
+    }
+    data[size] = '\0';
+    if (!skip(r, padding_of(size)))
+    {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * What a pax header says about the next entry.
+ */
+struct tar_pax
+{
+    char* path;
+    uint64_t size;
+    uint64_t mtime;
+    bool sized, timed;
+};
+
+/**
+ * Read the "length key=value\n" records of a pax
+ * header, the ones myfs has no use for are ignored.
+ */
+static void parse_pax(struct tar_pax* pax, char* data, uint64_t size)
+{
+    char *p = data, *end = data + size;
+    while (p < end)
+    {
+        char* q;
+        uint64_t len = strtoull(p, &q, 10);
+        if (len == 0 || len > end - p || *q != ' ') return;
+        char *key = q + 1, *next = p + len;
+        char* eq = memchr(key, '=', next - key);
+        if (eq == NULL || next[-1] != '\n') return;
+        char* value = eq + 1;
+        size_t key_len = eq - key, value_len = next - 1 - value;
+        if (key_len == 4 && !memcmp(key, "path", 4))
+        {
+            free(pax->path);
+            pax->path = strndup(value, value_len);
+        }
+        else if (key_len == 4 && !memcmp(key, "size", 4))
+        {
+            pax->size = strtoull(value, NULL, 10);
+            pax->sized = true;
+        }
+        else if (key_len == 5 && !memcmp(key, "mtime", 5))
+        {
+            pax->mtime = strtoull(value, NULL, 10);
+            pax->timed = true;
+        }
+        p = next;
+    }
+}
+
+/**
+ * Clean the path of an entry into `out`: no empty
+ * or "." parts, no slashes at the ends. Return its
+ * length, -1 if it goes up with ".." or has names
+ * myfs can't have.
+ */
+static int64_t clean_path(const char* path, char* out)
+{
+    int64_t len = 0;
+    while (*path)
+    {
+        const char* end = strchr(path, '/');
+        if (end == NULL) end = path + strlen(path);
+        size_t part = end - path;
+        if (part == 2 && !memcmp(path, "..", 2)) return -1;
+        if (memchr(path, '\n', part) || memchr(path, '\\', part)) return -1;
+        if (part && !(part == 1 && path[0] == '.'))
+        {
+            if (len) out[len++] = '/';
+            memcpy(out + len, path, part);
+            len += part;
+        }
+        path = *end ? end + 1 : end;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/**
+ * A directory the archive puts something in. Its
+ * entries are referenced when the archive is read.
+ */
+struct tar_dir
+{
+    // from the top, "" for the top itself
+    char* path;
+    // -1 if it couldn't be made
+    uint32_t inode;
+    // made for the archive, so empty before it
+    bool made;
+    // its entry wasn't referenced, all in it goes
+    bool failed;
+    struct my_dir_entry* entries;
+    // the directory of each entry, NULL for files
+    struct tar_dir** subs;
+    uint32_t count, size;
+};
+
+struct tar_in
+{
+    struct my_partition* partition;
+    struct my_tar_report* report;
+    // by path
+    struct tar_dir** table;
+    uint32_t slots;
+    // in the order they're made, parents first
+    struct tar_dir** dirs;
+    uint32_t count, size;
+};
+
+static uint32_t path_hash(const char* path, uint32_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; ++i)
+        hash = (hash ^ (uint8_t) path[i]) * 16777619u;
+    return hash;
+}
+
+static struct tar_dir* find_dir(struct tar_in* t, const char* path, uint32_t len)
+{
+    for (uint32_t i = path_hash(path, len) & (t->slots - 1); t->table[i];
+        i = (i + 1) & (t->slots - 1))
+        if (!strncmp(t->table[i]->path, path, len) && t->table[i]->path[len] == '\0')
+            return t->table[i];
+    return NULL;
+}
+
+static struct tar_dir* add_dir(
+    struct tar_in* t, const char* path, uint32_t len, uint32_t inode, bool made)
+{
+    if ((t->count + 1) * 2 > t->slots)
+    {
+        // grow the table, the dirs are all in the list
+        t->slots *= 2;
+        free(t->table);
+        t->table = (struct tar_dir**) calloc(t->slots, sizeof(struct tar_dir*));
+        for (uint32_t n = 0; n < t->count; ++n)
+        {
+            struct tar_dir* d = t->dirs[n];
+            uint32_t i = path_hash(d->path, strlen(d->path)) & (t->slots - 1);
+            while (t->table[i]) i = (i + 1) & (t->slots - 1);
+            t->table[i] = d;
+        }
+    }
+    if (t->count == t->size)
+    {
+        t->size *= 2;
+        t->dirs = (struct tar_dir**) realloc(t->dirs,
+            sizeof(struct tar_dir*) * t->size);
+    }
+    struct tar_dir* d = (struct tar_dir*) calloc(1, sizeof(struct tar_dir));
+    d->path = strndup(path, len);
+    d->inode = inode;
+    d->made = made;
+    uint32_t i = path_hash(path, len) & (t->slots - 1);
+    while (t->table[i]) i = (i + 1) & (t->slots - 1);
+    t->table[i] = d;
+    t->dirs[t->count++] = d;
+    return d;
+}
+
+static void add_entry(
+    struct tar_dir* dir, uint32_t inode, uint8_t type, const char* name,
+    struct tar_dir* sub)
+{
+    if (dir->count == dir->size)
+    {
+        dir->size = dir->size ? dir->size * 2 : 16;
+        dir->entries = (struct my_dir_entry*) realloc(dir->entries,
+            sizeof(struct my_dir_entry) * dir->size);
+        dir->subs = (struct tar_dir**) realloc(dir->subs,
+            sizeof(struct tar_dir*) * dir->size);
+    }
+    dir->entries[dir->count] = (struct my_dir_entry) { inode, type, name, false };
+    dir->subs[dir->count++] = sub;
+}
+
+/**
+ * Find the directory of the clean path, make it and
+ * its parents if they aren't there.
+ */
+static struct tar_dir* resolve(struct tar_in* t, const char* path, uint32_t len)
+{
+    struct tar_dir* d = find_dir(t, path, len);
+    if (d) return d;
+    uint32_t cut = len;
+    while (cut > 0 && path[cut - 1] != '/') --cut;
+    struct tar_dir* parent = resolve(t, path, cut ? cut - 1 : 0);
+    d = add_dir(t, path, len, -1, false);
+    const char* name = d->path + cut;
+    if (parent->inode == -1) return d;
+
+    if (!parent->made)
+    {
+        // it may be there already
+        struct my_dir_list* list = my_ls_dir(t->partition, parent->inode);
+        struct my_dir_list* file = my_get_file(t->partition, list, name);
+        if (file && file->type == MY_TYPE_DIR) d->inode = file->inode;
+        if (file && file->type != MY_TYPE_DIR) ++t->report->failed;
+        my_free_dir_list(t->partition, list);
+        if (file) return d;
+    }
+    d->inode = my_touch_in(t->partition, parent->inode, MY_TYPE_DIR);
+    if (d->inode == -1) ++t->report->failed;
+    else
+    {
+        d->made = true;
+        add_entry(parent, d->inode, MY_TYPE_DIR, name, d);
+    }
+    return d;
+}
+
+/**
+ * Make a file of the clean path with the data that
+ * follows in the archive. Return false if the
+ * archive is cut.
+ */
+static bool read_file(
+    struct tar_in* t, struct tar_reader* r, const char* path, uint32_t len,
+    uint64_t size, uint64_t mtime)
+{
+    struct my_partition* partition = t->partition;
+    uint32_t cut = len;
+    while (cut > 0 && path[cut - 1] != '/') --cut;
+    struct tar_dir* parent = resolve(t, path, cut ? cut - 1 : 0);
+    uint32_t inode = (parent->inode == -1) ? -1 :
+        my_touch_in(partition, parent->inode, MY_TYPE_FILE);
+    if (inode == -1)
+    {
+        ++t->report->failed;
+        return skip(r, size + padding_of(size));
+    }
+
+    // the size is known, map all the blocks at once
+    bool ok = size == 0 || my_file_reserve(partition, inode, size);
+    struct my_file* file = my_file_open(partition, inode);
+    uint64_t left = size;
+    uint32_t n;
+    while (ok && left)
+    {
+        // straight from the read buffer
+        uint8_t* p = take_some(r, left, &n);
+        if (p == NULL) break;
+        if (my_file_write(partition, file, p, n) != n) ok = false;
+        left -= n;
+    }
+    if (!my_file_flush(partition, file)) ok = false;
+    my_file_close(partition, file);
+    // no space, or the archive is cut in the middle
+    if (!ok || left)
+    {
+        my_delete_file(partition, inode);
+        ++t->report->failed;
+        return ok ? false : skip(r, left + padding_of(size));
+    }
+    my_get_inode_pointer(partition, inode)->mtime = mtime;
+    add_entry(parent, inode, MY_TYPE_FILE, strndup(path + cut, len - cut), NULL);
+    return skip(r, padding_of(size));
+}
+
+/**
+ * Reference the entries of every directory, parents
+ * before children. What's in a directory that wasn't
+ * referenced goes with it.
+ */
+static void finish(struct tar_in* t)
+{
+    struct my_partition* partition = t->partition;
+    for (uint32_t i = 0; i < t->count; ++i)
+    {
+        struct tar_dir* d = t->dirs[i];
+        if (!d->failed && d->count)
+            my_dir_reference_files(partition, d->inode, d->entries, d->count);
+        for (uint32_t j = 0; j < d->count; ++j)
+        {
+            struct my_dir_entry* e = &d->entries[j];
+            if (!d->failed && e->referenced)
+            {
+                if (d->subs[j]) ++t->report->dirs;
+                else
+                {
+                    ++t->report->files;
+                    t->report->bytes +=
+                        my_get_inode_pointer(partition, e->inode)->size;
+                }
+                continue;
+            }
+            ++t->report->failed;
+            if (d->subs[j]) d->subs[j]->failed = true;
+            else my_delete_file(partition, e->inode);
+        }
+        // nothing was referenced in it
+        if (d->failed) my_delete_file(partition, d->inode);
+    }
+}
+
+static void free_dirs(struct tar_in* t)
+{
+    for (uint32_t i = 0; i < t->count; ++i)
+    {
+        struct tar_dir* d = t->dirs[i];
+        // the names of directories live in their path
+        for (uint32_t j = 0; j < d->count; ++j)
+            if (d->subs[j] == NULL) free((char*) d->entries[j].filename);
+        free(d->entries);
+        free(d->subs);
+        free(d->path);
+        free(d);
+    }
+    free(t->dirs);
+    free(t->table);
+}
+
+bool my_tar_in(
+    struct my_partition* partition, uint32_t dir, int fd,
+    struct my_tar_report* report)
+{
+    struct timespec begin;
+    timespec_get(&begin, TIME_UTC);
+    memset(report, 0, sizeof(struct my_tar_report));
+    struct tar_in t = { partition, report };
+    t.slots = 64;
+    t.table = (struct tar_dir**) calloc(t.slots, sizeof(struct tar_dir*));
+    t.size = 16;
+    t.dirs = (struct tar_dir**) malloc(sizeof(struct tar_dir*) * t.size);
+    add_dir(&t, "", 0, dir, false);
+    struct tar_reader r = { fd, (uint8_t*) malloc(TAR_BUFFER), 0, 0 };
+    struct tar_pax pax;
+    memset(&pax, 0, sizeof(pax));
+    bool ok = false;
+
+    for (;;)
+    {
+        struct tar_header* h = (struct tar_header*) take(&r, TAR_BLOCK);
+        if (h == NULL)
+        {
+            // no end blocks, but nothing's cut either
+            ok = (r.start == r.end);
+            break;
+        }
+        if (all_zeros((uint8_t*) h))
+        {
+            ok = true;
+            break;
+        }
+        if (header_sum(h) != parse_number(h->checksum, sizeof(h->checksum)))
+            break;
+        uint64_t size = pax.sized ? pax.size :
+            parse_number(h->size, sizeof(h->size));
+        uint64_t mtime = pax.timed ? pax.mtime :
+            parse_number(h->mtime, sizeof(h->mtime));
+        char type = h->type;
+
+        if (type == 'x' || type == 'L')
+        {
+            // about the next entry
+            char* data = take_all(&r, size);
+            if (data == NULL) break;
+            if (type == 'x') parse_pax(&pax, data, size);
+            else
+            {
+                free(pax.path);
+                pax.path = data;
+                data = NULL;
+            }
+            free(data);
+            continue;
+        }
+
+        // the name, split in two by ustar
+        char raw[257];
+        const char* name = pax.path;
+        if (name == NULL)
+        {
+            size_t prefix = 0;
+            if (!memcmp(h->magic, "ustar", 5) && h->prefix[0])
+            {
+                prefix = strnlen(h->prefix, sizeof(h->prefix));
+                memcpy(raw, h->prefix, prefix);
+                raw[prefix++] = '/';
+            }
+            size_t len = strnlen(h->name, sizeof(h->name));
+            memcpy(raw + prefix, h->name, len);
+            raw[prefix + len] = '\0';
+            name = raw;
+        }
+        size_t raw_len = strlen(name);
+        // old archives mark directories with a slash
+        if ((type == '0' || type == '\0') && raw_len && name[raw_len - 1] == '/')
+            type = '5';
+        char* path = (char*) malloc(raw_len + 1);
+        int64_t len = clean_path(name, path);
+
+        bool more = true;
+        if ((type == '0' || type == '\0' || type == '7') && len > 0)
+            more = read_file(&t, &r, path, len, size, mtime);
+        else if (type == '5' && len > 0)
+        {
+            struct tar_dir* d = resolve(&t, path, len);
+            if (d->made)
+                my_get_inode_pointer(partition, d->inode)->mtime = mtime;
+            more = skip(&r, size + padding_of(size));
+        }
+        else
+        {
+            // links, devices, global pax headers, and
+            // names myfs can't have
+            if (type != 'g' && len != 0) ++report->skipped;
+            more = skip(&r, size + padding_of(size));
+        }
+        free(path);
+        free(pax.path);
+        memset(&pax, 0, sizeof(pax));
+        if (!more) break;
+    }
+
+    finish(&t);
+    free(pax.path);
+    free(r.buffer);
+    free_dirs(&t);
+    report->seconds = seconds_since(&begin);
+    return ok;
+}
+
+/**
+ * The archive going out, buffered.
+ */
+struct tar_writer
+{
+    int fd;
+    uint8_t* buffer;
+    uint32_t length;
+    // false once a write failed
+    bool ok;
+};
+
+static void flush_out(struct tar_writer* w)
+{
+    if (w->length && w->ok)
+    {
+        struct iovec iov = { w->buffer, w->length };
+        w->ok = my_write_iov(w->fd, &iov, 1);
+    }
+    w->length = 0;
+}
+
+static void put(struct tar_writer* w, const void* data, uint64_t size)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    while (size)
+    {
+        if (w->length == TAR_BUFFER) flush_out(w);
+        uint32_t len = TAR_BUFFER - w->length;
+        if (len > size) len = size;
+        // NULL for zeros
+        if (p) memcpy(w->buffer + w->length, p, len);
+        else memset(w->buffer + w->length, 0, len);
+        w->length += len;
+        if (p) p += len;
+        size -= len;
+    }
+}
+
+static void octal(char* field, uint32_t size, uint64_t value)
+{
+    // the last digit first, then the rest
+    field[size - 1] = '\0';
+    for (int32_t i = size - 2; i >= 0; --i, value >>= 3)
+        field[i] = '0' + (value & 7);
+}
+
+/**
+ * Put a "length key=value\n" record of pax at `out`,
+ * the length counts itself. Return its length.
+ */
+static uint32_t pax_record(char* out, const char* key, const char* value)
+{
+    uint32_t len = strlen(key) + strlen(value) + 3;
+    uint32_t digits = 1;
+    while (snprintf(NULL, 0, "%u", len + digits) > digits) ++digits;
+    return sprintf(out, "%u %s=%s\n", len + digits, key, value);
+}
+
+static void put_header(
+    struct tar_writer* w, const char* path, char type, uint64_t size,
+    uint64_t mtime)
+{
+    struct tar_header h;
+    memset(&h, 0, sizeof(h));
+    size_t len = strlen(path);
+    const char* name = path;
+    bool long_path = false;
+    if (len > sizeof(h.name))
+    {
+        // ustar takes it split at a slash
+        const char* cut = path + len - sizeof(h.name) - 1;
+        while (*cut && *cut != '/') ++cut;
+        if (*cut && cut > path && cut - path <= sizeof(h.prefix) && cut[1])
+        {
+            memcpy(h.prefix, path, cut - path);
+            name = cut + 1;
+        }
+        else long_path = true;
+    }
+    if (long_path || size > TAR_MAX_SIZE)
+    {
+        char size_text[24];
+        snprintf(size_text, sizeof(size_text), "%llu", (unsigned long long) size);
+        char* records = (char*) malloc(len + 64);
+        uint32_t length = 0;
+        if (long_path) length += pax_record(records + length, "path", path);
+        if (size > TAR_MAX_SIZE)
+            length += pax_record(records + length, "size", size_text);
+        put_header(w, "PaxHeader", 'x', length, mtime);
+        put(w, records, length);
+        put(w, NULL, padding_of(length));
+        free(records);
+    }
+
+    memcpy(h.name, name, strlen(name) < sizeof(h.name) ?
+        strlen(name) : sizeof(h.name));
+    octal(h.mode, sizeof(h.mode), (type == '5') ? 0755 : 0644);
+    octal(h.uid, sizeof(h.uid), 0);
+    octal(h.gid, sizeof(h.gid), 0);
+    octal(h.size, sizeof(h.size), (size > TAR_MAX_SIZE) ? 0 : size);
+    octal(h.mtime, sizeof(h.mtime), mtime);
+    h.type = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    octal(h.checksum, 7, header_sum(&h));
+    h.checksum[7] = ' ';
+    put(w, &h, sizeof(h));
+}
+
+struct tar_out
+{
+    struct my_partition* partition;
+    struct my_tar_report* report;
+    struct tar_writer writer;
+    struct iovec iov[TAR_IOVECS];
+};
+
+/**
+ * Put `size` bytes of the file, small pieces are
+ * copied to the buffer, large ones are written from
+ * the blocks under the range lock.
+ */
+static void put_data(struct tar_out* t, uint32_t inode, uint64_t size)
+{
+    struct my_partition* partition = t->partition;
+    struct tar_writer* w = &t->writer;
+    uint64_t offset = 0, mapped;
+    while (w->ok && offset < size)
+    {
+        uint64_t len = (size - offset < TAR_CHUNK) ? size - offset : TAR_CHUNK;
+        uint32_t lock = my_range_lock(partition, inode, offset, offset + len, false);
+        uint32_t n = my_file_map_iov(partition, inode, offset, len,
+            t->iov, TAR_IOVECS, &mapped);
+        if (mapped < TAR_DIRECT)
+            for (uint32_t i = 0; i < n; ++i)
+                put(w, t->iov[i].iov_base, t->iov[i].iov_len);
+        else
+        {
+            flush_out(w);
+            if (w->ok) w->ok = my_write_iov(w->fd, t->iov, n);
+        }
+        my_range_unlock(partition, inode, lock);
+        // it was cut meanwhile, the header has the size
+        if (mapped == 0) break;
+        offset += mapped;
+    }
+    put(w, NULL, size - offset + padding_of(size));
+}
+
+static void put_tree(struct tar_out* t, uint32_t inode, uint8_t type, const char* path)
+{
+    struct my_partition* partition = t->partition;
+    struct my_inode* node = my_get_inode_pointer(partition, inode);
+    if (type != MY_TYPE_DIR)
+    {
+        uint64_t size = node->size;
+        put_header(&t->writer, path, '0', size, node->mtime);
+        put_data(t, inode, size);
+        ++t->report->files;
+        t->report->bytes += size;
+        return;
+    }
+
+    size_t len = strlen(path);
+    if (len)
+    {
+        // a slash at the end of directories
+        char* name = (char*) malloc(len + 2);
+        sprintf(name, "%s/", path);
+        put_header(&t->writer, name, '5', 0, node->mtime);
+        free(name);
+        ++t->report->dirs;
+    }
+    struct my_dir_list* list = my_ls_dir(partition, inode);
+    for (struct my_dir_list* e = list; e && t->writer.ok; e = e->next)
+    {
+        char* sub = (char*) malloc(len + strlen(e->filename) + 2);
+        if (len) sprintf(sub, "%s/%s", path, e->filename);
+        else strcpy(sub, e->filename);
+        put_tree(t, e->inode, e->type, sub);
+        free(sub);
+    }
+    my_free_dir_list(partition, list);
+}
+
+bool my_tar_out(
+    struct my_partition* partition, uint32_t inode, uint8_t type,
+    const char* name, int fd, struct my_tar_report* report)
+{
+    struct timespec begin;
+    timespec_get(&begin, TIME_UTC);
+    memset(report, 0, sizeof(struct my_tar_report));
+    struct tar_out* t = (struct tar_out*) malloc(sizeof(struct tar_out));
+    t->partition = partition;
+    t->report = report;
+    t->writer = (struct tar_writer) { fd, (uint8_t*) malloc(TAR_BUFFER), 0, true };
+
+    put_tree(t, inode, type, name);
+    // the end is two blocks of zeros
+    put(&t->writer, NULL, 2 * TAR_BLOCK);
+    flush_out(&t->writer);
+
+    bool ok = t->writer.ok;
+    free(t->writer.buffer);
+    free(t);
+    report->seconds = seconds_since(&begin);
+    return ok;
+}
@@ -0,0 +1,54 @@
+#ifndef __H_MY_TAR__
+#define __H_MY_TAR__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "myfs.h"
+
+/**
+ * What `my_tar_in` or `my_tar_out` did.
+ */
+struct my_tar_report
+{
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+    // entries that couldn't be made, read or written
+    uint64_t failed;
+    // links, devices and names myfs can't have
+    uint64_t skipped;
+    double seconds;
+};
+
+/**
+ * Read a tar archive (ustar, with pax and GNU long
+ * names) from `fd` in one pass and make its files
+ * and directories under the directory `dir`. The
+ * data goes from the read buffer to the blocks, the
+ * directories of the archive that exist already are
+ * filled, the files that exist already are kept.
+ * The entries of a directory are referenced with one
+ * update of it once the archive is read.
+ * Return false if the archive is cut or broken, the
+ * entries before stay.
+ */
+bool my_tar_in(
+    struct my_partition* partition, uint32_t dir, int fd,
+    struct my_tar_report* report);
+
+/**
+ * Write `inode` of `type`, a file or a directory and
+ * all under it, as a ustar archive to `fd` in one
+ * pass, named `name` in it. If `name` is empty, the
+ * directory itself isn't in the archive, only what's
+ * in it.
+ * Paths too long for ustar get a pax header. Large
+ * files are written with `writev` right from their
+ * blocks. Return false if `fd` can't be written.
+ */
+bool my_tar_out(
+    struct my_partition* partition, uint32_t inode, uint8_t type,
+    const char* name, int fd, struct my_tar_report* report);
+
+#endif
@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// max number of rings, threads after that aren't traced
+#define MY_TRACE_RINGS 256
+
+struct trace_slot
+{
+    uint64_t begin;
+    uint64_t end;
+    uint64_t bytes;
+    uint32_t inode;
+    uint16_t tid;
+    uint8_t event;
+};
+
+/**
+ * The events of a thread. The thread writes a slot
+ * then moves `head`, the readers copy the slots then
+ * read `head` again to see what was overwritten.
+ */
+struct trace_ring
+{
+    _Atomic uint64_t head;
+    // events before it are from the last trace
+    _Atomic uint64_t first;
+    // false when the thread is gone, the next new
+    // thread takes it
+    _Atomic bool owned;
+    uint16_t tid;
+    struct trace_slot slots[MY_TRACE_RING];
+};
+
+_Atomic bool my_trace_on = false;
+
+static const char* names[MY_TRACE_EVENTS] = {
+    "read",
+    "write",
+    "alloc",
+    "link",
+    "unlink",
+    "erase",
+    "dump",
+    "load",
+};
+
+static struct
+{
+    pthread_mutex_t mutex;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct trace_ring* rings[MY_TRACE_RINGS];
+    _Atomic uint32_t count;
+    uint16_t next_tid;
+} tracer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+
+static _Thread_local struct trace_ring* ring = NULL;
+
+static void retire(void* p)
+{
+    atomic_store(&((struct trace_ring*) p)->owned, false);
+}
+
+static void init_key()
+{
+    pthread_key_create(&tracer.key, retire);
+}
+
+/**
+ * Take a ring left by a thread that's gone, or make
+ * a new one. NULL if there are too many.
+ */
+static struct trace_ring* take_ring()
+{
+    pthread_once(&tracer.once, init_key);
+    struct trace_ring* r = NULL;
+    pthread_mutex_lock(&tracer.mutex);
+    uint32_t count = atomic_load(&tracer.count);
+    for (uint32_t i = 0; i < count && !r; ++i)
+        if (!atomic_load(&tracer.rings[i]->owned)) r = tracer.rings[i];
+    if (r == NULL && count < MY_TRACE_RINGS &&
+        (r = (struct trace_ring*) calloc(1, sizeof(struct trace_ring))))
+    {
+        tracer.rings[count] = r;
+        atomic_store(&tracer.count, count + 1);
+    }
+    if (r)
+    {
+        // the old events keep the id of their thread
+        r->tid = ++tracer.next_tid;
+        atomic_store(&r->owned, true);
+        pthread_setspecific(tracer.key, r);
+    }
+    pthread_mutex_unlock(&tracer.mutex);
+    return r;
+}
+
+void my_trace_record(
+    enum my_trace_event event, uint64_t begin, uint32_t inode, uint64_t bytes)
+{
+    uint64_t end = my_stat_now();
+    if (ring == NULL && (ring = take_ring()) == NULL) return;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct trace_slot* slot = &ring->slots[head % MY_TRACE_RING];
+    slot->begin = begin;
+    slot->end = end;
+    slot->bytes = bytes;
+    slot->inode = inode;
+    slot->tid = ring->tid;
+    slot->event = event;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void my_trace_start()
+{
+    atomic_store(&my_trace_on, false);
+    pthread_mutex_lock(&tracer.mutex);
+    uint32_t count = atomic_load(&tracer.count);
+    for (uint32_t i = 0; i < count; ++i)
+        atomic_store(&tracer.rings[i]->first, atomic_load(&tracer.rings[i]->head));
+    pthread_mutex_unlock(&tracer.mutex);
+    atomic_store(&my_trace_on, true);
+}
+
+void my_trace_stop()
+{
+    atomic_store(&my_trace_on, false);
+}
+
+uint64_t my_trace_save(FILE* file)
+{
+    struct trace_slot* copy = (struct trace_slot*) malloc(
+        sizeof(struct trace_slot) * MY_TRACE_RING);
+    uint64_t written = 0;
+    int pid = getpid();
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    pthread_mutex_lock(&tracer.mutex);
+    uint32_t count = atomic_load(&tracer.count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        struct trace_ring* r = tracer.rings[i];
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t first = atomic_load(&r->first);
+        uint64_t start = (head > MY_TRACE_RING) ? head - MY_TRACE_RING : 0;
+        if (start < first) start = first;
+        for (uint64_t n = start; n < head; ++n)
+            copy[n - start] = r->slots[n % MY_TRACE_RING];
+        // the slots the thread wrote again meanwhile are
+        // garbage, and the one it may be writing now
+        uint64_t now = atomic_load_explicit(&r->head, memory_order_acquire) + 1;
+        uint64_t from = (now > MY_TRACE_RING) ? now - MY_TRACE_RING : 0;
+        if (from < start) from = start;
+        for (uint64_t n = from; n < head; ++n)
+        {
+            struct trace_slot* s = &copy[n - start];
+            fprintf(file, "%s\n{\"name\": \"%s\", \"cat\": \"myfs\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %u, "
+                "\"args\": {\"inode\": %u, \"bytes\": %llu}}",
+                written++ ? "," : "", names[s->event], s->begin / 1e3,
+                (s->end - s->begin) / 1e3, pid, s->tid, s->inode,
+                (unsigned long long) s->bytes);
+        }
+    }
+    pthread_mutex_unlock(&tracer.mutex);
+    fprintf(file, "\n]}\n");
+    free(copy);
+    return written;
+}
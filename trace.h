@@ -0,0 +1,81 @@
+#ifndef __H_MY_TRACE__
+#define __H_MY_TRACE__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+// events a thread keeps, the older ones are overwritten
+#define MY_TRACE_RING 16384
+
+/**
+ * The traced spans.
+ */
+enum my_trace_event
+{
+    MY_TRACE_READ,
+    MY_TRACE_WRITE,
+    MY_TRACE_ALLOC,
+    MY_TRACE_LINK,
+    MY_TRACE_UNLINK,
+    MY_TRACE_ERASE,
+    MY_TRACE_DUMP,
+    MY_TRACE_LOAD,
+    MY_TRACE_EVENTS
+};
+
+// true between `my_trace_start` and `my_trace_stop`
+extern _Atomic bool my_trace_on;
+
+static inline bool my_tracing()
+{
+    return atomic_load_explicit(&my_trace_on, memory_order_relaxed);
+}
+
+/**
+ * Trace the code between `MY_TRACE_BEGIN(t)` and
+ * `MY_TRACE_END(event, t, inode, bytes)`. When
+ * tracing is off it costs a load and a branch, build
+ * with `MY_FS_NO_TRACE` and it's gone.
+ */
+#ifdef MY_FS_NO_TRACE
+    #define MY_TRACE_BEGIN(t)
+    #define MY_TRACE_END(event, t, inode, bytes) ((void) 0)
+#else
+    #define MY_TRACE_BEGIN(t) uint64_t t = my_tracing() ? my_stat_now() : 0
+    #define MY_TRACE_END(event, t, inode, bytes) \
+        do { if (t) my_trace_record((event), (t), (inode), (bytes)); } while (0)
+#endif
+
+/**
+ * Put an event that began at `begin` and ends now in
+ * the ring of the calling thread. Only the thread
+ * writes its ring, so it takes no lock.
+ */
+void my_trace_record(
+    enum my_trace_event event, uint64_t begin, uint32_t inode, uint64_t bytes);
+
+/**
+ * Forget the events so far and start tracing.
+ */
+void my_trace_start();
+
+/**
+ * Stop tracing, the events are kept until the next
+ * start.
+ */
+void my_trace_stop();
+
+/**
+ * Write the events of all the threads to `file` in
+ * the Chrome trace format, for chrome://tracing or
+ * Perfetto. It can be called while tracing, events
+ * overwritten during the copy are dropped. Return
+ * the number of events written.
+ */
+uint64_t my_trace_save(FILE* file);
+
+#endif
@@ -1,8 +1,15 @@
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "utils.h"
 
+// the least max number of iovecs of a writev
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
 char* newstr(char* old, uint32_t size)
 {
     char* new;
@@ -19,9 +26,32 @@ char* newstr(char* old, uint32_t size)
 
 char* strappend(char* str, uint32_t* len, uint32_t* size, char ch)
 {
+    // doubled, long strings aren't copied over and over
     if (*len + 1 >= *size)
-        str = newstr(str, *size += 8);
+        str = newstr(str, *size = *size ? *size * 2 : 16);
     str[(*len)++] = ch;
     str[*len] = '\0';
     return str;
 }
+
+bool my_write_iov(int fd, struct iovec* iov, uint32_t count)
+{
+    while (count)
+    {
+        ssize_t w = writev(fd, iov, (count < IOV_MAX) ? count : IOV_MAX);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        while (count && (size_t) w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count)
+        {
+            iov->iov_base = (uint8_t*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
@@ -2,6 +2,8 @@
 #define __H_MY_UTILS__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 #ifdef _WIN32
     #define C_RED
@@ -28,4 +30,10 @@ char* strappend(
     char* str, uint32_t* len,
     uint32_t* size, char ch);
 
+/**
+ * Write all the iovecs to `fd`, `iov` is changed on
+ * a short write. Return false on error.
+ */
+bool my_write_iov(int fd, struct iovec* iov, uint32_t count);
+
 #endif